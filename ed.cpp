@@ -1,37 +1,179 @@
 #include <sys/time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#define GL_GLEXT_PROTOTYPES
 #include <GL/freeglut.h>
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
 #include <memory.h>
+#include <limits.h>
 
 // external interface
-void InitWindow();
+void InitWindow(const char *tilesetname);
+bool Image_IsImageFile(const char *filename);
+void Image_Open(const char *filename, int *w, int *h);
+const unsigned char *Image_Pixels();
+int Image_BeginStream(GLuint texture);
+bool Image_UpdateStream(int stream);
+void Minimap_InitWindow();
+void Minimap_Reset();
+void Minimap_UpdateCell(int x, int y);
+void Minimap_Redisplay();
+bool Indexed_Init();
+void Indexed_Reset();
+void Indexed_UpdateCell(int layer, int x, int y, int tile);
+bool Indexed_Draw(float x0, float y0, float x1, float y1, GLuint atlas, int tilew, int tileh, int animatedtile, float brightness);
+void Journal_Open(const char *mapname);
+bool Journal_Replay();
+void Journal_Reset();
+void Journal_Saved();
+void Journal_BeginGroup();
+void Journal_EndGroup();
+void Journal_Record(int layer, int x, int y, int oldtile, int newtile);
+void Journal_Undo();
+void Journal_Redo();
+void Journal_Update(unsigned int msecs);
+int Mem_Subsystem(const char *name);
+void Mem_Track(int subsystem, long long bytes);
+void *Mem_FrameAlloc(size_t size);
+void Mem_EndFrame();
+void Mem_Print();
+struct arena_t;
+arena_t *Arena_Create(const char *name, size_t blocksize);
+void *Arena_Alloc(arena_t *a, size_t size);
+void *Arena_Calloc(arena_t *a, size_t size);
+void Arena_Reset(arena_t *a);
+struct object_t;
+object_t *Objects_Place(float x, float y, int tile);
+void Objects_Remove(object_t *o);
+void Objects_Move(object_t *o, float x, float y);
+object_t *Objects_Pick(float x, float y);
+int Objects_Count();
+void Objects_Draw(float x0, float y0, float x1, float y1, GLuint atlas, int tilew, int tileh);
+void Objects_DrawSelection(object_t *o);
+bool Objects_Save(const char *mapname);
+void Objects_Load(const char *mapname);
+void Light_Init(const char *tilesetname);
+void Light_Rebuild();
+bool Light_UpdateCell(int x, int y, int oldtile, int newtile, int rect[4]);
+float Light_Level(int x, int y);
+void Path_Reset(int w, int h);
+void Path_CellChanged(int x, int y);
+int Path_Find(int sx, int sy, int gx, int gy);
+void Path_SetOrigin(int x, int y);
+bool Path_GetOrigin(int *x, int *y);
+void Path_ChunkReachability(int cx, int cy, unsigned char *cells);
+struct instance_t;
+void Prefab_Init(const char *tilesetname);
+void Prefab_Reset(int w, int h);
+void Prefab_CellChanged(int layer, int x, int y, int tile);
+int Prefab_Create(int x0, int y0, int x1, int y1);
+instance_t *Prefab_Place(int prefab, int x, int y);
+instance_t *Prefab_Pick(int x, int y);
+void Prefab_Remove(instance_t *inst);
+bool Prefab_EditCell(int layer, int x, int y, int tile);
+int Prefab_Count();
+int Prefab_NumInstances();
+void Prefab_Draw(float x0, float y0, float x1, float y1, int tilesize, instance_t *selected);
+bool Prefab_Save(const char *mapname);
+void Prefab_Load(const char *mapname);
 int GetSelectedTile();
+void TileUsed(int tile);
 void SelectUp();
 void SelectDown();
 void SelectLeft();
 void SelectRight();
 
 static bool drawgrid;
+static bool uselayercache = true;
+static bool useindexed;
+static bool uselighting;
+static bool showreachability;
+
+// clicks paint this collision class instead of tiles when it's set
+static const char classbrushes[] = "#.wlf";
+static int classbrush = -1;
+
+// clicks place and move objects instead of tiles
+static bool objectmode;
+static object_t *selectedobject;
+static bool draggingobject;
+
+// clicks place and pick prefab instances, ctrl and drag makes a new prefab
+static bool prefabmode;
+static int currentprefab;
+static instance_t *selectedinstance;
+static bool makingprefab;
+static int prefabrect[4];
+
+// painting over an instance changes its prefab instead of just that instance
+static bool editprefabs;
 
 // simulation timestep in msecs
 // eqv to 30 frames per second
 #define SIM_TIMESTEP	32
 #define TILE_SIZE	16
+#define TILE_MIP_LEVELS	4	// log2 of the tile size
+
+// this tile pulses in brightness
+#define ANIMATED_TILE	55
+
+// map dimensions are in tiles and a multiple of the chunk size
+// the map is split into square chunks for caching
+#define LEGACY_MAP_SIZE	16
+#define CHUNK_SIZE	16
+#define NUM_LAYERS	4
+
+// the view shows the map at twice its pixel size, each zoom step out
+// halves that
+#define VIEW_SCALE	2
+#define VIEW_SPEED	8
+#define MAX_VIEW_ZOOM	10
 
 static unsigned int realtime;
 static unsigned int simframe;
 static unsigned int simtime;
 
 // tileset info
+static const char *tilesetname = "tiles";
+static int tilesetstream = -1;
 static GLuint texobj[1];
 static int tilew;
 static int tileh;
 static int imagew;
 static int imageh;
 
+// the per tile tables, released whenever the tileset is analyzed again
+static arena_t *tilesetarena;
+
+// average colour of each tile
+static unsigned char (*tilecolors)[4];
+
+// how much of each tile covers what's beneath it
+enum opacity_t
+{
+	OPACITY_PARTIAL,
+	OPACITY_TRANSPARENT,
+	OPACITY_OPAQUE
+};
+
+static unsigned char *tileopacity;
+
+// view origin in map pixels
+static int viewx;
+static int viewy;
+static int viewzoom;
+static int windoww = 512;
+static int windowh = 512;
+
+// window pixels per map pixel
+static float ViewScale()
+{
+	return (float)VIEW_SCALE / (1 << viewzoom);
+}
+
 static void Error(const char *error, ...)
 {
 	va_list valist;
@@ -47,39 +189,84 @@ static void Error(const char *error, ...)
 	exit(1);
 }
 
-static int FileSize(FILE *fp)
+static off_t FileSize(FILE *fp)
 {
-	int curpos = ftell(fp);
-	fseek(fp, 0, SEEK_END);
-	int size = ftell(fp);
-	fseek(fp, curpos, SEEK_SET);
+	off_t curpos = ftello(fp);
+	fseeko(fp, 0, SEEK_END);
+	off_t size = ftello(fp);
+	fseeko(fp, curpos, SEEK_SET);
 
 	return size;
 }
 
-static int ReadFile(const char* filename, void **data)
+// the data is frame scratch memory and is gone at the end of the frame
+static size_t ReadFile(const char* filename, void **data)
 {
 	FILE *fp = fopen(filename, "rb");
 	if(!fp)
 		Error("Failed to open file \"%s\"\n", filename);
 
-	int size = FileSize(fp);
+	size_t size = FileSize(fp);
 
-	*data = malloc(size);
+	*data = Mem_FrameAlloc(size);
 	fread(*data, size, 1, fp);
 	fclose(fp);
 
 	return size;
 }
 
-static void WriteFile(const char *filename, void *data, int numbytes)
+static bool FileExists(const char *filename)
 {
-	FILE *fp = fopen(filename, "wb");
+	FILE *fp = fopen(filename, "rb");
 	if(!fp)
-		Error("Failed to open file \"%s\"\n", filename);
+		return false;
 
-	fwrite(data, numbytes, 1, fp);
 	fclose(fp);
+	return true;
+}
+
+// saves are written beside the file and renamed over it once they have
+// reached the disk, so a crash leaves either the old file or the new one.
+// the objects and prefabs save their side files this way too
+FILE *Sys_BeginWrite(const char *filename)
+{
+	char tempname[1100];
+	snprintf(tempname, sizeof(tempname), "%s.tmp", filename);
+
+	FILE *fp = fopen(tempname, "wb");
+	if (!fp)
+		fprintf(stderr, "Failed to open file \"%s\"\n", tempname);
+
+	return fp;
+}
+
+// returns false and leaves the old file alone if the new one didn't make it
+// to the disk
+bool Sys_EndWrite(FILE *fp, const char *filename)
+{
+	char tempname[1100];
+	snprintf(tempname, sizeof(tempname), "%s.tmp", filename);
+
+	bool ok = !fflush(fp) && !ferror(fp) && !fdatasync(fileno(fp));
+	ok = !fclose(fp) && ok;
+	if (!ok || rename(tempname, filename))
+	{
+		fprintf(stderr, "Failed to write file \"%s\"\n", filename);
+		unlink(tempname);
+		return false;
+	}
+
+	// the rename is only safe once the directory has reached the disk
+	char dirpath[1100];
+	snprintf(dirpath, sizeof(dirpath), "%s", filename);
+	int dirfd = open(dirname(dirpath), O_RDONLY | O_DIRECTORY);
+	if (dirfd >= 0)
+	{
+		fsync(dirfd);
+		close(dirfd);
+	}
+
+	return true;
 }
 
 static int KeyInt(const char *data, const char *key)
@@ -131,23 +318,154 @@ static void FlipRasterOrder(int imagew, int imageh, char* pixels)
 	}
 }
 
+// tiles stay sharp when magnified and are averaged when the view is zoomed
+// out. the mipmaps stop at one texel per tile, so each texel of every level
+// averages a single tile. sampling is nearest within the level, a linear
+// sample would blend in the neighbouring tiles
 static void MakeTexture(int imagew, int imageh, void *pixels)
 {
 	glGenTextures(1, texobj);
 	glBindTexture(GL_TEXTURE_2D, texobj[0]);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, imagew, imageh, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, TILE_MIP_LEVELS);
+	glGenerateMipmap(GL_TEXTURE_2D);
+}
+
+static void InvalidateAllLayerCaches();
+static void InvalidateAllLod();
+static void RebuildOccupancy();
+
+// pixels are in gl order with tile 0 at the bottom left
+static void ClassifyTileOpacity(const unsigned char *pixels)
+{
+	tileopacity = (unsigned char*)Arena_Alloc(tilesetarena, tilew * tileh);
+
+	for (int tile = 0; tile < tilew * tileh; tile++)
+	{
+		int x0 = (tile % tilew) * TILE_SIZE;
+		int y0 = (tile / tilew) * TILE_SIZE;
+		int minalpha = 255, maxalpha = 0;
+
+		for (int y = y0; y < y0 + TILE_SIZE; y++)
+		{
+			for (int x = x0; x < x0 + TILE_SIZE; x++)
+			{
+				int alpha = pixels[(y * imagew + x) * 4 + 3];
+				if (alpha < minalpha)
+					minalpha = alpha;
+				if (alpha > maxalpha)
+					maxalpha = alpha;
+			}
+		}
+
+		if (maxalpha == 0)
+			tileopacity[tile] = OPACITY_TRANSPARENT;
+		else if (minalpha == 255)
+			tileopacity[tile] = OPACITY_OPAQUE;
+		else
+			tileopacity[tile] = OPACITY_PARTIAL;
+	}
+}
+
+// tile 0 is always empty. until the tileset has loaded everything else is
+// treated as partially transparent so nothing gets culled
+static int TileOpacity(int tile)
+{
+	if (tile == 0)
+		return OPACITY_TRANSPARENT;
+	if (!tileopacity || tile < 0 || tile >= tilew * tileh)
+		return OPACITY_PARTIAL;
+
+	return tileopacity[tile];
+}
+
+static void ComputeTileColors(const unsigned char *pixels)
+{
+	tilecolors = (unsigned char(*)[4])Arena_Alloc(tilesetarena, tilew * tileh * 4);
+
+	for (int tile = 0; tile < tilew * tileh; tile++)
+	{
+		int x0 = (tile % tilew) * TILE_SIZE;
+		int y0 = (tile / tilew) * TILE_SIZE;
+		int sum[4] = { 0, 0, 0, 0 };
+
+		// colour is weighted by alpha so transparent texels don't darken it
+		for (int y = y0; y < y0 + TILE_SIZE; y++)
+		{
+			for (int x = x0; x < x0 + TILE_SIZE; x++)
+			{
+				const unsigned char *p = pixels + (y * imagew + x) * 4;
+				sum[0] += p[0] * p[3];
+				sum[1] += p[1] * p[3];
+				sum[2] += p[2] * p[3];
+				sum[3] += p[3];
+			}
+		}
+
+		for (int i = 0; i < 3; i++)
+			tilecolors[tile][i] = sum[3] ? sum[i] / sum[3] : 0;
+		tilecolors[tile][3] = sum[3] / (TILE_SIZE * TILE_SIZE);
+	}
+}
+
+static void AnalyzeTileset(const unsigned char *pixels)
+{
+	Arena_Reset(tilesetarena);
+	ClassifyTileOpacity(pixels);
+	ComputeTileColors(pixels);
+
+	RebuildOccupancy();
+	Minimap_Reset();
+}
+
+// tga and bmp tilesets are decoded in the background and streamed into the
+// texture a few rows at a time while the editor is running
+static void LoadTilesetImage()
+{
+	Image_Open(tilesetname, &imagew, &imageh);
+	tilew = imagew / TILE_SIZE;
+	tileh = imageh / TILE_SIZE;
+
+	MakeTexture(imagew, imageh, NULL);
+	tilesetstream = Image_BeginStream(texobj[0]);
+}
+
+static void UpdateTilesetStream()
+{
+	if (tilesetstream < 0)
+		return;
+
+	if (Image_UpdateStream(tilesetstream))
+	{
+		tilesetstream = -1;
+		AnalyzeTileset(Image_Pixels());
+	}
+
+	glBindTexture(GL_TEXTURE_2D, texobj[0]);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// cached layers hold whatever part of the tileset had arrived
+	InvalidateAllLayerCaches();
+	InvalidateAllLod();
 }
 
 static void LoadTileset()
 {
+	if (Image_IsImageFile(tilesetname))
+	{
+		LoadTilesetImage();
+		return;
+	}
+
 	char *buffer = NULL, *end = NULL;
 
 	// read the file
-	int numbytes = ReadFile("tiles", (void**)&buffer);
+	size_t numbytes = ReadFile(tilesetname, (void**)&buffer);
 	end = buffer + numbytes;
 
 	// decode the key data
@@ -166,210 +484,867 @@ static void LoadTileset()
 
 	FlipRasterOrder(imagew, imageh, buffer);
 	MakeTexture(imagew, imageh, (void*)buffer);
+	AnalyzeTileset((unsigned char*)buffer);
 }
 
 //________________________________________________________________________________
 // Graphics
-// the magic 16 constants here are all the map dimensions
 
 static int currentlayer;
 
 // called to place a tile
-static int layoutdata[1024];
+static const char *mapname = "maptiles.bin";
+static int mapw;
+static int maph;
+static int mapchunksx;
+static int mapchunksy;
+static int *layoutdata;
+
+// collision class of each cell, see the type flags below
+static char *mapclasses;
+
+static void InvalidateLayerCache(int layer, int tilenum);
+static void InvalidateChunkCaches(int chunk);
+static void FreeLayerCache();
+static void AllocLayerCache();
+static void InvalidateChunkRect(const int rect[4]);
+static void FreeLod();
+static void AllocLod();
+static void InvalidateLod(int chunk);
 
-static void WriteMapData()
+//
+// Occupancy
+// one bit per non-empty cell for each layer and chunk. tile 0 is the empty
+// tile so sparse layers can be walked a word at a time. the visibility and
+// opacity bits are kept the same way so cells hidden under an opaque tile on a
+// higher layer, or holding a fully transparent tile, are never drawn
+//
+
+#define CHUNK_CELLS	(CHUNK_SIZE * CHUNK_SIZE)
+#define CHUNK_WORDS	(CHUNK_CELLS / 64)
+
+typedef unsigned long long occword_t;
+
+static occword_t *occupancy;	// tile isn't empty
+static occword_t *visibility;	// tile isn't fully transparent
+static occword_t *opacity;	// tile is fully opaque
+
+static int NumChunks()
 {
-	WriteFile("maptiles.bin", layoutdata, sizeof(int) * sizeof(layoutdata));
+	return mapchunksx * mapchunksy;
 }
 
-static void ReadMapData()
+static occword_t *ChunkBits(occword_t *bits, int layer, int chunk)
 {
-	void *buffer;
-	ReadFile("maptiles.bin", &buffer);
-	memcpy(layoutdata, buffer, sizeof(layoutdata));
+	return bits + (layer * NumChunks() + chunk) * CHUNK_WORDS;
 }
 
-static void PlaceClick(int x, int y)
+static occword_t *ChunkOccupancy(int layer, int chunk)
 {
-	// 16 is the size of the map data
-	// fixme: need to handle the coordinate systems better
-	x /= 32;
-	y /= 32;
-	//printf("set tile x: %i, y: %i\n", x, y);
-	layoutdata[(currentlayer * 16 * 16) + (y * 16) + x] = GetSelectedTile();
+	return ChunkBits(occupancy, layer, chunk);
 }
 
-static int GetTileIndex(int layer, int tilenum)
+static int ChunkForTile(int tilenum)
 {
-	return layoutdata[(layer * 16 * 16) + tilenum];
+	int x = tilenum % mapw;
+	int y = tilenum / mapw;
+
+	return (y / CHUNK_SIZE) * mapchunksx + (x / CHUNK_SIZE);
 }
 
-static void ChangeLayer()
+// bit index of a tile within its chunk
+static int ChunkBitForTile(int tilenum)
 {
-	currentlayer = (currentlayer + 1) % 4;
-	printf("layer is %i\n", currentlayer);
-}
+	int x = tilenum % mapw;
+	int y = tilenum / mapw;
 
-// --------------------------------------------------------------------------------
-// Input
+	return (y % CHUNK_SIZE) * CHUNK_SIZE + (x % CHUNK_SIZE);
+}
 
-enum keyaction_t
+// tile number of a bit within a chunk
+static int TileForChunkBit(int chunk, int bit)
 {
-	ka_left,
-	ka_right,
-	ka_up,
-	ka_down,
-	ka_x,
-	ka_y,
-	NUM_KEY_ACTIONS
-};
+	int x = (chunk % mapchunksx) * CHUNK_SIZE + bit % CHUNK_SIZE;
+	int y = (chunk / mapchunksx) * CHUNK_SIZE + bit / CHUNK_SIZE;
 
-static bool keyactions[NUM_KEY_ACTIONS];
+	return y * mapw + x;
+}
 
-static void KeyDownFunc(unsigned char key, int x, int y)
+// returns true if the bit changed
+static bool SetChunkBit(occword_t *bits, int layer, int tilenum, bool set)
 {
-	if (key == 'x')
-		drawgrid = !drawgrid;
-	if (key == ' ')
-		ChangeLayer();
+	int bit = ChunkBitForTile(tilenum);
+	occword_t *word = &ChunkBits(bits, layer, ChunkForTile(tilenum))[bit / 64];
+	occword_t mask = 1ull << (bit % 64);
+	occword_t old = *word;
 
-	if (key == 'o')
-		ReadMapData();
-	if (key == 'p')
-		WriteMapData();
+	if (set)
+		*word |= mask;
+	else
+		*word &= ~mask;
 
-	if (key == 'j')
-		SelectRight();
-	if (key == 'y')
-		SelectUp();
-	if (key == 'g')
-		SelectLeft();
-	if (key == 'h')
-		SelectDown();
+	return *word != old;
 }
 
+// returns true if the cell's opacity changed
+static bool UpdateCellBits(int layer, int tilenum, int tile)
+{
+	int opaque = TileOpacity(tile);
 
+	SetChunkBit(occupancy, layer, tilenum, tile != 0);
+	SetChunkBit(visibility, layer, tilenum, opaque != OPACITY_TRANSPARENT);
+	return SetChunkBit(opacity, layer, tilenum, opaque == OPACITY_OPAQUE);
+}
 
-static void KeyUpFunc(unsigned char key, int x, int y)
+// nothing visible on the layer in this chunk
+static bool ChunkLayerEmpty(int layer, int chunk)
 {
-	if (key == 'a')
-		keyactions[ka_left] = false;
-	if (key == 'd')
-		keyactions[ka_right] = false;
-	if (key == 'w')
-		keyactions[ka_up] = false;
-	if (key == 's')
-		keyactions[ka_down] = false;
-	if (key == 'x')
-		keyactions[ka_x] = false;
-	if (key == 'z')
-		keyactions[ka_y] = false;
+	occword_t bits = 0;
+	for (int i = 0; i < CHUNK_WORDS; i++)
+		bits |= ChunkBits(visibility, layer, chunk)[i];
+
+	return bits == 0;
 }
 
+// cells of a layer that aren't hidden under an opaque tile on a higher layer
+static occword_t VisibleCells(int layer, int chunk, int word)
+{
+	occword_t covered = 0;
+	for (int i = layer + 1; i < NUM_LAYERS; i++)
+		covered |= ChunkBits(opacity, i, chunk)[word];
 
+	return ChunkBits(visibility, layer, chunk)[word] & ~covered;
+}
 
-static void SpecialDownFunc(int key, int x, int y)
+static void RebuildOccupancy()
 {
-	if (key == GLUT_KEY_LEFT)
-		keyactions[ka_left] = true;
-	if (key == GLUT_KEY_RIGHT)
-		keyactions[ka_right] = true;
-	if (key == GLUT_KEY_UP)
-		keyactions[ka_up] = true;
-	if (key == GLUT_KEY_DOWN)
-		keyactions[ka_down] = true;
+	if (!layoutdata)
+		return;
+
+	size_t numbytes = (size_t)NUM_LAYERS * NumChunks() * CHUNK_WORDS * sizeof(occword_t);
+	memset(occupancy, 0, numbytes);
+	memset(visibility, 0, numbytes);
+	memset(opacity, 0, numbytes);
+
+	for (int layer = 0; layer < NUM_LAYERS; layer++)
+		for (int i = 0; i < mapw * maph; i++)
+			if (layoutdata[(layer * mapw * maph) + i])
+				UpdateCellBits(layer, i, layoutdata[(layer * mapw * maph) + i]);
 }
 
+// computes the bounds of a layer's content in tiles, inclusive
+// only the occupancy words are visited so it is linear in the chunk count
+static bool LayerBounds(int layer, int *x0, int *y0, int *x1, int *y1)
+{
+	bool found = false;
+
+	for (int chunk = 0; chunk < NumChunks(); chunk++)
+	{
+		int rowmin = CHUNK_SIZE, rowmax = -1;
+		unsigned int columns = 0;
 
+		for (int i = 0; i < CHUNK_WORDS; i++)
+		{
+			occword_t word = ChunkOccupancy(layer, chunk)[i];
+			if (!word)
+				continue;
+
+			// each word holds 64 / CHUNK_SIZE rows of the chunk
+			int firstrow = (i * 64 + __builtin_ctzll(word)) / CHUNK_SIZE;
+			int lastrow = (i * 64 + 63 - __builtin_clzll(word)) / CHUNK_SIZE;
+			if (firstrow < rowmin)
+				rowmin = firstrow;
+			if (lastrow > rowmax)
+				rowmax = lastrow;
+
+			for (int j = 0; j < 64; j += CHUNK_SIZE)
+				columns |= (word >> j) & ((1u << CHUNK_SIZE) - 1);
+		}
 
-static void SpecialUpFunc(int key, int x, int y)
+		if (rowmax < 0)
+			continue;
+
+		int ox = (chunk % mapchunksx) * CHUNK_SIZE;
+		int oy = (chunk / mapchunksx) * CHUNK_SIZE;
+		int cx0 = ox + __builtin_ctz(columns);
+		int cx1 = ox + 31 - __builtin_clz(columns);
+		int cy0 = oy + rowmin;
+		int cy1 = oy + rowmax;
+
+		if (!found || cx0 < *x0)
+			*x0 = cx0;
+		if (!found || cy0 < *y0)
+			*y0 = cy0;
+		if (!found || cx1 > *x1)
+			*x1 = cx1;
+		if (!found || cy1 > *y1)
+			*y1 = cy1;
+		found = true;
+	}
+
+	return found;
+}
+
+static void PrintLayerBounds()
 {
-	if (key == GLUT_KEY_LEFT)
-		keyactions[ka_left] = false;
-	if (key == GLUT_KEY_RIGHT)
-		keyactions[ka_right] = false;
-	if (key == GLUT_KEY_UP)
-		keyactions[ka_up] = false;
-	if (key == GLUT_KEY_DOWN)
-		keyactions[ka_down] = false;
+	for (int layer = 0; layer < NUM_LAYERS; layer++)
+	{
+		int x0, y0, x1, y1;
+		if (LayerBounds(layer, &x0, &y0, &x1, &y1))
+			printf("layer %i bounds: %i %i - %i %i\n", layer, x0, y0, x1, y1);
+		else
+			printf("layer %i is empty\n", layer);
+	}
 }
 
-static void MouseFunc(int button, int state, int x, int y)
+static void LoadLegacyClasses(char *classes);
+
+// everything sized by the map is allocated from here and released together
+static arena_t *maparena;
+
+// cells are indexed with ints across all the layers, so the map has to fit
+// in that before any of its sizes are worked out
+static void CheckMapSize(int w, int h)
 {
-	//printf("x: %i, y: %i\n", x, y);
-	if (button == GLUT_LEFT_BUTTON && state == GLUT_UP)
-		PlaceClick(x, 512 - y);
+	if (w <= 0 || h <= 0 || w % CHUNK_SIZE || h % CHUNK_SIZE)
+		Error("Map size %ix%i is not a multiple of %i\n", w, h, CHUNK_SIZE);
+	if ((long long)NUM_LAYERS * w * h > INT_MAX)
+		Error("Map size %ix%i is too big, %i layers of it must fit in %i cells\n", w, h, NUM_LAYERS, INT_MAX);
 }
 
-static void MouseMotionFunc(int x, int y)
+static void AllocMap(int w, int h)
 {
-	PlaceClick(x, 512 - y);
+	CheckMapSize(w, h);
+
+	FreeLayerCache();
+	FreeLod();
+	Arena_Reset(maparena);
+
+	mapw = w;
+	maph = h;
+	mapchunksx = w / CHUNK_SIZE;
+	mapchunksy = h / CHUNK_SIZE;
+
+	size_t numcells = (size_t)w * h;
+	size_t occbytes = (size_t)NUM_LAYERS * NumChunks() * CHUNK_WORDS * sizeof(occword_t);
+	layoutdata = (int*)Arena_Calloc(maparena, NUM_LAYERS * numcells * sizeof(int));
+	occupancy = (occword_t*)Arena_Calloc(maparena, occbytes);
+	visibility = (occword_t*)Arena_Calloc(maparena, occbytes);
+	opacity = (occword_t*)Arena_Calloc(maparena, occbytes);
+
+	// the original map has its collision classes built in
+	mapclasses = (char*)Arena_Alloc(maparena, numcells);
+	if (w == LEGACY_MAP_SIZE && h == LEGACY_MAP_SIZE)
+		LoadLegacyClasses(mapclasses);
+	else
+		memset(mapclasses, '.', numcells);
+
+	AllocLayerCache();
+	AllocLod();
+	Light_Rebuild();
+	Path_Reset(w, h);
+	Prefab_Reset(w, h);
+	selectedinstance = NULL;
 }
 
-// --------------------------------------------------------------------------------
-// Game logic
+// the original 16x16 map is kept as the raw cell array. bigger maps have a
+// text header like the tileset followed by the cells and then the classes
+// mapw 256 maph 256 layers 4
+// data<cells><classes>
+static void WriteMapData()
+{
+	FILE *fp = Sys_BeginWrite(mapname);
+	if (!fp)
+		return;
 
-//
-// Map
-//
+	bool legacy = mapw == LEGACY_MAP_SIZE && maph == LEGACY_MAP_SIZE;
+	if (!legacy)
+		fprintf(fp, "mapw %i maph %i layers %i\ndata", mapw, maph, NUM_LAYERS);
+	fwrite(layoutdata, (size_t)NUM_LAYERS * mapw * maph * sizeof(int), 1, fp);
+	if (!legacy)
+		fwrite(mapclasses, (size_t)mapw * maph, 1, fp);
 
-#define LEFT	0
-#define RIGHT	1
-#define BOTTOMC	2
-#define BOTTOML 3
-#define BOTTOMR 4
-#define TOPC	5
-#define TOPL	6
-#define TOPR	7
+	// the side files describe the map, so they're only written once it's
+	// safely on disk. if any save failed the journal still has the edits
+	if (!Sys_EndWrite(fp, mapname))
+		return;
 
-static int offsets[][2] =
+	bool objectssaved = Objects_Save(mapname);
+	bool prefabssaved = Prefab_Save(mapname);
+	if (objectssaved && prefabssaved)
+		Journal_Saved();
+}
+
+static void ReadMapData()
 {
-	{ -4,  0 },
-	{  4,  0 },
-	{  0, -4 },
-	{ -4, -4 },
-	{  4, -4 },
-	{  0,  4 },
-	{ -4,  4 },
-	{  4,  4 }
-};
+	char *buffer = NULL, *end = NULL;
+	size_t numbytes = ReadFile(mapname, (void**)&buffer);
+	end = buffer + numbytes;
 
-// type flags
-#define	SOLID	(1 << 0)
-#define WATER	(1 << 1)
-#define LADDER  (1 << 2)
-#define FIELD   (1 << 3)
+	if (numbytes < 4 || memcmp(buffer, "mapw", 4))
+	{
+		size_t legacysize = NUM_LAYERS * LEGACY_MAP_SIZE * LEGACY_MAP_SIZE * sizeof(int);
+		if (numbytes < legacysize)
+			Error("Map file \"%s\" is too small\n", mapname);
 
-#if 0
-static const char map[] =
-"################" \
-"#wwwwwwwwwwwwww#" \
-"#wwwwwwwwwwwwww#" \
-"###########..###" \
-"#.............f#" \
-"#.1....11.....f#" \
-"#....111......f#" \
-"#.............f#" \
-"#.....111#####f#" \
-"#......l......f#" \
-"#......l......f#" \
-"#......l......f#" \
-"#######l##....f#" \
-"#......l......f#" \
-"#......l......f#" \
-"################";
-#endif
+		AllocMap(LEGACY_MAP_SIZE, LEGACY_MAP_SIZE);
+		memcpy(layoutdata, buffer, legacysize);
+	}
+	else
+	{
+		int w = KeyInt(buffer, "mapw");
+		int h = KeyInt(buffer, "maph");
+		if (KeyInt(buffer, "layers") != NUM_LAYERS)
+			Error("Map file \"%s\" doesn't have %i layers\n", mapname, NUM_LAYERS);
+
+		// search for the data block
+		char *data = buffer;
+		while(end - data >= 4 && memcmp("data", data, 4))
+			data++;
+		if (end - data < 4)
+			Error("Couldn't find data block");
+		data += 4;
+
+		CheckMapSize(w, h);
+		size_t classbytes = (size_t)w * h;
+		size_t cellbytes = NUM_LAYERS * classbytes * sizeof(int);
+		if ((size_t)(end - data) < cellbytes + classbytes)
+			Error("Map file \"%s\" is truncated\n", mapname);
+
+		AllocMap(w, h);
+		memcpy(layoutdata, data, cellbytes);
+		memcpy(mapclasses, data + cellbytes, classbytes);
+	}
 
-static const char map[] =
-"################" \
-"#wwwwwwwwwwwwww#" \
-"#wwwwwwwwwwwwww#" \
-"###########..###" \
-"#.............f#" \
-"#.1....11#####f#" \
-"#....111######f#" \
-"#.....11######f#" \
-"#.....111#####f#" \
+	printf("loaded %s, %ix%i\n", mapname, mapw, maph);
+
+	selectedobject = NULL;
+	draggingobject = false;
+	Objects_Load(mapname);
+	Prefab_Load(mapname);
+
+	RebuildOccupancy();
+	Light_Rebuild();
+	Path_Reset(mapw, maph);
+	Minimap_Reset();
+	Indexed_Reset();
+}
+
+static int GetTileIndex(int layer, int tilenum)
+{
+	return layoutdata[(layer * mapw * maph) + tilenum];
+}
+
+static void SetTileIndex(int layer, int tilenum, int tile)
+{
+	int *cell = &layoutdata[(layer * mapw * maph) + tilenum];
+	if (*cell == tile)
+		return;
+
+	int oldtile = *cell;
+	*cell = tile;
+	if (UpdateCellBits(layer, tilenum, tile))
+		InvalidateChunkCaches(ChunkForTile(tilenum));
+	else
+		InvalidateLayerCache(layer, tilenum);
+	InvalidateLod(ChunkForTile(tilenum));
+
+	// the light around an emitter or occluder has to be redone
+	int rect[4];
+	if (Light_UpdateCell(tilenum % mapw, tilenum / mapw, oldtile, tile, rect) && uselighting)
+		InvalidateChunkRect(rect);
+	Minimap_UpdateCell(tilenum % mapw, tilenum / mapw);
+	Indexed_UpdateCell(layer, tilenum % mapw, tilenum / mapw, tile);
+	Prefab_CellChanged(layer, tilenum % mapw, tilenum / mapw, tile);
+}
+
+// x and y are window pixels with the origin at the bottom left
+static void PlaceClick(int x, int y)
+{
+	x = ((int)(x / ViewScale()) + viewx) / TILE_SIZE;
+	y = ((int)(y / ViewScale()) + viewy) / TILE_SIZE;
+	if (x < 0 || x >= mapw || y < 0 || y >= maph)
+		return;
+
+	// class edits aren't journaled
+	if (classbrush >= 0)
+	{
+		char *cls = &mapclasses[y * mapw + x];
+		if (*cls != classbrushes[classbrush])
+		{
+			*cls = classbrushes[classbrush];
+			Path_CellChanged(x, y);
+		}
+		return;
+	}
+
+	//printf("set tile x: %i, y: %i\n", x, y);
+	int tilenum = y * mapw + x;
+	int tile = GetSelectedTile();
+
+	// prefab edits are journaled as one operation by the prefabs
+	if (editprefabs && Prefab_EditCell(currentlayer, x, y, tile))
+	{
+		TileUsed(tile);
+		return;
+	}
+
+	int oldtile = GetTileIndex(currentlayer, tilenum);
+	if (oldtile == tile)
+		return;
+
+	Journal_Record(currentlayer, x, y, oldtile, tile);
+	SetTileIndex(currentlayer, tilenum, tile);
+	TileUsed(tile);
+}
+
+// x and y are window pixels with the origin at the bottom left
+static void ObjectClick(int x, int y)
+{
+	float mapx = (float)x / ViewScale() + viewx;
+	float mapy = (float)y / ViewScale() + viewy;
+
+	// clicking empty space places a new object
+	selectedobject = Objects_Pick(mapx, mapy);
+	if (!selectedobject)
+	{
+		selectedobject = Objects_Place(mapx, mapy, GetSelectedTile());
+		TileUsed(GetSelectedTile());
+	}
+	draggingobject = true;
+}
+
+static void ObjectDrag(int x, int y)
+{
+	if (!draggingobject || !selectedobject)
+		return;
+
+	Objects_Move(selectedobject, (float)x / ViewScale() + viewx, (float)y / ViewScale() + viewy);
+}
+
+// x and y are window pixels with the origin at the bottom left. clicking an
+// instance picks it, clicking anywhere else places the current prefab there
+static void PrefabClick(int x, int y, bool make)
+{
+	x = ((int)(x / ViewScale()) + viewx) / TILE_SIZE;
+	y = ((int)(y / ViewScale()) + viewy) / TILE_SIZE;
+
+	if (make)
+	{
+		makingprefab = true;
+		prefabrect[0] = prefabrect[2] = x;
+		prefabrect[1] = prefabrect[3] = y;
+		return;
+	}
+
+	if (x < 0 || x >= mapw || y < 0 || y >= maph)
+		return;
+
+	selectedinstance = Prefab_Pick(x, y);
+	if (!selectedinstance)
+		selectedinstance = Prefab_Place(currentprefab, x, y);
+}
+
+static void PrefabDrag(int x, int y)
+{
+	if (!makingprefab)
+		return;
+
+	prefabrect[2] = ((int)(x / ViewScale()) + viewx) / TILE_SIZE;
+	prefabrect[3] = ((int)(y / ViewScale()) + viewy) / TILE_SIZE;
+}
+
+static void MakePrefab()
+{
+	makingprefab = false;
+
+	int prefab = Prefab_Create(prefabrect[0], prefabrect[1], prefabrect[2], prefabrect[3]);
+	if (prefab < 0)
+	{
+		printf("no prefab made\n");
+		return;
+	}
+
+	currentprefab = prefab;
+	selectedinstance = Prefab_Pick(prefabrect[0] < prefabrect[2] ? prefabrect[0] : prefabrect[2],
+		prefabrect[1] < prefabrect[3] ? prefabrect[1] : prefabrect[3]);
+	printf("made prefab %i\n", prefab);
+}
+
+unsigned int Sys_Milliseconds(void);
+
+// right click sets where paths start from, with ctrl it finds the path there
+static void PathClick(int x, int y, bool find)
+{
+	x = ((int)(x / ViewScale()) + viewx) / TILE_SIZE;
+	y = ((int)(y / ViewScale()) + viewy) / TILE_SIZE;
+	if (x < 0 || x >= mapw || y < 0 || y >= maph)
+		return;
+
+	int ox, oy;
+	if (!find || !Path_GetOrigin(&ox, &oy))
+	{
+		Path_SetOrigin(x, y);
+		printf("path origin %i %i\n", x, y);
+		return;
+	}
+
+	unsigned int start = Sys_Milliseconds();
+	int length = Path_Find(ox, oy, x, y);
+	unsigned int msecs = Sys_Milliseconds() - start;
+	if (length < 0)
+		printf("no path from %i %i to %i %i, %u ms\n", ox, oy, x, y, msecs);
+	else
+		printf("path from %i %i to %i %i is %i cells, %u ms\n", ox, oy, x, y, length, msecs);
+}
+
+static void RemoveSelectedInstance()
+{
+	if (!selectedinstance)
+		return;
+
+	Prefab_Remove(selectedinstance);
+	selectedinstance = NULL;
+}
+
+static void RemoveSelectedObject()
+{
+	if (!selectedobject)
+		return;
+
+	Objects_Remove(selectedobject);
+	selectedobject = NULL;
+	draggingobject = false;
+}
+
+static void LoadMap()
+{
+	ReadMapData();
+	Journal_Reset();
+}
+
+// replays the journal of an unsaved session over the last saved map
+static void RecoverMap()
+{
+	if (FileExists(mapname))
+		ReadMapData();
+
+	Journal_Replay();
+}
+
+static void ChangeLayer()
+{
+	currentlayer = (currentlayer + 1) % NUM_LAYERS;
+	printf("layer is %i\n", currentlayer);
+
+	// the layers above and below have changed
+	InvalidateAllLayerCaches();
+}
+
+// steps out when positive and in when negative, keeping the middle of the
+// view where it is. there's no zooming out once the whole map fits
+static void ZoomView(int step)
+{
+	int zoom = viewzoom + step;
+	if (zoom < 0 || zoom > MAX_VIEW_ZOOM)
+		return;
+	if (step > 0 && mapw * TILE_SIZE * ViewScale() <= windoww && maph * TILE_SIZE * ViewScale() <= windowh)
+		return;
+
+	float centerx = viewx + windoww / ViewScale() / 2;
+	float centery = viewy + windowh / ViewScale() / 2;
+	viewzoom = zoom;
+	viewx = centerx - windoww / ViewScale() / 2;
+	viewy = centery - windowh / ViewScale() / 2;
+
+	printf("zoom 1/%i\n", 1 << viewzoom);
+}
+
+// --------------------------------------------------------------------------------
+// Input
+
+enum keyaction_t
+{
+	ka_left,
+	ka_right,
+	ka_up,
+	ka_down,
+	ka_x,
+	ka_y,
+	NUM_KEY_ACTIONS
+};
+
+static bool keyactions[NUM_KEY_ACTIONS];
+
+static void KeyDownFunc(unsigned char key, int x, int y)
+{
+	if (key == 'x')
+		drawgrid = !drawgrid;
+	if (key == ' ')
+		ChangeLayer();
+	if (key == 'b')
+		PrintLayerBounds();
+	if (key == 'm')
+		Mem_Print();
+	if (key == 'l')
+	{
+		uselighting = !uselighting;
+		InvalidateAllLayerCaches();
+		InvalidateAllLod();
+		printf("lighting %s%s\n", uselighting ? "on" : "off", useindexed ? ", not shown by the indexed renderer" : "");
+	}
+	if (key == 'e')
+	{
+		objectmode = !objectmode;
+		prefabmode = false;
+		selectedobject = NULL;
+		printf("object mode %s, %i objects\n", objectmode ? "on" : "off", Objects_Count());
+	}
+	if (key == 'f')
+	{
+		prefabmode = !prefabmode;
+		objectmode = false;
+		selectedinstance = NULL;
+		makingprefab = false;
+		printf("prefab mode %s, %i prefabs, %i instances\n", prefabmode ? "on" : "off", Prefab_Count(), Prefab_NumInstances());
+	}
+	if (key == 't' && Prefab_Count())
+	{
+		currentprefab = (currentprefab + 1) % Prefab_Count();
+		printf("prefab %i\n", currentprefab);
+	}
+	if (key == 'v')
+	{
+		editprefabs = !editprefabs;
+		printf("painting over instances %s\n", editprefabs ? "edits their prefab" : "only changes that instance");
+	}
+	if (key == '-')
+		ZoomView(1);
+	if (key == '=' || key == '+')
+		ZoomView(-1);
+	if (key == 'k')
+	{
+		// off, then each class in turn
+		classbrush++;
+		if (!classbrushes[classbrush])
+			classbrush = -1;
+
+		if (classbrush < 0)
+			printf("class brush off\n");
+		else
+			printf("class brush '%c'\n", classbrushes[classbrush]);
+	}
+	if (key == 'n')
+	{
+		showreachability = !showreachability;
+		printf("reachability %s\n", showreachability ? "on" : "off");
+	}
+	if (key == 127 || key == 8)
+	{
+		if (prefabmode)
+			RemoveSelectedInstance();
+		else
+			RemoveSelectedObject();
+	}
+	if (key == 'i')
+	{
+		useindexed = !useindexed && Indexed_Init();
+		printf("indexed renderer %s\n", useindexed ? "on" : "off");
+	}
+	if (key == 'c')
+	{
+		uselayercache = !uselayercache;
+		printf("layer cache %s\n", uselayercache ? "on" : "off");
+	}
+
+	if (key == 'o')
+		LoadMap();
+	if (key == 'p')
+		WriteMapData();
+	// undo and redo can take the selected instance away
+	if (key == 'u')
+	{
+		Journal_Undo();
+		selectedinstance = NULL;
+	}
+	if (key == 'r')
+	{
+		Journal_Redo();
+		selectedinstance = NULL;
+	}
+
+	if (key == 'j')
+		SelectRight();
+	if (key == 'y')
+		SelectUp();
+	if (key == 'g')
+		SelectLeft();
+	if (key == 'h')
+		SelectDown();
+}
+
+
+
+static void KeyUpFunc(unsigned char key, int x, int y)
+{
+	if (key == 'a')
+		keyactions[ka_left] = false;
+	if (key == 'd')
+		keyactions[ka_right] = false;
+	if (key == 'w')
+		keyactions[ka_up] = false;
+	if (key == 's')
+		keyactions[ka_down] = false;
+	if (key == 'x')
+		keyactions[ka_x] = false;
+	if (key == 'z')
+		keyactions[ka_y] = false;
+}
+
+
+
+static void SpecialDownFunc(int key, int x, int y)
+{
+	if (key == GLUT_KEY_LEFT)
+		keyactions[ka_left] = true;
+	if (key == GLUT_KEY_RIGHT)
+		keyactions[ka_right] = true;
+	if (key == GLUT_KEY_UP)
+		keyactions[ka_up] = true;
+	if (key == GLUT_KEY_DOWN)
+		keyactions[ka_down] = true;
+}
+
+
+
+static void SpecialUpFunc(int key, int x, int y)
+{
+	if (key == GLUT_KEY_LEFT)
+		keyactions[ka_left] = false;
+	if (key == GLUT_KEY_RIGHT)
+		keyactions[ka_right] = false;
+	if (key == GLUT_KEY_UP)
+		keyactions[ka_up] = false;
+	if (key == GLUT_KEY_DOWN)
+		keyactions[ka_down] = false;
+}
+
+static void MouseFunc(int button, int state, int x, int y)
+{
+	//printf("x: %i, y: %i\n", x, y);
+	if (button == GLUT_RIGHT_BUTTON && state == GLUT_DOWN)
+	{
+		PathClick(x, windowh - y, glutGetModifiers() & GLUT_ACTIVE_CTRL);
+		return;
+	}
+
+	if (objectmode)
+	{
+		if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN)
+			ObjectClick(x, windowh - y);
+		if (button == GLUT_LEFT_BUTTON && state == GLUT_UP)
+			draggingobject = false;
+		return;
+	}
+
+	if (prefabmode)
+	{
+		if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN)
+			PrefabClick(x, windowh - y, glutGetModifiers() & GLUT_ACTIVE_CTRL);
+		if (button == GLUT_LEFT_BUTTON && state == GLUT_UP && makingprefab)
+			MakePrefab();
+		return;
+	}
+
+	// a click and drag is undone as one
+	if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN)
+		Journal_BeginGroup();
+	if (button == GLUT_LEFT_BUTTON && state == GLUT_UP)
+	{
+		PlaceClick(x, windowh - y);
+		Journal_EndGroup();
+	}
+}
+
+static void MouseWheelFunc(int wheel, int direction, int x, int y)
+{
+	ZoomView(direction > 0 ? -1 : 1);
+}
+
+static void MouseMotionFunc(int x, int y)
+{
+	if (objectmode)
+		ObjectDrag(x, windowh - y);
+	else if (prefabmode)
+		PrefabDrag(x, windowh - y);
+	else
+		PlaceClick(x, windowh - y);
+}
+
+// --------------------------------------------------------------------------------
+// Game logic
+
+//
+// Map
+//
+
+#define LEFT	0
+#define RIGHT	1
+#define BOTTOMC	2
+#define BOTTOML 3
+#define BOTTOMR 4
+#define TOPC	5
+#define TOPL	6
+#define TOPR	7
+
+static int offsets[][2] =
+{
+	{ -4,  0 },
+	{  4,  0 },
+	{  0, -4 },
+	{ -4, -4 },
+	{  4, -4 },
+	{  0,  4 },
+	{ -4,  4 },
+	{  4,  4 }
+};
+
+// type flags
+#define	SOLID	(1 << 0)
+#define WATER	(1 << 1)
+#define LADDER  (1 << 2)
+#define FIELD   (1 << 3)
+
+#if 0
+static const char map[] =
+"################" \
+"#wwwwwwwwwwwwww#" \
+"#wwwwwwwwwwwwww#" \
+"###########..###" \
+"#.............f#" \
+"#.1....11.....f#" \
+"#....111......f#" \
+"#.............f#" \
+"#.....111#####f#" \
+"#......l......f#" \
+"#......l......f#" \
+"#......l......f#" \
+"#######l##....f#" \
+"#......l......f#" \
+"#......l......f#" \
+"################";
+#endif
+
+static const char map[] =
+"################" \
+"#wwwwwwwwwwwwww#" \
+"#wwwwwwwwwwwwww#" \
+"###########..###" \
+"#.............f#" \
+"#.1....11#####f#" \
+"#....111######f#" \
+"#.....11######f#" \
+"#.....111#####f#" \
 "#......l......f#" \
 "#......l......f#" \
 "#......l......f#" \
@@ -378,119 +1353,519 @@ static const char map[] =
 "#......l......f#" \
 "################";
 
-// measured in tiles
-static char Map_Tile(float x, float y)
+static void LoadLegacyClasses(char *classes)
+{
+	memcpy(classes, map, LEGACY_MAP_SIZE * LEGACY_MAP_SIZE);
+}
+
+// measured in tiles
+static char Map_Tile(float x, float y)
+{
+	int xx = x / 16;
+	int yy = y / 16;
+
+	int addr = yy * mapw + xx;
+	return mapclasses[addr];
+}
+
+
+
+// --------------------------------------------------------------------------------
+// Rendering
+
+static float *LookupColor(int x, int y)
+{
+	static float colors[6][3] =
+	{
+		{ 1, 0, 0 },
+		{ 0, 0, 1 },
+		{ 1, 1, 1 },
+		{ 1, 1, 0 },
+		{ 0, 1, 1 },
+		{ 0.5, 0, 0 },
+	};
+
+	char tile = Map_Tile(x, y);
+	if (tile == '#')
+		return colors[0];
+	else if (tile == 'w')
+		return colors[1];
+	else if (tile == 'l')
+		return colors[3];
+	else if (tile == 'f')
+		return colors[4];
+	else if (tile == '1')
+		return colors[5];
+	else
+		return colors[2];
+}
+
+static void DrawCrosshair(int x, int y)
+{
+	static int s = 2;
+
+	glBegin(GL_LINES);
+	glColor3f(0, 0, 0);
+	glVertex2f(x - s, y);
+	glVertex2f(x + s, y);
+	glVertex2f(x, y - s);
+	glVertex2f(x, y + s);
+	glEnd();
+}
+
+// the range of chunks overlapping the view, inclusive
+static void VisibleChunks(int *cx0, int *cy0, int *cx1, int *cy1)
+{
+	int chunkpixels = CHUNK_SIZE * TILE_SIZE;
+	int vieww = windoww / ViewScale();
+	int viewh = windowh / ViewScale();
+
+	*cx0 = viewx / chunkpixels;
+	*cy0 = viewy / chunkpixels;
+	*cx1 = (viewx + vieww - 1) / chunkpixels;
+	*cy1 = (viewy + viewh - 1) / chunkpixels;
+
+	if (*cx0 < 0)
+		*cx0 = 0;
+	if (*cy0 < 0)
+		*cy0 = 0;
+	if (*cx1 > mapchunksx - 1)
+		*cx1 = mapchunksx - 1;
+	if (*cy1 > mapchunksy - 1)
+		*cy1 = mapchunksy - 1;
+}
+
+// coordinate system is in pixels
+// the rectangle being dragged out for a new prefab
+static void DrawPrefabRect()
+{
+	if (!makingprefab)
+		return;
+
+	float x0 = (prefabrect[0] < prefabrect[2] ? prefabrect[0] : prefabrect[2]) * TILE_SIZE;
+	float y0 = (prefabrect[1] < prefabrect[3] ? prefabrect[1] : prefabrect[3]) * TILE_SIZE;
+	float x1 = ((prefabrect[0] > prefabrect[2] ? prefabrect[0] : prefabrect[2]) + 1) * TILE_SIZE;
+	float y1 = ((prefabrect[1] > prefabrect[3] ? prefabrect[1] : prefabrect[3]) + 1) * TILE_SIZE;
+
+	glColor3f(0, 1, 0);
+	glBegin(GL_LINE_LOOP);
+	glVertex2f(x0, y0);
+	glVertex2f(x1, y0);
+	glVertex2f(x1, y1);
+	glVertex2f(x0, y1);
+	glEnd();
+}
+
+static void DrawGrid()
+{
+	if (!drawgrid)
+		return;
+
+	int cx0, cy0, cx1, cy1;
+	VisibleChunks(&cx0, &cy0, &cx1, &cy1);
+
+	for (int x = cx0 * CHUNK_SIZE; x <= (cx1 + 1) * CHUNK_SIZE; x++)
+	{
+		for (int y = cy0 * CHUNK_SIZE; y <= (cy1 + 1) * CHUNK_SIZE; y++)
+		{
+			// convert from tile coordinates to screen coordinates
+			DrawCrosshair(x * 16, y * 16);
+		}
+	}
+}
+
+// tints the passable cells of the visible chunks green where they can be
+// walked to from the path origin and red where they can't
+static void DrawReachability()
+{
+	if (!showreachability)
+		return;
+
+	int cx0, cy0, cx1, cy1;
+	VisibleChunks(&cx0, &cy0, &cx1, &cy1);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glBegin(GL_QUADS);
+
+	unsigned char cells[CHUNK_SIZE * CHUNK_SIZE];
+	for (int cy = cy0; cy <= cy1; cy++)
+	{
+		for (int cx = cx0; cx <= cx1; cx++)
+		{
+			Path_ChunkReachability(cx, cy, cells);
+
+			for (int i = 0; i < CHUNK_SIZE * CHUNK_SIZE; i++)
+			{
+				if (!cells[i])
+					continue;
+
+				if (cells[i] == 2)
+					glColor4f(0, 1, 0, 0.3f);
+				else
+					glColor4f(1, 0, 0, 0.3f);
+
+				int x = (cx * CHUNK_SIZE + i % CHUNK_SIZE) * TILE_SIZE;
+				int y = (cy * CHUNK_SIZE + i / CHUNK_SIZE) * TILE_SIZE;
+				glVertex2f(x, y);
+				glVertex2f(x + TILE_SIZE, y);
+				glVertex2f(x + TILE_SIZE, y + TILE_SIZE);
+				glVertex2f(x, y + TILE_SIZE);
+			}
+		}
+	}
+
+	glEnd();
+	glDisable(GL_BLEND);
+
+	int ox, oy;
+	if (Path_GetOrigin(&ox, &oy))
+	{
+		glColor3f(0, 0, 0);
+		glBegin(GL_LINE_LOOP);
+		glVertex2f(ox * TILE_SIZE + 2, oy * TILE_SIZE + 2);
+		glVertex2f(ox * TILE_SIZE + TILE_SIZE - 2, oy * TILE_SIZE + 2);
+		glVertex2f(ox * TILE_SIZE + TILE_SIZE - 2, oy * TILE_SIZE + TILE_SIZE - 2);
+		glVertex2f(ox * TILE_SIZE + 2, oy * TILE_SIZE + TILE_SIZE - 2);
+		glEnd();
+	}
+
+	glColor3f(1, 1, 1);
+}
+
+static bool IsAnimatedTile(int tile)
+{
+	return tile == ANIMATED_TILE;
+}
+
+static float AnimatedTileBrightness()
+{
+	float color = (float)(simframe & 127) / 128.0f;
+	color = 0.5f * sin(2.0f * 3.1415f * color) + 0.5f;
+	//color += 0.5f;
+	return color;
+}
+
+static void DrawTileTextured(int layer, int x, int y, float color[3])
+{
+	// tilew, and tileh are the count of the tiles, not the tile size
+	const float size = TILE_SIZE;
+	const float tcsizex = 1.0f / tilew;
+	const float tcsizey = 1.0f / tileh;
+
+	int tileaddr = GetTileIndex(layer, y * mapw + x);
+	float tcx = tileaddr % tilew;
+	float tcy = tileaddr / tilew;
+	tcx *= tcsizex;
+	tcy *= tcsizey;
+
+	float light = uselighting ? Light_Level(x, y) : 1;
+	if (!IsAnimatedTile(tileaddr))
+		glColor3f(light, light, light);
+	else
+	{
+		float color = AnimatedTileBrightness() * light;
+		glColor3f(color, color, color);
+	}
+
+	x *= size;
+	y *= size;
+
+	glBegin(GL_TRIANGLE_STRIP);
+	glTexCoord2f(tcx, tcy);
+	glVertex2f(x + 0.0f, y + 0.0f);
+
+	glTexCoord2f(tcx + tcsizex, tcy);
+	glVertex2f(x + size, y + 0.0f);
+
+	glTexCoord2f(tcx, tcy + tcsizey);
+	glVertex2f(x + 0.0f, y + size);
+
+	glTexCoord2f(tcx + tcsizex, tcy + tcsizey);
+	glVertex2f(x + size, y + size);
+	glEnd();
+}
+
+static void DrawTile(int layer, int x, int y, float color[3])
+{
+	DrawTileTextured(layer, x, y, color);
+}
+
+// texture and blend state is set once by the caller rather than per tile
+static void BeginTileDraw()
+{
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, texobj[0]);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+static void EndTileDraw()
+{
+	glDisable(GL_TEXTURE_2D);
+	glDisable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ZERO);
+}
+
+// empty, transparent and covered cells are skipped a word at a time
+static void DrawLayerChunk(int layer, int cx, int cy)
+{
+	int chunk = cy * mapchunksx + cx;
+
+	for (int i = 0; i < CHUNK_WORDS; i++)
+	{
+		occword_t word = VisibleCells(layer, chunk, i);
+
+		while (word)
+		{
+			int tilenum = TileForChunkBit(chunk, i * 64 + __builtin_ctzll(word));
+			int x = tilenum % mapw;
+			int y = tilenum / mapw;
+			word &= word - 1;
+
+			float *c = LookupColor(x * 16, y * 16);
+
+			DrawTile(layer, x, y, c);
+		}
+	}
+}
+
+static void DrawLayer(int layer)
+{
+	int cx0, cy0, cx1, cy1;
+	VisibleChunks(&cx0, &cy0, &cx1, &cy1);
+
+	BeginTileDraw();
+
+	for (int cy = cy0; cy <= cy1; cy++)
+		for (int cx = cx0; cx <= cx1; cx++)
+			DrawLayerChunk(layer, cx, cy);
+
+	EndTileDraw();
+}
+
+//
+// Layer cache
+// the layers below and above the current layer don't change while editing so
+// they are flattened into a texture per chunk. each frame then draws two quads
+// per chunk plus the live layer, however many layers there are. the render
+// targets are only created for chunks that have been in view
+//
+
+#define CHUNK_PIXELS	(CHUNK_SIZE * TILE_SIZE)
+
+enum
+{
+	CACHE_BELOW,
+	CACHE_ABOVE,
+	NUM_CACHES
+};
+
+struct layercache_t
+{
+	GLuint fbo;
+	GLuint texture;
+	bool dirty;
+	bool animated;	// holds a tile which changes every frame
+};
+
+// NUM_CACHES entries per chunk
+static layercache_t *layercache;
+static int numlayercaches;
+
+// the render targets are counted against this
+static int layercachememory = -1;
+
+static layercache_t *GetLayerCache(int chunk, int cache)
+{
+	return &layercache[chunk * NUM_CACHES + cache];
+}
+
+// called before the map arena is released
+static void FreeLayerCache()
+{
+	for (int i = 0; i < numlayercaches; i++)
+	{
+		if (!layercache[i].fbo)
+			continue;
+
+		glDeleteFramebuffers(1, &layercache[i].fbo);
+		glDeleteTextures(1, &layercache[i].texture);
+		Mem_Track(layercachememory, -CHUNK_PIXELS * CHUNK_PIXELS * 4);
+	}
+
+	layercache = NULL;
+	numlayercaches = 0;
+}
+
+// called whenever the map is resized
+static void AllocLayerCache()
+{
+	numlayercaches = NumChunks() * NUM_CACHES;
+	layercache = (layercache_t*)Arena_Calloc(maparena, numlayercaches * sizeof(layercache_t));
+}
+
+// a square texture that can be drawn into
+static void CreateRenderTarget(GLuint *fbo, GLuint *texture, int size, GLint filter)
 {
-	int xx = x / 16;
-	int yy = y / 16;
+	glGenTextures(1, texture);
+	glBindTexture(GL_TEXTURE_2D, *texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-	int addr = yy * 16 + xx;
-	return map[addr];
-}
+	glGenFramebuffers(1, fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, *fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, *texture, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		Error("Render target framebuffer incomplete\n");
 
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
 
+static void CreateLayerCache(layercache_t *lc)
+{
+	CreateRenderTarget(&lc->fbo, &lc->texture, CHUNK_PIXELS, GL_NEAREST);
+	if (layercachememory < 0)
+		layercachememory = Mem_Subsystem("layer cache");
+	Mem_Track(layercachememory, CHUNK_PIXELS * CHUNK_PIXELS * 4);
 
-// --------------------------------------------------------------------------------
-// Rendering
+	lc->dirty = true;
+}
 
-static float *LookupColor(int x, int y)
+static void InvalidateLayerCache(int layer, int tilenum)
 {
-	static float colors[6][3] =
-	{
-		{ 1, 0, 0 },
-		{ 0, 0, 1 },
-		{ 1, 1, 1 },
-		{ 1, 1, 0 },
-		{ 0, 1, 1 },
-		{ 0.5, 0, 0 },
-	};
+	int chunk = ChunkForTile(tilenum);
 
-	char tile = Map_Tile(x, y);
-	if (tile == '#')
-		return colors[0];
-	else if (tile == 'w')
-		return colors[1];
-	else if (tile == 'l')
-		return colors[3];
-	else if (tile == 'f')
-		return colors[4];
-	else if (tile == '1')
-		return colors[5];
-	else
-		return colors[2];
+	// edits to the live layer are drawn directly
+	if (layer < currentlayer)
+		GetLayerCache(chunk, CACHE_BELOW)->dirty = true;
+	else if (layer > currentlayer)
+		GetLayerCache(chunk, CACHE_ABOVE)->dirty = true;
 }
 
-static void DrawCrosshair(int x, int y)
+// a change in opacity culls or uncovers cells on other layers
+static void InvalidateChunkCaches(int chunk)
 {
-	static int s = 2;
+	for (int i = 0; i < NUM_CACHES; i++)
+		GetLayerCache(chunk, i)->dirty = true;
+}
 
-	glBegin(GL_LINES);
-	glColor3f(0, 0, 0);
-	glVertex2f(x - s, y);
-	glVertex2f(x + s, y);
-	glVertex2f(x, y - s);
-	glVertex2f(x, y + s);
-	glEnd();
+// rect is in cells, inclusive
+static void InvalidateChunkRect(const int rect[4])
+{
+	for (int cy = rect[1] / CHUNK_SIZE; cy <= rect[3] / CHUNK_SIZE; cy++)
+	{
+		for (int cx = rect[0] / CHUNK_SIZE; cx <= rect[2] / CHUNK_SIZE; cx++)
+		{
+			InvalidateChunkCaches(cy * mapchunksx + cx);
+			InvalidateLod(cy * mapchunksx + cx);
+		}
+	}
 }
 
-// coordinate system is in pixels
-static void DrawGrid()
+static void InvalidateAllLayerCaches()
 {
-	if (!drawgrid)
-		return;
+	for (int i = 0; i < numlayercaches; i++)
+		layercache[i].dirty = true;
+}
 
-	for (int x = 0; x <= 16; x++)
+static bool ChunkHasAnimatedTile(int layer, int chunk)
+{
+	for (int i = 0; i < CHUNK_WORDS; i++)
 	{
-		for (int y = 0; y <= 16; y++)
+		for (occword_t word = ChunkOccupancy(layer, chunk)[i]; word; word &= word - 1)
 		{
-			// convert from tile coordinates to screen coordinates
-			DrawCrosshair(x * 16, y * 16);
+			int tilenum = TileForChunkBit(chunk, i * 64 + __builtin_ctzll(word));
+			if (IsAnimatedTile(GetTileIndex(layer, tilenum)))
+				return true;
 		}
 	}
+
+	return false;
 }
 
-static void DrawTileTextured(int layer, int x, int y, float color[3])
+// points drawing at a render target covering the map pixels x, y to
+// x + mapsize, y + mapsize and clears it
+static void BeginRenderTarget(GLuint fbo, int size, float x, float y, float mapsize)
 {
-	// tilew, and tileh are the count of the tiles, not the tile size
-	const float size = TILE_SIZE;
-	const float tcsizex = 1.0f / tilew;
-	const float tcsizey = 1.0f / tileh;
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glPushAttrib(GL_VIEWPORT_BIT | GL_COLOR_BUFFER_BIT);
+	glViewport(0, 0, size, size);
 
-	int tileaddr = GetTileIndex(layer, y * 16 + x);
-	float tcx = tileaddr % tilew;
-	float tcy = tileaddr / tilew;
-	tcx *= tcsizex;
-	tcy *= tcsizey;
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	glOrtho(x, x + mapsize, y, y + mapsize, -1, 1);
+	glMatrixMode(GL_MODELVIEW);
 
-	if (tileaddr != 55)
-		glColor3f(1, 1, 1);
-	else
+	glClearColor(0, 0, 0, 0);
+	glClear(GL_COLOR_BUFFER_BIT);
+}
+
+static void EndRenderTarget()
+{
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPopAttrib();
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// draws the layers of the chunk into the current render target. returns
+// true if any of them holds an animated tile
+static bool RenderChunkLayers(int cx, int cy, int firstlayer, int lastlayer)
+{
+	// accumulate premultiplied colour so the result composites with a single
+	// blend exactly as the individual layers would have
+	BeginTileDraw();
+	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	bool animated = false;
+	for (int layer = firstlayer; layer <= lastlayer; layer++)
 	{
-		float color = (float)(simframe & 127) / 128.0f;
-		color = 0.5f * sin(2.0f * 3.1415f * color) + 0.5f;
-		//color += 0.5f;
-		glColor3f(color, color, color);
+		DrawLayerChunk(layer, cx, cy);
+		animated |= ChunkHasAnimatedTile(layer, cy * mapchunksx + cx);
 	}
 
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, texobj[0]);
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	EndTileDraw();
+	return animated;
+}
 
-	x *= size;
-	y *= size;
+static void FlattenLayers(int chunk, int cache, int firstlayer, int lastlayer)
+{
+	layercache_t *lc = GetLayerCache(chunk, cache);
+	int cx = chunk % mapchunksx;
+	int cy = chunk / mapchunksx;
 
-	glBegin(GL_TRIANGLE_STRIP);
-	glTexCoord2f(tcx, tcy);
-	glVertex2f(x + 0.0f, y + 0.0f);
+	BeginRenderTarget(lc->fbo, CHUNK_PIXELS, cx * CHUNK_PIXELS, cy * CHUNK_PIXELS, CHUNK_PIXELS);
+	lc->animated = RenderChunkLayers(cx, cy, firstlayer, lastlayer);
+	EndRenderTarget();
 
-	glTexCoord2f(tcx + tcsizex, tcy);
-	glVertex2f(x + size, y + 0.0f);
+	lc->dirty = false;
+}
 
-	glTexCoord2f(tcx, tcy + tcsizey);
-	glVertex2f(x + 0.0f, y + size);
+// draws a premultiplied render target over the map pixels x, y to x + size,
+// y + size
+static void DrawRenderTarget(GLuint texture, float x, float y, float size)
+{
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glColor3f(1, 1, 1);
 
-	glTexCoord2f(tcx + tcsizex, tcy + tcsizey);
+	glBegin(GL_TRIANGLE_STRIP);
+	glTexCoord2f(0.0f, 0.0f);
+	glVertex2f(x, y);
+	glTexCoord2f(1.0f, 0.0f);
+	glVertex2f(x + size, y);
+	glTexCoord2f(0.0f, 1.0f);
+	glVertex2f(x, y + size);
+	glTexCoord2f(1.0f, 1.0f);
 	glVertex2f(x + size, y + size);
 	glEnd();
 
@@ -499,42 +1874,270 @@ static void DrawTileTextured(int layer, int x, int y, float color[3])
 	glBlendFunc(GL_ONE, GL_ZERO);
 }
 
-static void DrawTile(int layer, int x, int y, float color[3])
+static void DrawCachedChunk(int chunk, int cache)
 {
-	DrawTileTextured(layer, x, y, color);
+	float x = (chunk % mapchunksx) * CHUNK_PIXELS;
+	float y = (chunk / mapchunksx) * CHUNK_PIXELS;
+
+	DrawRenderTarget(GetLayerCache(chunk, cache)->texture, x, y, CHUNK_PIXELS);
 }
 
-static void DrawLayer(int layer)
+static void DrawCachedLayers(int chunk, int cache, int firstlayer, int lastlayer)
 {
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	if (firstlayer > lastlayer)
+		return;
+
+	// nothing to composite if every cached layer is empty here
+	bool empty = true;
+	for (int layer = firstlayer; layer <= lastlayer; layer++)
+		empty &= ChunkLayerEmpty(layer, chunk);
+	if (empty)
+		return;
+
+	layercache_t *lc = GetLayerCache(chunk, cache);
+	if (!lc->fbo)
+		CreateLayerCache(lc);
+
+	// animated tiles are baked into the cache so it has to be redrawn
+	if (lc->dirty || lc->animated)
+		FlattenLayers(chunk, cache, firstlayer, lastlayer);
+
+	DrawCachedChunk(chunk, cache);
+}
+
+//
+// Level of detail
+// zoomed out, the map is drawn from a pyramid of small images instead of
+// tiles. a node on level 0 is one chunk with every layer flattened into it,
+// and a node on each level above is its four children shrunk into the same
+// size. the view draws the level whose nodes come out the size of their
+// image, so the whole map costs about as many quads as a screen of chunks.
+// an edit marks its chunk's node and everything above it, and nodes are
+// only redrawn and created when they're next in view
+//
+
+#define LOD_PIXELS	64
+#define MAX_LOD_LEVELS	12
+
+struct lodnode_t
+{
+	GLuint fbo;
+	GLuint texture;
+	bool dirty;
+};
+
+struct lodlevel_t
+{
+	lodnode_t *nodes;
+	int nodesx;
+	int nodesy;
+};
+
+static lodlevel_t lodlevels[MAX_LOD_LEVELS];
+static int numlodlevels;
+
+static int lodmemory = -1;
+
+static lodnode_t *GetLodNode(int level, int x, int y)
+{
+	return &lodlevels[level].nodes[y * lodlevels[level].nodesx + x];
+}
+
+// called before the map arena is released
+static void FreeLod()
+{
+	for (int level = 0; level < numlodlevels; level++)
+	{
+		lodlevel_t *l = &lodlevels[level];
+		for (int i = 0; i < l->nodesx * l->nodesy; i++)
+		{
+			if (!l->nodes[i].fbo)
+				continue;
+
+			glDeleteFramebuffers(1, &l->nodes[i].fbo);
+			glDeleteTextures(1, &l->nodes[i].texture);
+			Mem_Track(lodmemory, -LOD_PIXELS * LOD_PIXELS * 4);
+		}
+	}
+
+	numlodlevels = 0;
+}
+
+// levels are added until one node covers the map
+static void AllocLod()
+{
+	int nodesx = mapchunksx;
+	int nodesy = mapchunksy;
+
+	for (numlodlevels = 0; numlodlevels < MAX_LOD_LEVELS; numlodlevels++)
+	{
+		lodlevel_t *l = &lodlevels[numlodlevels];
+		l->nodesx = nodesx;
+		l->nodesy = nodesy;
+		l->nodes = (lodnode_t*)Arena_Calloc(maparena, nodesx * nodesy * sizeof(lodnode_t));
+
+		if (nodesx == 1 && nodesy == 1)
+		{
+			numlodlevels++;
+			break;
+		}
+
+		nodesx = (nodesx + 1) / 2;
+		nodesy = (nodesy + 1) / 2;
+	}
+}
+
+static void InvalidateLod(int chunk)
+{
+	int x = chunk % mapchunksx;
+	int y = chunk / mapchunksx;
+
+	for (int level = 0; level < numlodlevels; level++, x /= 2, y /= 2)
+		GetLodNode(level, x, y)->dirty = true;
+}
+
+static void InvalidateAllLod()
+{
+	for (int level = 0; level < numlodlevels; level++)
+		for (int i = 0; i < lodlevels[level].nodesx * lodlevels[level].nodesy; i++)
+			lodlevels[level].nodes[i].dirty = true;
+}
+
+// the level to draw at the current zoom, -1 when the tiles should be drawn
+static int LodLevel()
+{
+	// window pixels across a chunk
+	float size = CHUNK_PIXELS * ViewScale();
+	if (size > LOD_PIXELS || !numlodlevels)
+		return -1;
+
+	int level = 0;
+	while (level < numlodlevels - 1 && size * 2 <= LOD_PIXELS)
+	{
+		size *= 2;
+		level++;
+	}
+
+	return level;
+}
 
-	if (layer == 0)
+// brings the node and the nodes below it up to date
+static void UpdateLodNode(int level, int x, int y)
+{
+	lodnode_t *node = GetLodNode(level, x, y);
+	if (!node->fbo)
 	{
-		glBlendFunc(GL_ONE, GL_ZERO);
+		CreateRenderTarget(&node->fbo, &node->texture, LOD_PIXELS, GL_LINEAR);
+		if (lodmemory < 0)
+			lodmemory = Mem_Subsystem("lod");
+		Mem_Track(lodmemory, LOD_PIXELS * LOD_PIXELS * 4);
+		node->dirty = true;
 	}
 
-	for (int i = 0; i < 256; i++)
+	if (!node->dirty)
+		return;
+
+	// the children on the map, they're brought up to date first as only
+	// one render target can be drawn into at a time
+	int cx0 = 2 * x, cy0 = 2 * y, cx1 = -1, cy1 = -1;
+	if (level)
 	{
-		int y = i / 16;
-		int x = i % 16;
+		cx1 = cx0 + 1 < lodlevels[level - 1].nodesx ? cx0 + 1 : cx0;
+		cy1 = cy0 + 1 < lodlevels[level - 1].nodesy ? cy0 + 1 : cy0;
+	}
+
+	for (int cy = cy0; cy <= cy1; cy++)
+		for (int cx = cx0; cx <= cx1; cx++)
+			UpdateLodNode(level - 1, cx, cy);
 
-		float *c = LookupColor(x * 16, y * 16);
+	// the map pixels the node covers
+	float size = CHUNK_PIXELS << level;
+	BeginRenderTarget(node->fbo, LOD_PIXELS, x * size, y * size, size);
 
-		DrawTile(layer, x, y, c);
+	if (!level)
+		RenderChunkLayers(x, y, 0, NUM_LAYERS - 1);
+
+	// each child lands on half as many pixels and the linear filter averages
+	// each 2x2 block of it. blending over the cleared target keeps the
+	// colour premultiplied
+	float childsize = size / 2;
+	for (int cy = cy0; cy <= cy1; cy++)
+		for (int cx = cx0; cx <= cx1; cx++)
+			DrawRenderTarget(GetLodNode(level - 1, cx, cy)->texture, cx * childsize, cy * childsize, childsize);
+
+	EndRenderTarget();
+	node->dirty = false;
+}
+
+static void DrawLod(int level)
+{
+	int cx0, cy0, cx1, cy1;
+	VisibleChunks(&cx0, &cy0, &cx1, &cy1);
+
+	float size = CHUNK_PIXELS << level;
+	for (int y = cy0 >> level; y <= cy1 >> level; y++)
+	{
+		for (int x = cx0 >> level; x <= cx1 >> level; x++)
+		{
+			UpdateLodNode(level, x, y);
+			DrawRenderTarget(GetLodNode(level, x, y)->texture, x * size, y * size, size);
+		}
 	}
 }
 
 static void DrawTiles()
 {
-	for (int i = 0; i < 4; i++)
-		DrawLayer(i);
+	// a map loaded since that is too big for the indexed renderer falls back
+	if (useindexed && Indexed_Draw(viewx, viewy, viewx + windoww / ViewScale(), viewy + windowh / ViewScale(),
+		texobj[0], tilew, tileh, ANIMATED_TILE, AnimatedTileBrightness()))
+		return;
+
+	int level = LodLevel();
+	if (level >= 0)
+	{
+		DrawLod(level);
+		return;
+	}
+
+	if (!uselayercache)
+	{
+		for (int i = 0; i < NUM_LAYERS; i++)
+			DrawLayer(i);
+		return;
+	}
+
+	int cx0, cy0, cx1, cy1;
+	VisibleChunks(&cx0, &cy0, &cx1, &cy1);
+
+	for (int cy = cy0; cy <= cy1; cy++)
+	{
+		for (int cx = cx0; cx <= cx1; cx++)
+		{
+			int chunk = cy * mapchunksx + cx;
+
+			DrawCachedLayers(chunk, CACHE_BELOW, 0, currentlayer - 1);
+
+			BeginTileDraw();
+			DrawLayerChunk(currentlayer, cx, cy);
+			EndTileDraw();
+
+			DrawCachedLayers(chunk, CACHE_ABOVE, currentlayer + 1, NUM_LAYERS - 1);
+		}
+	}
+}
+
+static void SetupView()
+{
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glOrtho(viewx, viewx + windoww / ViewScale(), viewy, viewy + windowh / ViewScale(), -1, 1);
+	glMatrixMode(GL_MODELVIEW);
 }
 
 static void ReshapeFunc(int w, int h)
 {
-	glMatrixMode(GL_PROJECTION);
-	glOrtho(0, 256, 0, 256, -1, 1);
+	windoww = w;
+	windowh = h;
 
 	glViewport(0, 0, w, h);
 }
@@ -546,11 +2149,34 @@ static void DisplayFunc()
 	glClearColor(1, 1, 1, 0);
 	glClear(GL_COLOR_BUFFER_BIT);
 
+	UpdateTilesetStream();
+
+	SetupView();
+
 	DrawTiles();
 
-	DrawGrid();
+	Objects_Draw(viewx, viewy, viewx + windoww / ViewScale(), viewy + windowh / ViewScale(), texobj[0], tilew, tileh);
+	if (objectmode)
+		Objects_DrawSelection(selectedobject);
+	if (prefabmode)
+	{
+		Prefab_Draw(viewx, viewy, viewx + windoww / ViewScale(), viewy + windowh / ViewScale(), TILE_SIZE, selectedinstance);
+		DrawPrefabRect();
+	}
+
+	// both are drawn per cell so they're left out when zoomed out
+	if (LodLevel() < 0)
+	{
+		DrawReachability();
+		DrawGrid();
+	}
 
 	glutSwapBuffers();
+
+	// keeps the view rectangle up to date
+	Minimap_Redisplay();
+
+	Mem_EndFrame();
 }
 // --------------------------------------------------------------------------------
 // Main
@@ -581,11 +2207,120 @@ void Sys_Sleep(unsigned int msecs)
 }
 
 
+// external interface for the minimap and indexed renderer
+int Map_Width();
+int Map_Height();
+int Map_NumLayers();
+int Map_GetTile(int layer, int x, int y);
+const int *Map_LayerData(int layer);
+void Map_TileColor(int tile, unsigned char rgba[4]);
+void Map_SetTile(int layer, int x, int y, int tile);
+char Map_GetClass(int x, int y);
+void View_GetRect(float rect[4]);
+void View_Center(float x, float y);
+
+int Map_Width()
+{
+	return mapw;
+}
+
+int Map_Height()
+{
+	return maph;
+}
+
+int Map_NumLayers()
+{
+	return NUM_LAYERS;
+}
+
+int Map_GetTile(int layer, int x, int y)
+{
+	return GetTileIndex(layer, y * mapw + x);
+}
+
+// used by the journal, so the edit isn't recorded again
+void Map_SetTile(int layer, int x, int y, int tile)
+{
+	if (x < 0 || x >= mapw || y < 0 || y >= maph || layer < 0 || layer >= NUM_LAYERS)
+		return;
+
+	SetTileIndex(layer, y * mapw + x, tile);
+}
+
+// used by the pathfinder
+char Map_GetClass(int x, int y)
+{
+	return mapclasses[y * mapw + x];
+}
+
+// mapw * maph cells, row by row from the bottom
+const int *Map_LayerData(int layer)
+{
+	return layoutdata + layer * mapw * maph;
+}
+
+void Map_TileColor(int tile, unsigned char rgba[4])
+{
+	// the tileset may still be loading
+	if (!tilecolors || tile < 0 || tile >= tilew * tileh)
+	{
+		memset(rgba, 0, 4);
+		return;
+	}
+
+	memcpy(rgba, tilecolors[tile], 4);
+}
+
+// the view rectangle in tiles
+void View_GetRect(float rect[4])
+{
+	rect[0] = (float)viewx / TILE_SIZE;
+	rect[1] = (float)viewy / TILE_SIZE;
+	rect[2] = (float)(viewx + windoww / ViewScale()) / TILE_SIZE;
+	rect[3] = (float)(viewy + windowh / ViewScale()) / TILE_SIZE;
+}
+
+// x and y are in tiles, the view is clamped to the map on the next frame
+void View_Center(float x, float y)
+{
+	viewx = x * TILE_SIZE - windoww / ViewScale() / 2;
+	viewy = y * TILE_SIZE - windowh / ViewScale() / 2;
+}
+
+static void MoveView()
+{
+	// the same speed on screen at any zoom
+	int speed = VIEW_SPEED << viewzoom;
+	if (keyactions[ka_left])
+		viewx -= speed;
+	if (keyactions[ka_right])
+		viewx += speed;
+	if (keyactions[ka_down])
+		viewy -= speed;
+	if (keyactions[ka_up])
+		viewy += speed;
+
+	// keep some of the map in view
+	int maxx = mapw * TILE_SIZE - windoww / ViewScale();
+	int maxy = maph * TILE_SIZE - windowh / ViewScale();
+	if (viewx > maxx)
+		viewx = maxx;
+	if (viewy > maxy)
+		viewy = maxy;
+	if (viewx < 0)
+		viewx = 0;
+	if (viewy < 0)
+		viewy = 0;
+}
+
 static void SimRunFrame()
 {
 	//printf("===== simrunframe =====\n");
 	simframe++;
 	simtime = simframe * SIM_TIMESTEP;
+
+	MoveView();
 }
 
 
@@ -607,6 +2342,8 @@ static void MainLoopFunc()
 	if (simtime < realtime)
 		SimRunFrame();
 
+	Journal_Update(realtime);
+
 	// signal a rendering update
 	glutPostRedisplay();
 }
@@ -617,7 +2354,14 @@ int main(int argc, char *argv[])
 {
 	// glutmain
 	glutInit(&argc, argv);
-	glutInitWindowSize(512, 512);
+
+	// a tga or bmp sheet can be opened directly instead of the tiles file
+	if (argc > 1)
+		tilesetname = argv[1];
+	if (argc > 2)
+		mapname = argv[2];
+
+	glutInitWindowSize(windoww, windowh);
 	glutCreateWindow("test window");
 	glutDisplayFunc(DisplayFunc);
 	glutReshapeFunc(ReshapeFunc);
@@ -628,11 +2372,25 @@ int main(int argc, char *argv[])
 	glutSpecialUpFunc(SpecialUpFunc);
 	glutMouseFunc(MouseFunc);
 	glutMotionFunc(MouseMotionFunc);
+	glutMouseWheelFunc(MouseWheelFunc);
+
+	tilesetarena = Arena_Create("tileset", 64 * 1024);
+	maparena = Arena_Create("map", 1024 * 1024);
 
 	LoadTileset();
+	Light_Init(tilesetname);
+	Prefab_Init(tilesetname);
+	AllocMap(LEGACY_MAP_SIZE, LEGACY_MAP_SIZE);
+
+	// bring back any edits that weren't saved last time
+	Journal_Open(mapname);
+	RecoverMap();
 
 	// tile window
-	InitWindow();
+	InitWindow(tilesetname);
+
+	// minimap window
+	Minimap_InitWindow();
 
 	glutMainLoop();
 
@@ -0,0 +1,501 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <pthread.h>
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/freeglut.h>
+
+// ==============================================
+// errors and warnings
+
+static void Error(const char *error, ...)
+{
+	va_list valist;
+	char buffer[2048];
+
+	va_start(valist, error);
+	vsprintf(buffer, error, valist);
+	va_end(valist);
+
+	fprintf(stderr, "\x1b[31m");
+	fprintf(stderr, "Error: %s", buffer);
+	fprintf(stderr, "\x1b[0m");
+	exit(1);
+}
+
+// ==============================================
+// Files
+
+static int FileSize(FILE *fp)
+{
+	int curpos = ftell(fp);
+	fseek(fp, 0, SEEK_END);
+	int size = ftell(fp);
+	fseek(fp, curpos, SEEK_SET);
+
+	return size;
+}
+
+int Mem_Subsystem(const char *name);
+void *Mem_Alloc(int subsystem, size_t size);
+void Mem_Free(void *p);
+
+// the decoder thread's memory is counted here, it can't use frame memory
+static int imagememory;
+
+// runs on the decode thread, so it returns -1 rather than exiting
+static int ReadFile(const char* filename, void **data)
+{
+	FILE *fp = fopen(filename, "rb");
+	if(!fp)
+		return -1;
+
+	int size = FileSize(fp);
+
+	*data = Mem_Alloc(imagememory, size);
+	fread(*data, size, 1, fp);
+	fclose(fp);
+
+	return size;
+}
+
+static int ReadHeader(const char *filename, unsigned char *data, int numbytes, int *filesize)
+{
+	FILE *fp = fopen(filename, "rb");
+	if(!fp)
+		Error("Failed to open file \"%s\"\n", filename);
+
+	*filesize = FileSize(fp);
+	numbytes = fread(data, 1, numbytes, fp);
+	fclose(fp);
+
+	return numbytes;
+}
+
+static int ReadShort(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static int ReadInt(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+
+// ________________________________________________________________________________
+// Image decoding
+// tga and bmp files are decoded on a worker thread. the header is parsed and
+// checked up front so the caller knows the image size, then the pixels arrive
+// a row at a time in gl order (bottom row first) and can be streamed into a
+// texture. the worker can't exit the editor, if the data turns out to be bad
+// the rest of the image is left blank and the error is reported by the stream
+
+enum imagetype_t
+{
+	IMAGE_TGA,
+	IMAGE_BMP
+};
+
+static char imagename[1024];
+static imagetype_t imagetype;
+static int imagew;
+static int imageh;
+static int bitsperpixel;
+static bool rle;
+static bool topdown;		// the file stores the top row first
+static int dataoffset;		// start of the pixel data in the file
+static unsigned int masks[4];	// bmp bitfield masks, r g b a
+
+static unsigned char *pixels;
+static int rowsdecoded;		// rows complete, in file order
+static pthread_t decodethread;
+static const char *decodeerror;	// set before the last row is published
+static bool errorreported;
+
+static int GetRowsDecoded()
+{
+	return __atomic_load_n(&rowsdecoded, __ATOMIC_ACQUIRE);
+}
+
+static void RowDecoded()
+{
+	__atomic_store_n(&rowsdecoded, rowsdecoded + 1, __ATOMIC_RELEASE);
+}
+
+// gl row a file row is written to
+static int DestRow(int filerow)
+{
+	return topdown ? imageh - 1 - filerow : filerow;
+}
+
+// blanks the rows that weren't decoded and publishes them all, so the image
+// still completes
+static void DecodeFailed(const char *error)
+{
+	for (int y = rowsdecoded; y < imageh; y++)
+		memset(pixels + DestRow(y) * imagew * 4, 0, imagew * 4);
+
+	decodeerror = error;
+	__atomic_store_n(&rowsdecoded, imageh, __ATOMIC_RELEASE);
+}
+
+static void ParseTGA(const unsigned char *header, int numbytes)
+{
+	if (numbytes < 18)
+		Error("Truncated tga header in \"%s\"\n", imagename);
+
+	int idlength = header[0];
+	int colormaptype = header[1];
+	int type = header[2];
+	int colormaplength = ReadShort(header + 5);
+	int colormapbits = header[7];
+
+	if (colormaptype != 0 || (type != 2 && type != 10))
+		Error("Only truecolor tga files are supported \"%s\"\n", imagename);
+
+	imagew = ReadShort(header + 12);
+	imageh = ReadShort(header + 14);
+	bitsperpixel = header[16];
+	topdown = (header[17] & 0x20) != 0;
+	rle = type == 10;
+	dataoffset = 18 + idlength + colormaplength * ((colormapbits + 7) / 8);
+
+	if (bitsperpixel != 24 && bitsperpixel != 32)
+		Error("Unsupported tga pixel depth %i\n", bitsperpixel);
+}
+
+static void ParseBMP(const unsigned char *header, int numbytes)
+{
+	if (numbytes < 54 || memcmp(header, "BM", 2))
+		Error("Bad bmp header in \"%s\"\n", imagename);
+
+	dataoffset = ReadInt(header + 10);
+	int infosize = ReadInt(header + 14);
+	imagew = ReadInt(header + 18);
+	imageh = ReadInt(header + 22);
+	bitsperpixel = ReadShort(header + 28);
+	int compression = ReadInt(header + 30);
+	rle = false;
+
+	// a negative height stores the rows top down
+	if (imageh == INT_MIN)
+		Error("Bad bmp header in \"%s\"\n", imagename);
+	topdown = imageh < 0;
+	if (topdown)
+		imageh = -imageh;
+	if (dataoffset < 0)
+		Error("Bad bmp header in \"%s\"\n", imagename);
+
+	if (bitsperpixel != 24 && bitsperpixel != 32)
+		Error("Unsupported bmp pixel depth %i\n", bitsperpixel);
+
+	// defaults for BI_RGB, stored as bgra
+	masks[0] = 0x00ff0000;
+	masks[1] = 0x0000ff00;
+	masks[2] = 0x000000ff;
+	masks[3] = 0;
+
+	if (compression == 3)
+	{
+		if (numbytes < 14 + 40 + 16)
+			Error("Truncated bmp header in \"%s\"\n", imagename);
+
+		masks[0] = ReadInt(header + 54);
+		masks[1] = ReadInt(header + 58);
+		masks[2] = ReadInt(header + 62);
+		masks[3] = infosize >= 56 ? ReadInt(header + 66) : 0;
+	}
+	else if (compression != 0)
+		Error("Compressed bmp files are not supported \"%s\"\n", imagename);
+}
+
+static unsigned char MaskChannel(unsigned int value, unsigned int mask)
+{
+	if (!mask)
+		return 255;
+
+	value &= mask;
+	while (!(mask & 1))
+	{
+		mask >>= 1;
+		value >>= 1;
+	}
+
+	return (value * 255) / mask;
+}
+
+static bool DecodeTGA(const unsigned char *data, const unsigned char *end)
+{
+	int bytesperpixel = bitsperpixel / 8;
+	int runcount = 0;
+	bool runpacket = false;
+	const unsigned char *src = data + dataoffset;
+
+	for (int y = 0; y < imageh; y++)
+	{
+		unsigned char *dst = pixels + DestRow(y) * imagew * 4;
+
+		for (int x = 0; x < imagew; x++, dst += 4)
+		{
+			if (rle && !runcount)
+			{
+				if (src >= end)
+					return false;
+
+				runpacket = (*src & 0x80) != 0;
+				runcount = (*src & 0x7f) + 1;
+				src++;
+			}
+
+			if (src + bytesperpixel > end)
+				return false;
+
+			// tga is stored as bgra
+			dst[0] = src[2];
+			dst[1] = src[1];
+			dst[2] = src[0];
+			dst[3] = bytesperpixel == 4 ? src[3] : 255;
+
+			// a run packet repeats the same pixel
+			if (rle)
+			{
+				runcount--;
+				if (!runpacket || !runcount)
+					src += bytesperpixel;
+			}
+			else
+				src += bytesperpixel;
+		}
+
+		RowDecoded();
+	}
+
+	return true;
+}
+
+// rows are padded to 4 bytes
+static int BMPPitch()
+{
+	return (imagew * (bitsperpixel / 8) + 3) & ~3;
+}
+
+static bool DecodeBMP(const unsigned char *data, const unsigned char *end)
+{
+	int bytesperpixel = bitsperpixel / 8;
+	int pitch = BMPPitch();
+
+	// checked when the header was parsed, but the file may have changed since
+	if (dataoffset + (long long)pitch * imageh > end - data)
+		return false;
+
+	for (int y = 0; y < imageh; y++)
+	{
+		const unsigned char *src = data + dataoffset + y * pitch;
+		unsigned char *dst = pixels + DestRow(y) * imagew * 4;
+
+		for (int x = 0; x < imagew; x++, src += bytesperpixel, dst += 4)
+		{
+			unsigned int value = src[0] | (src[1] << 8) | (src[2] << 16);
+			if (bytesperpixel == 4)
+				value |= (unsigned int)src[3] << 24;
+
+			dst[0] = MaskChannel(value, masks[0]);
+			dst[1] = MaskChannel(value, masks[1]);
+			dst[2] = MaskChannel(value, masks[2]);
+			dst[3] = MaskChannel(value, masks[3]);
+		}
+
+		RowDecoded();
+	}
+
+	return true;
+}
+
+static void *DecodeThread(void *arg)
+{
+	unsigned char *data;
+	int numbytes = ReadFile(imagename, (void**)&data);
+	if (numbytes < 0)
+	{
+		DecodeFailed("Failed to open file");
+		return NULL;
+	}
+
+	bool ok;
+	if (imagetype == IMAGE_TGA)
+		ok = DecodeTGA(data, data + numbytes);
+	else
+		ok = DecodeBMP(data, data + numbytes);
+
+	if (!ok)
+		DecodeFailed("Truncated image data in");
+
+	Mem_Free(data);
+	return NULL;
+}
+
+// ________________________________________________________________________________
+// Texture streaming
+// each gl context has its own texture so each one streams the decoded rows
+// separately. the rows go through a pixel buffer object so the copy into the
+// texture doesn't stall the calling thread
+
+#define MAX_STREAMS	4
+
+struct imagestream_t
+{
+	GLuint pbo;
+	GLuint texture;
+	int rowsuploaded;	// in file order
+};
+
+static imagestream_t streams[MAX_STREAMS];
+static int numstreams;
+
+// ________________________________________________________________________________
+// external interface
+
+bool Image_IsImageFile(const char *filename);
+void Image_Open(const char *filename, int *w, int *h);
+const unsigned char *Image_Pixels();
+bool Image_Decoded();
+int Image_BeginStream(GLuint texture);
+bool Image_UpdateStream(int stream);
+
+bool Image_IsImageFile(const char *filename)
+{
+	const char *ext = strrchr(filename, '.');
+	if (!ext)
+		return false;
+
+	return !strcasecmp(ext, ".tga") || !strcasecmp(ext, ".bmp");
+}
+
+// parses the header and starts decoding in the background
+// opening the same file again returns the image that is already decoding
+void Image_Open(const char *filename, int *w, int *h)
+{
+	if (pixels)
+	{
+		if (strcmp(filename, imagename))
+			Error("Only one image can be opened \"%s\"\n", filename);
+
+		*w = imagew;
+		*h = imageh;
+		return;
+	}
+
+	snprintf(imagename, sizeof(imagename), "%s", filename);
+
+	const char *ext = strrchr(filename, '.');
+	imagetype = !strcasecmp(ext, ".tga") ? IMAGE_TGA : IMAGE_BMP;
+
+	unsigned char header[256];
+	int filesize;
+	int numbytes = ReadHeader(filename, header, sizeof(header), &filesize);
+	if (imagetype == IMAGE_TGA)
+		ParseTGA(header, numbytes);
+	else
+		ParseBMP(header, numbytes);
+
+	// the sizes are checked here, the decode thread can't exit the editor
+	if (imagew <= 0 || imageh <= 0)
+		Error("Bad image size %ix%i in \"%s\"\n", imagew, imageh, imagename);
+	if ((long long)imagew * imageh * 4 > INT_MAX)
+		Error("Image \"%s\" is too big, %ix%i\n", imagename, imagew, imageh);
+	if (imagetype == IMAGE_BMP && dataoffset + (long long)BMPPitch() * imageh > filesize)
+		Error("Truncated bmp data in \"%s\"\n", imagename);
+
+	imagememory = Mem_Subsystem("tileset image");
+	pixels = (unsigned char*)Mem_Alloc(imagememory, imagew * imageh * 4);
+	rowsdecoded = 0;
+	decodeerror = NULL;
+	errorreported = false;
+
+	if (pthread_create(&decodethread, NULL, DecodeThread, NULL))
+		Error("Failed to start the image decode thread\n");
+	pthread_detach(decodethread);
+
+	*w = imagew;
+	*h = imageh;
+}
+
+// the decoded pixels in gl order, only complete once Image_Decoded is true
+const unsigned char *Image_Pixels()
+{
+	return pixels;
+}
+
+bool Image_Decoded()
+{
+	return pixels && GetRowsDecoded() == imageh;
+}
+
+// the texture must already be allocated at the image size in the current context
+int Image_BeginStream(GLuint texture)
+{
+	if (numstreams == MAX_STREAMS)
+		Error("Too many image streams\n");
+
+	imagestream_t *s = &streams[numstreams];
+	s->texture = texture;
+	s->rowsuploaded = 0;
+
+	glGenBuffers(1, &s->pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s->pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, imagew * imageh * 4, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	return numstreams++;
+}
+
+// uploads any rows decoded since the last call, returns true once the whole
+// image is in the texture. must be called with the stream's context current
+bool Image_UpdateStream(int stream)
+{
+	imagestream_t *s = &streams[stream];
+	if (!s->pbo)
+		return true;
+
+	int ready = GetRowsDecoded();
+	if (ready == s->rowsuploaded)
+		return false;
+
+	// the decode thread gave up, what it got is shown and the rest is blank
+	if (ready == imageh && decodeerror && !errorreported)
+	{
+		fprintf(stderr, "\x1b[31m");
+		fprintf(stderr, "Error: %s \"%s\", the rest of the image is left blank\n", decodeerror, imagename);
+		fprintf(stderr, "\x1b[0m");
+		errorreported = true;
+	}
+
+	// the new rows are contiguous in gl order whichever way the file is stored
+	int numrows = ready - s->rowsuploaded;
+	int firstrow = topdown ? imageh - ready : s->rowsuploaded;
+	int offset = firstrow * imagew * 4;
+	int numbytes = numrows * imagew * 4;
+
+	// each range is only written once so there's no need to synchronize
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s->pbo);
+	void *dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, offset, numbytes,
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	memcpy(dst, pixels + offset, numbytes);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	glBindTexture(GL_TEXTURE_2D, s->texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, firstrow, imagew, numrows, GL_RGBA, GL_UNSIGNED_BYTE, (void*)(size_t)offset);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	s->rowsuploaded = ready;
+	if (ready < imageh)
+		return false;
+
+	// finished with the staging buffer
+	glDeleteBuffers(1, &s->pbo);
+	s->pbo = 0;
+	return true;
+}
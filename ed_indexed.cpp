@@ -0,0 +1,256 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+// ________________________________________________________________________________
+// Indexed renderer
+// each layer lives in an integer texture holding its tile numbers. a layer is
+// drawn as one quad over the view and the fragment shader looks the tile up in
+// the atlas, so the cost doesn't depend on how many cells are on screen and an
+// edit is a single texel upload. glsl 1.30 keeps it working on mesa's
+// software rasterizer
+
+#define TILE_SIZE	16
+
+int Map_Width();
+int Map_Height();
+int Map_NumLayers();
+const int *Map_LayerData(int layer);
+
+static const char *vertexshader =
+	"#version 130\n"
+	"out vec2 mappos;\n"
+	"void main()\n"
+	"{\n"
+	"	// map pixels to tiles\n"
+	"	mappos = gl_Vertex.xy / 16.0;\n"
+	"	gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;\n"
+	"}\n";
+
+static const char *fragmentshader =
+	"#version 130\n"
+	"uniform isampler2D tiles;\n"
+	"uniform sampler2D atlas;\n"
+	"uniform ivec2 atlassize;\n"
+	"uniform int animatedtile;\n"
+	"uniform float brightness;\n"
+	"in vec2 mappos;\n"
+	"void main()\n"
+	"{\n"
+	"	int tile = texelFetch(tiles, ivec2(floor(mappos)), 0).r;\n"
+	"	if (tile <= 0 || tile >= atlassize.x * atlassize.y)\n"
+	"		discard;\n"
+	"\n"
+	"	vec2 corner = vec2(tile % atlassize.x, tile / atlassize.x);\n"
+	"	vec4 color = textureLod(atlas, (corner + fract(mappos)) / vec2(atlassize), 0.0);\n"
+	"	if (tile == animatedtile)\n"
+	"		color.rgb *= brightness;\n"
+	"	gl_FragColor = color;\n"
+	"}\n";
+
+#define MAX_LAYERS	8
+
+static bool initialized;
+static bool unsupported;
+static bool fits;		// the map isn't bigger than the max texture size
+static GLuint program;
+static GLuint layertextures[MAX_LAYERS];
+static int texturew;
+static int textureh;
+
+static GLint tilesloc;
+static GLint atlasloc;
+static GLint atlassizeloc;
+static GLint animatedtileloc;
+static GLint brightnessloc;
+
+static GLuint CompileShader(GLenum type, const char *source)
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+
+	GLint status;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (!status)
+	{
+		char log[2048];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		fprintf(stderr, "indexed renderer: shader failed to compile\n%s\n", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+static bool CreateProgram()
+{
+	GLuint vs = CompileShader(GL_VERTEX_SHADER, vertexshader);
+	GLuint fs = CompileShader(GL_FRAGMENT_SHADER, fragmentshader);
+	if (!vs || !fs)
+		return false;
+
+	program = glCreateProgram();
+	glAttachShader(program, vs);
+	glAttachShader(program, fs);
+	glLinkProgram(program);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+
+	GLint status;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (!status)
+	{
+		char log[2048];
+		glGetProgramInfoLog(program, sizeof(log), NULL, log);
+		fprintf(stderr, "indexed renderer: program failed to link\n%s\n", log);
+		return false;
+	}
+
+	tilesloc = glGetUniformLocation(program, "tiles");
+	atlasloc = glGetUniformLocation(program, "atlas");
+	atlassizeloc = glGetUniformLocation(program, "atlassize");
+	animatedtileloc = glGetUniformLocation(program, "animatedtile");
+	brightnessloc = glGetUniformLocation(program, "brightness");
+
+	return true;
+}
+
+// the map's cell arrays are uploaded as they are, one int per texel. returns
+// false and drops the textures if the map doesn't fit in them
+static bool UploadLayers()
+{
+	texturew = Map_Width();
+	textureh = Map_Height();
+
+	GLint maxsize;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxsize);
+	if (texturew > maxsize || textureh > maxsize)
+	{
+		printf("indexed renderer: %ix%i map is bigger than the max texture size %i, drawing by chunks\n", texturew, textureh, maxsize);
+		glDeleteTextures(MAX_LAYERS, layertextures);
+		memset(layertextures, 0, sizeof(layertextures));
+		return false;
+	}
+
+	for (int layer = 0; layer < Map_NumLayers(); layer++)
+	{
+		if (!layertextures[layer])
+			glGenTextures(1, &layertextures[layer]);
+
+		glBindTexture(GL_TEXTURE_2D, layertextures[layer]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32I, texturew, textureh, 0, GL_RED_INTEGER, GL_INT, Map_LayerData(layer));
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return true;
+}
+
+// ________________________________________________________________________________
+// external interface
+
+bool Indexed_Init();
+void Indexed_Reset();
+void Indexed_UpdateCell(int layer, int x, int y, int tile);
+bool Indexed_Draw(float x0, float y0, float x1, float y1, GLuint atlas, int tilew, int tileh, int animatedtile, float brightness);
+
+// must be called with the map window's context current, returns false if
+// the shaders aren't supported or the map is too big for them
+bool Indexed_Init()
+{
+	if (initialized)
+		return fits;
+	if (unsupported)
+		return false;
+
+	if (Map_NumLayers() > MAX_LAYERS || !CreateProgram())
+	{
+		unsupported = true;
+		return false;
+	}
+
+	initialized = true;
+	fits = UploadLayers();
+	return fits;
+}
+
+// the map has been loaded or resized
+void Indexed_Reset()
+{
+	if (initialized)
+		fits = UploadLayers();
+}
+
+void Indexed_UpdateCell(int layer, int x, int y, int tile)
+{
+	if (!fits)
+		return;
+
+	glBindTexture(GL_TEXTURE_2D, layertextures[layer]);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, 1, 1, GL_RED_INTEGER, GL_INT, &tile);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// x0, y0, x1, y1 is the visible area in map pixels. returns false if the
+// map has to be drawn some other way
+bool Indexed_Draw(float x0, float y0, float x1, float y1, GLuint atlas, int tilew, int tileh, int animatedtile, float brightness)
+{
+	if (!fits)
+		return false;
+
+	// clip to the map so the lookups stay inside the textures
+	float mapx = texturew * TILE_SIZE;
+	float mapy = textureh * TILE_SIZE;
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 > mapx)
+		x1 = mapx;
+	if (y1 > mapy)
+		y1 = mapy;
+
+	glUseProgram(program);
+	glUniform1i(tilesloc, 0);
+	glUniform1i(atlasloc, 1);
+	glUniform2i(atlassizeloc, tilew, tileh);
+	glUniform1i(animatedtileloc, animatedtile);
+	glUniform1f(brightnessloc, brightness);
+
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, atlas);
+	glActiveTexture(GL_TEXTURE0);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	for (int layer = 0; layer < Map_NumLayers(); layer++)
+	{
+		glBindTexture(GL_TEXTURE_2D, layertextures[layer]);
+
+		glBegin(GL_TRIANGLE_STRIP);
+		glVertex2f(x0, y0);
+		glVertex2f(x1, y0);
+		glVertex2f(x0, y1);
+		glVertex2f(x1, y1);
+		glEnd();
+	}
+
+	glDisable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ZERO);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glUseProgram(0);
+	return true;
+}
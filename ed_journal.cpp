@@ -0,0 +1,366 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// ________________________________________________________________________________
+// Journal
+// every edit is recorded as the cell, layer and the tile before and after.
+// the records live in a ring for undo and redo, and are also appended to a
+// side file next to the map. the side file is synced in batches and emptied
+// when the map is saved, so after a crash replaying it over the saved map
+// brings back the lost session
+
+// records held for undo, the oldest strokes are dropped past this
+#define JOURNAL_RECORDS	65536
+
+// a longer stroke is split so it can't wrap over its own start
+#define JOURNAL_MAX_GROUP	(JOURNAL_RECORDS / 2)
+
+// unsynced records are written out when there are this many, or this often
+#define JOURNAL_BATCH	256
+#define JOURNAL_SYNC_MS	1000
+
+#define JOURNAL_MAGIC	0x4c4e4a54	// "TJNL"
+#define JOURNAL_VERSION	1
+
+// the first record of each stroke or operation
+#define RECORD_START	(1 << 0)
+
+// a prefab instance placed or removed rather than a tile change. it can hang
+// off the map so the cell holds its bottom left x and y in 16 bits each,
+// layer is the prefab, oldtile its serial and newtile set if it takes its
+// base from the map when it's put back
+#define RECORD_PLACE	(1 << 1)
+#define RECORD_REMOVE	(1 << 2)
+#define RECORD_INSTANCE	(RECORD_PLACE | RECORD_REMOVE)
+
+struct editrecord_t
+{
+	int cell;	// y * mapw + x
+	short layer;
+	short flags;
+	int oldtile;
+	int newtile;
+};
+
+struct journalheader_t
+{
+	int magic;
+	int version;
+	int mapw;
+	int maph;
+};
+
+int Map_Width();
+int Map_Height();
+void Map_SetTile(int layer, int x, int y, int tile);
+void Prefab_SetInstance(bool placed, int prefab, int x, int y, int serial, bool mapisbase);
+void *Mem_FrameAlloc(size_t size);
+
+// absolute record numbers, the ring index is the number modulo the size
+static editrecord_t ring[JOURNAL_RECORDS];
+static unsigned long long tail;		// oldest record
+static unsigned long long cursor;	// one past the last applied record
+static unsigned long long head;		// one past the last record that can be redone
+
+static bool groupopen;
+static bool groupstarted;
+static int grouprecords;
+static bool groupsplit;
+
+static char journalname[1024];
+static int journalfd = -1;
+static bool headerwritten;
+static editrecord_t pending[JOURNAL_BATCH];
+static int numpending;
+static unsigned int lastsync;
+
+static editrecord_t *RingRecord(unsigned long long n)
+{
+	return &ring[n % JOURNAL_RECORDS];
+}
+
+static void WriteBytes(const void *data, int numbytes)
+{
+	const char *p = (const char*)data;
+
+	while (numbytes > 0)
+	{
+		int written = write(journalfd, p, numbytes);
+		if (written <= 0)
+		{
+			fprintf(stderr, "journal: failed to write \"%s\"\n", journalname);
+			return;
+		}
+
+		p += written;
+		numbytes -= written;
+	}
+}
+
+static void FlushPending()
+{
+	if (journalfd < 0 || !numpending)
+		return;
+
+	// the map size is written with the first record so a stale journal
+	// isn't replayed over a different map
+	if (!headerwritten)
+	{
+		journalheader_t header = { JOURNAL_MAGIC, JOURNAL_VERSION, Map_Width(), Map_Height() };
+		WriteBytes(&header, sizeof(header));
+		headerwritten = true;
+	}
+
+	WriteBytes(pending, numpending * sizeof(editrecord_t));
+	fdatasync(journalfd);
+	numpending = 0;
+}
+
+// the side file records what was applied to the map in order, undo and redo
+// included, so replaying it only needs the new tiles
+static void AppendToFile(int cell, int layer, int flags, int oldtile, int newtile)
+{
+	if (journalfd < 0)
+		return;
+
+	if (numpending == JOURNAL_BATCH)
+		FlushPending();
+
+	editrecord_t *r = &pending[numpending++];
+	r->cell = cell;
+	r->layer = layer;
+	r->flags = flags;
+	r->oldtile = oldtile;
+	r->newtile = newtile;
+}
+
+// undoing a placement removes the instance and the other way round. an
+// instance that is put back takes its base from what it covers again
+static void Apply(const editrecord_t *r, bool undo)
+{
+	if (r->flags & RECORD_INSTANCE)
+	{
+		bool placed = ((r->flags & RECORD_PLACE) != 0) != undo;
+		Prefab_SetInstance(placed, r->layer, (short)(r->cell & 0xffff), r->cell >> 16, r->oldtile, undo || r->newtile);
+	}
+	else
+		Map_SetTile(r->layer, r->cell % Map_Width(), r->cell / Map_Width(), undo ? r->oldtile : r->newtile);
+}
+
+// the record that redoes what undoing r did, for the side file
+static void AppendUndo(const editrecord_t *r, int flags)
+{
+	if (r->flags & RECORD_INSTANCE)
+		AppendToFile(r->cell, r->layer, flags | (r->flags & RECORD_PLACE ? RECORD_REMOVE : RECORD_PLACE), r->oldtile, 1);
+	else
+		AppendToFile(r->cell, r->layer, flags, r->newtile, r->oldtile);
+}
+
+// ________________________________________________________________________________
+// external interface
+
+void Journal_Open(const char *mapname);
+bool Journal_Replay();
+void Journal_Reset();
+void Journal_Saved();
+void Journal_BeginGroup();
+void Journal_EndGroup();
+void Journal_Record(int layer, int x, int y, int oldtile, int newtile);
+void Journal_RecordInstance(bool placed, int prefab, int x, int y, int serial, bool mapisbase);
+void Journal_Undo();
+void Journal_Redo();
+void Journal_Update(unsigned int msecs);
+
+void Journal_Open(const char *mapname)
+{
+	snprintf(journalname, sizeof(journalname), "%s.journal", mapname);
+
+	journalfd = open(journalname, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (journalfd < 0)
+		fprintf(stderr, "journal: failed to open \"%s\", edits won't be recoverable\n", journalname);
+
+	headerwritten = journalfd >= 0 && lseek(journalfd, 0, SEEK_END) > 0;
+}
+
+// applies the journal over the map that has just been loaded, returns true
+// if there was anything to recover
+bool Journal_Replay()
+{
+	if (journalfd < 0)
+		return false;
+
+	int numbytes = lseek(journalfd, 0, SEEK_END);
+	if (numbytes < (int)sizeof(journalheader_t))
+		return false;
+
+	char *buffer = (char*)Mem_FrameAlloc(numbytes);
+	pread(journalfd, buffer, numbytes, 0);
+
+	journalheader_t *header = (journalheader_t*)buffer;
+	if (header->magic != JOURNAL_MAGIC || header->version != JOURNAL_VERSION ||
+		header->mapw != Map_Width() || header->maph != Map_Height())
+	{
+		// kept to one side rather than thrown away
+		char rejectedname[1100];
+		snprintf(rejectedname, sizeof(rejectedname), "%s.rejected", journalname);
+		fprintf(stderr, "journal: \"%s\" doesn't match the map, moved to \"%s\"\n", journalname, rejectedname);
+
+		close(journalfd);
+		rename(journalname, rejectedname);
+		journalfd = open(journalname, O_RDWR | O_CREAT | O_APPEND | O_TRUNC, 0644);
+		headerwritten = false;
+		return false;
+	}
+
+	// a partly written record at the end is dropped
+	int numrecords = (numbytes - sizeof(journalheader_t)) / sizeof(editrecord_t);
+	editrecord_t *records = (editrecord_t*)(buffer + sizeof(journalheader_t));
+	for (int i = 0; i < numrecords; i++)
+		Apply(&records[i], false);
+
+	printf("journal: recovered %i edits from %s\n", numrecords, journalname);
+	return numrecords > 0;
+}
+
+// a new map has been loaded, the history no longer applies
+void Journal_Reset()
+{
+	tail = cursor = head = 0;
+	groupopen = false;
+	Journal_Saved();
+}
+
+// the map on disk now holds every edit so the side file can be emptied
+void Journal_Saved()
+{
+	numpending = 0;
+	headerwritten = false;
+
+	if (journalfd >= 0 && ftruncate(journalfd, 0))
+		fprintf(stderr, "journal: failed to truncate \"%s\"\n", journalname);
+}
+
+void Journal_BeginGroup()
+{
+	groupopen = true;
+	groupstarted = false;
+	grouprecords = 0;
+	groupsplit = false;
+}
+
+void Journal_EndGroup()
+{
+	groupopen = false;
+
+	if (numpending >= JOURNAL_BATCH / 2)
+		FlushPending();
+}
+
+static void AddRecord(int cell, int layer, int flags, int oldtile, int newtile)
+{
+	// a new edit drops anything that could have been redone
+	head = cursor;
+
+	// make room by dropping the oldest whole group
+	if (head - tail == JOURNAL_RECORDS)
+	{
+		tail++;
+		while (tail < head && !(RingRecord(tail)->flags & RECORD_START))
+			tail++;
+	}
+
+	// a stroke too long for the ring carries on as a new group, undo
+	// takes it back in parts and the oldest parts may be dropped
+	if (groupopen && groupstarted && grouprecords == JOURNAL_MAX_GROUP)
+	{
+		if (!groupsplit)
+			printf("journal: edit is over %i tiles, undo will take it back in parts and the start may be lost\n", JOURNAL_MAX_GROUP);
+		groupsplit = true;
+		groupstarted = false;
+	}
+
+	// edits outside a group are an operation on their own
+	if (!groupopen || !groupstarted)
+	{
+		flags |= RECORD_START;
+		grouprecords = 0;
+	}
+	groupstarted = true;
+	grouprecords++;
+
+	editrecord_t *r = RingRecord(head);
+	r->cell = cell;
+	r->layer = layer;
+	r->flags = flags;
+	r->oldtile = oldtile;
+	r->newtile = newtile;
+	head++;
+	cursor = head;
+
+	AppendToFile(cell, layer, flags, oldtile, newtile);
+}
+
+void Journal_Record(int layer, int x, int y, int oldtile, int newtile)
+{
+	if (oldtile != newtile)
+		AddRecord(y * Map_Width() + x, layer, 0, oldtile, newtile);
+}
+
+void Journal_RecordInstance(bool placed, int prefab, int x, int y, int serial, bool mapisbase)
+{
+	AddRecord((y << 16) | (x & 0xffff), prefab, placed ? RECORD_PLACE : RECORD_REMOVE, serial, mapisbase);
+}
+
+void Journal_Undo()
+{
+	if (cursor == tail)
+		return;
+
+	// back to the start of the group
+	int count = 0;
+	editrecord_t *r;
+	do
+	{
+		cursor--;
+		r = RingRecord(cursor);
+		Apply(r, true);
+		AppendUndo(r, count ? 0 : RECORD_START);
+		count++;
+	} while (!(r->flags & RECORD_START) && cursor > tail);
+
+	printf("undo %i edits\n", count);
+	FlushPending();
+}
+
+void Journal_Redo()
+{
+	if (cursor == head)
+		return;
+
+	// forward to the start of the next group
+	int count = 0;
+	do
+	{
+		editrecord_t *r = RingRecord(cursor);
+		Apply(r, false);
+		AppendToFile(r->cell, r->layer, r->flags, r->oldtile, r->newtile);
+		cursor++;
+		count++;
+	} while (cursor < head && !(RingRecord(cursor)->flags & RECORD_START));
+
+	printf("redo %i edits\n", count);
+	FlushPending();
+}
+
+// called regularly so a long stroke is still synced
+void Journal_Update(unsigned int msecs)
+{
+	if (msecs - lastsync < JOURNAL_SYNC_MS)
+		return;
+
+	FlushPending();
+	lastsync = msecs;
+}
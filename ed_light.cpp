@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// ________________________________________________________________________________
+// Lighting
+// tiles can emit light or block it. light spreads out from the emitters one
+// level per cell until it runs out, and an occluder is lit but doesn't pass
+// the light on. the levels are kept in a grid per chunk. light can't travel
+// further than LIGHT_RADIUS cells, so an edit only has to redo the cells
+// within that distance using the emitters that can reach them
+
+#define LIGHT_RADIUS	8
+
+// tile flags
+#define LIGHT_EMITTER	(1 << 0)
+#define LIGHT_OCCLUDER	(1 << 1)
+
+#define MAX_LIGHT_TILES	65536
+
+// the level of a cell nothing reaches, as a fraction of full brightness
+#define AMBIENT_LIGHT	0.35f
+
+#define CHUNK_SIZE	16
+
+int Map_Width();
+int Map_Height();
+int Map_NumLayers();
+int Map_GetTile(int layer, int x, int y);
+int Mem_Subsystem(const char *name);
+void *Mem_Alloc(int subsystem, size_t size);
+void *Mem_Calloc(int subsystem, size_t size);
+void Mem_Free(void *p);
+void *Mem_FrameAlloc(size_t size);
+
+static unsigned char tileflags[MAX_LIGHT_TILES];
+
+// used when there's no lights file next to the tileset, the lamp and the
+// ground tiles
+static const int defaultemitters[] = { 55 };
+static const int defaultoccluders[] = { 104, 105, 106, 107 };
+
+// chunk by chunk, each chunk row by row from the bottom
+static unsigned char *lightgrid;
+static int gridw;
+static int gridh;
+
+static int lightmemory = -1;
+
+static int TileFlags(int tile)
+{
+	if (tile <= 0 || tile >= MAX_LIGHT_TILES)
+		return 0;
+
+	return tileflags[tile];
+}
+
+// the flags of every layer at the cell
+static int CellFlags(int x, int y)
+{
+	int flags = 0;
+	for (int layer = 0; layer < Map_NumLayers(); layer++)
+		flags |= TileFlags(Map_GetTile(layer, x, y));
+
+	return flags;
+}
+
+static unsigned char *GridCell(int x, int y)
+{
+	int chunk = (y / CHUNK_SIZE) * (gridw / CHUNK_SIZE) + x / CHUNK_SIZE;
+	return &lightgrid[chunk * CHUNK_SIZE * CHUNK_SIZE + (y % CHUNK_SIZE) * CHUNK_SIZE + x % CHUNK_SIZE];
+}
+
+// a lights file has a tile number and its flags on each line, e for an
+// emitter and o for an occluder
+// 55 e
+// 104 o
+static bool LoadLightsFile(const char *filename)
+{
+	FILE *fp = fopen(filename, "r");
+	if (!fp)
+		return false;
+
+	int tile;
+	char flags[8];
+	while (fscanf(fp, "%i %7s", &tile, flags) == 2)
+	{
+		if (tile <= 0 || tile >= MAX_LIGHT_TILES)
+			continue;
+
+		tileflags[tile] = 0;
+		if (strchr(flags, 'e'))
+			tileflags[tile] |= LIGHT_EMITTER;
+		if (strchr(flags, 'o'))
+			tileflags[tile] |= LIGHT_OCCLUDER;
+	}
+
+	fclose(fp);
+	return true;
+}
+
+// breadth first from every emitter inside the area. levels holds the area's
+// cells and starts out zeroed, the map cells outside it are treated as dark
+static void Propagate(int x0, int y0, int w, int h, unsigned char *levels)
+{
+	int *queue = (int*)Mem_FrameAlloc((size_t)w * h * sizeof(int));
+	int head = 0, tail = 0;
+
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			if (CellFlags(x0 + x, y0 + y) & LIGHT_EMITTER)
+			{
+				levels[y * w + x] = LIGHT_RADIUS;
+				queue[tail++] = y * w + x;
+			}
+		}
+	}
+
+	// every cell is queued once, by the first and so the brightest level
+	// to reach it
+	static const int offsets[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+	while (head < tail)
+	{
+		int cell = queue[head++];
+		int x = cell % w;
+		int y = cell / w;
+		int level = levels[cell] - 1;
+
+		if (level <= 0)
+			continue;
+		if ((CellFlags(x0 + x, y0 + y) & (LIGHT_EMITTER | LIGHT_OCCLUDER)) == LIGHT_OCCLUDER)
+			continue;
+
+		for (int i = 0; i < 4; i++)
+		{
+			int nx = x + offsets[i][0];
+			int ny = y + offsets[i][1];
+			if (nx < 0 || ny < 0 || nx >= w || ny >= h)
+				continue;
+
+			int next = ny * w + nx;
+			if (levels[next])
+				continue;
+
+			levels[next] = level;
+			queue[tail++] = next;
+		}
+	}
+}
+
+// ________________________________________________________________________________
+// external interface
+
+void Light_Init(const char *tilesetname);
+void Light_Rebuild();
+bool Light_UpdateCell(int x, int y, int oldtile, int newtile, int rect[4]);
+float Light_Level(int x, int y);
+
+void Light_Init(const char *tilesetname)
+{
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "%s.lights", tilesetname);
+
+	memset(tileflags, 0, sizeof(tileflags));
+	if (LoadLightsFile(filename))
+	{
+		printf("loaded %s\n", filename);
+		return;
+	}
+
+	for (unsigned int i = 0; i < sizeof(defaultemitters) / sizeof(int); i++)
+		tileflags[defaultemitters[i]] |= LIGHT_EMITTER;
+	for (unsigned int i = 0; i < sizeof(defaultoccluders) / sizeof(int); i++)
+		tileflags[defaultoccluders[i]] |= LIGHT_OCCLUDER;
+}
+
+// lights the whole map, called when it's loaded or resized
+void Light_Rebuild()
+{
+	if (lightmemory < 0)
+		lightmemory = Mem_Subsystem("light");
+
+	Mem_Free(lightgrid);
+	gridw = Map_Width();
+	gridh = Map_Height();
+	lightgrid = (unsigned char*)Mem_Calloc(lightmemory, (size_t)gridw * gridh);
+
+	unsigned char *levels = (unsigned char*)Mem_Calloc(lightmemory, (size_t)gridw * gridh);
+	Propagate(0, 0, gridw, gridh, levels);
+
+	for (int y = 0; y < gridh; y++)
+		for (int x = 0; x < gridw; x++)
+			*GridCell(x, y) = levels[y * gridw + x];
+
+	Mem_Free(levels);
+}
+
+// called after a tile changes. only a change in the flags can move the
+// light, and then only the cells within LIGHT_RADIUS of the edit. they can be
+// reached by emitters up to twice that away, so those are propagated over
+// the larger area and the inner part is copied back. rect is filled with the
+// cells that changed, returns false if none did
+bool Light_UpdateCell(int x, int y, int oldtile, int newtile, int rect[4])
+{
+	if (!lightgrid || TileFlags(oldtile) == TileFlags(newtile))
+		return false;
+
+	// the area emitters can reach the edit from
+	int ax0 = x - 2 * LIGHT_RADIUS;
+	int ay0 = y - 2 * LIGHT_RADIUS;
+	int ax1 = x + 2 * LIGHT_RADIUS;
+	int ay1 = y + 2 * LIGHT_RADIUS;
+	if (ax0 < 0)
+		ax0 = 0;
+	if (ay0 < 0)
+		ay0 = 0;
+	if (ax1 > gridw - 1)
+		ax1 = gridw - 1;
+	if (ay1 > gridh - 1)
+		ay1 = gridh - 1;
+
+	int w = ax1 - ax0 + 1;
+	int h = ay1 - ay0 + 1;
+	unsigned char *levels = (unsigned char*)Mem_FrameAlloc(w * h);
+	memset(levels, 0, w * h);
+	Propagate(ax0, ay0, w, h, levels);
+
+	bool changed = false;
+	for (int cy = y - LIGHT_RADIUS; cy <= y + LIGHT_RADIUS; cy++)
+	{
+		for (int cx = x - LIGHT_RADIUS; cx <= x + LIGHT_RADIUS; cx++)
+		{
+			if (cx < 0 || cy < 0 || cx >= gridw || cy >= gridh)
+				continue;
+
+			unsigned char *cell = GridCell(cx, cy);
+			unsigned char level = levels[(cy - ay0) * w + (cx - ax0)];
+			if (*cell == level)
+				continue;
+
+			*cell = level;
+			if (!changed)
+			{
+				rect[0] = rect[2] = cx;
+				rect[1] = rect[3] = cy;
+				changed = true;
+			}
+
+			if (cx < rect[0])
+				rect[0] = cx;
+			if (cx > rect[2])
+				rect[2] = cx;
+			if (cy < rect[1])
+				rect[1] = cy;
+			if (cy > rect[3])
+				rect[3] = cy;
+		}
+	}
+
+	return changed;
+}
+
+// brightness to scale the cell's colour by
+float Light_Level(int x, int y)
+{
+	if (!lightgrid)
+		return 1;
+
+	float level = (float)*GridCell(x, y) / LIGHT_RADIUS;
+	return AMBIENT_LIGHT + (1 - AMBIENT_LIGHT) * level;
+}
@@ -0,0 +1,378 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+// ________________________________________________________________________________
+// Memory
+// allocations are tagged with the subsystem that made them so the live and
+// peak bytes of each one can be printed while the editor is running. arenas
+// hand out memory that is all released at once, pools hand out fixed size
+// items and keep the freed ones for reuse. both get their blocks from here so
+// they show up in the totals
+
+#define MAX_SUBSYSTEMS	16
+
+// every allocation is aligned to this
+#define MEM_ALIGN	16
+
+// scratch memory kept between frames, anything more is released every frame
+#define FRAME_BLOCK_SIZE	(1 << 20)
+
+static void Error(const char *error, ...)
+{
+	va_list valist;
+	char buffer[2048];
+
+	va_start(valist, error);
+	vsprintf(buffer, error, valist);
+	va_end(valist);
+
+	fprintf(stderr, "\x1b[31m");
+	fprintf(stderr, "Error: %s", buffer);
+	fprintf(stderr, "\x1b[0m");
+	exit(1);
+}
+
+struct memstats_t
+{
+	const char *name;
+	long long live;		// bytes held
+	long long peak;
+	long long allocs;	// allocations made
+	long long liveallocs;
+};
+
+// the stats are updated atomically as the image decoder allocates on its own thread
+static memstats_t stats[MAX_SUBSYSTEMS];
+static int numsubsystems;
+
+// sits in front of each block so it can be freed without the caller
+// remembering the size
+struct memheader_t
+{
+	size_t size;
+	int subsystem;
+	int pad;
+};
+
+static size_t Align(size_t size)
+{
+	return (size + MEM_ALIGN - 1) & ~(size_t)(MEM_ALIGN - 1);
+}
+
+static void CountBytes(int subsystem, long long bytes)
+{
+	memstats_t *s = &stats[subsystem];
+	long long live = __atomic_add_fetch(&s->live, bytes, __ATOMIC_RELAXED);
+
+	long long peak = __atomic_load_n(&s->peak, __ATOMIC_RELAXED);
+	while (live > peak && !__atomic_compare_exchange_n(&s->peak, &peak, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void CountAllocs(int subsystem, int count)
+{
+	memstats_t *s = &stats[subsystem];
+	if (count > 0)
+		__atomic_add_fetch(&s->allocs, count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->liveallocs, count, __ATOMIC_RELAXED);
+}
+
+static void *SysAlloc(int subsystem, size_t size)
+{
+	memheader_t *h = (memheader_t*)malloc(sizeof(memheader_t) + size);
+	if (!h)
+		Error("Out of memory allocating %zu bytes for %s\n", size, stats[subsystem].name);
+
+	h->size = size;
+	h->subsystem = subsystem;
+	CountBytes(subsystem, size);
+
+	return h + 1;
+}
+
+static void SysFree(void *p)
+{
+	memheader_t *h = (memheader_t*)p - 1;
+	CountBytes(h->subsystem, -(long long)h->size);
+	free(h);
+}
+
+// ________________________________________________________________________________
+// Arenas
+
+struct arenablock_t
+{
+	arenablock_t *next;
+	size_t size;
+	size_t used;
+	size_t pad;
+};
+
+struct arena_t
+{
+	int subsystem;
+	size_t blocksize;
+	arenablock_t *blocks;	// the current block is first
+	int numallocs;
+};
+
+static arenablock_t *NewArenaBlock(arena_t *a, size_t size)
+{
+	arenablock_t *b = (arenablock_t*)SysAlloc(a->subsystem, sizeof(arenablock_t) + size);
+	b->next = a->blocks;
+	b->size = size;
+	b->used = 0;
+	a->blocks = b;
+
+	return b;
+}
+
+// ________________________________________________________________________________
+// Pools
+
+struct poolitem_t
+{
+	poolitem_t *next;
+};
+
+struct pool_t
+{
+	int subsystem;
+	size_t itemsize;
+	int itemsperblock;
+	void *blocks;		// chained through the first item of each block
+	poolitem_t *freeitems;
+};
+
+static void NewPoolBlock(pool_t *p)
+{
+	char *block = (char*)SysAlloc(p->subsystem, (p->itemsperblock + 1) * p->itemsize);
+
+	// the first item links the blocks together
+	*(void**)block = p->blocks;
+	p->blocks = block;
+
+	for (int i = p->itemsperblock; i > 0; i--)
+	{
+		poolitem_t *item = (poolitem_t*)(block + i * p->itemsize);
+		item->next = p->freeitems;
+		p->freeitems = item;
+	}
+}
+
+// ________________________________________________________________________________
+// external interface
+
+int Mem_Subsystem(const char *name);
+void *Mem_Alloc(int subsystem, size_t size);
+void *Mem_Calloc(int subsystem, size_t size);
+void Mem_Free(void *p);
+void Mem_Track(int subsystem, long long bytes);
+void *Mem_FrameAlloc(size_t size);
+void Mem_EndFrame();
+void Mem_Print();
+
+struct arena_t;
+arena_t *Arena_Create(const char *name, size_t blocksize);
+void *Arena_Alloc(arena_t *a, size_t size);
+void *Arena_Calloc(arena_t *a, size_t size);
+void Arena_Reset(arena_t *a);
+
+struct pool_t;
+pool_t *Pool_Create(const char *name, size_t itemsize, int itemsperblock);
+void *Pool_Alloc(pool_t *p);
+void Pool_Free(pool_t *p, void *item);
+
+// the same name always gives the same subsystem. names are expected to be
+// string literals
+int Mem_Subsystem(const char *name)
+{
+	for (int i = 0; i < numsubsystems; i++)
+		if (!strcmp(stats[i].name, name))
+			return i;
+
+	if (numsubsystems == MAX_SUBSYSTEMS)
+		Error("Too many memory subsystems, can't add %s\n", name);
+
+	stats[numsubsystems].name = name;
+	return numsubsystems++;
+}
+
+void *Mem_Alloc(int subsystem, size_t size)
+{
+	CountAllocs(subsystem, 1);
+	return SysAlloc(subsystem, size);
+}
+
+void *Mem_Calloc(int subsystem, size_t size)
+{
+	void *p = Mem_Alloc(subsystem, size);
+	memset(p, 0, size);
+	return p;
+}
+
+void Mem_Free(void *p)
+{
+	if (!p)
+		return;
+
+	CountAllocs(((memheader_t*)p - 1)->subsystem, -1);
+	SysFree(p);
+}
+
+// for memory that lives outside the process heap, like gl textures
+void Mem_Track(int subsystem, long long bytes)
+{
+	CountAllocs(subsystem, bytes > 0 ? 1 : -1);
+	CountBytes(subsystem, bytes);
+}
+
+arena_t *Arena_Create(const char *name, size_t blocksize)
+{
+	arena_t *a = (arena_t*)calloc(1, sizeof(arena_t));
+	a->subsystem = Mem_Subsystem(name);
+	a->blocksize = Align(blocksize);
+
+	return a;
+}
+
+void *Arena_Alloc(arena_t *a, size_t size)
+{
+	size = Align(size);
+
+	arenablock_t *b = a->blocks;
+	if (size > a->blocksize)
+	{
+		// anything too big for a block gets one to itself, behind the
+		// current block so that one keeps filling up
+		arenablock_t *current = a->blocks;
+		b = NewArenaBlock(a, size);
+		if (current)
+		{
+			a->blocks = current;
+			b->next = current->next;
+			current->next = b;
+		}
+	}
+	else if (!b || b->used + size > b->size)
+		b = NewArenaBlock(a, a->blocksize);
+
+	void *p = (char*)(b + 1) + b->used;
+	b->used += size;
+
+	a->numallocs++;
+	CountAllocs(a->subsystem, 1);
+
+	return p;
+}
+
+void *Arena_Calloc(arena_t *a, size_t size)
+{
+	void *p = Arena_Alloc(a, size);
+	memset(p, 0, size);
+	return p;
+}
+
+// releases everything allocated from the arena. one block is kept for next
+// time, so an arena that is reset regularly stays at one block unless
+// something outgrows it
+void Arena_Reset(arena_t *a)
+{
+	arenablock_t *keep = NULL;
+
+	for (arenablock_t *b = a->blocks, *next; b; b = next)
+	{
+		next = b->next;
+		if (!keep && b->size == a->blocksize)
+		{
+			keep = b;
+			continue;
+		}
+
+		SysFree(b);
+	}
+
+	if (keep)
+	{
+		keep->next = NULL;
+		keep->used = 0;
+	}
+
+	a->blocks = keep;
+
+	CountAllocs(a->subsystem, -a->numallocs);
+	a->numallocs = 0;
+}
+
+// itemsize is rounded up so items stay aligned
+pool_t *Pool_Create(const char *name, size_t itemsize, int itemsperblock)
+{
+	pool_t *p = (pool_t*)calloc(1, sizeof(pool_t));
+	p->subsystem = Mem_Subsystem(name);
+	p->itemsize = Align(itemsize < sizeof(poolitem_t) ? sizeof(poolitem_t) : itemsize);
+	p->itemsperblock = itemsperblock;
+
+	return p;
+}
+
+void *Pool_Alloc(pool_t *p)
+{
+	if (!p->freeitems)
+		NewPoolBlock(p);
+
+	poolitem_t *item = p->freeitems;
+	p->freeitems = item->next;
+
+	CountAllocs(p->subsystem, 1);
+	return item;
+}
+
+void Pool_Free(pool_t *p, void *item)
+{
+	if (!item)
+		return;
+
+	poolitem_t *i = (poolitem_t*)item;
+	i->next = p->freeitems;
+	p->freeitems = i;
+
+	CountAllocs(p->subsystem, -1);
+}
+
+// scratch memory that is only good until the end of the frame. only the main
+// thread may use it
+static arena_t *framearena;
+
+void *Mem_FrameAlloc(size_t size)
+{
+	if (!framearena)
+		framearena = Arena_Create("frame", FRAME_BLOCK_SIZE);
+
+	return Arena_Alloc(framearena, size);
+}
+
+void Mem_EndFrame()
+{
+	if (framearena)
+		Arena_Reset(framearena);
+}
+
+void Mem_Print()
+{
+	long long live = 0, peak = 0;
+
+	printf("%-16s %10s %10s %10s %10s\n", "subsystem", "live kb", "peak kb", "allocs", "live");
+	for (int i = 0; i < numsubsystems; i++)
+	{
+		memstats_t *s = &stats[i];
+		printf("%-16s %10lld %10lld %10lld %10lld\n", s->name, s->live / 1024, s->peak / 1024, s->allocs, s->liveallocs);
+
+		live += s->live;
+		peak += s->peak;
+	}
+
+	// the peaks weren't necessarily at the same time
+	printf("%-16s %10lld %10lld\n", "total", live / 1024, peak / 1024);
+}
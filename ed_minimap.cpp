@@ -0,0 +1,280 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <GL/gl.h>
+#include <GL/freeglut.h>
+
+// ________________________________________________________________________________
+// Minimap
+// the whole map at one pixel per cell. each texel is the cell's layers blended
+// with the average colour of their tiles, so an edit only has to recompute and
+// upload the texels it touched. a map too big for one texture is shown at
+// one texel for every few cells, sampling the cell at the texel's corner
+
+// the window is sized so the longer side of the map is this many pixels
+#define MINIMAP_SIZE	256
+
+// past this many pending cells it's cheaper to upload the whole image
+#define MAX_DIRTY_CELLS	4096
+
+int Map_Width();
+int Map_Height();
+int Map_NumLayers();
+int Map_GetTile(int layer, int x, int y);
+void Map_TileColor(int tile, unsigned char rgba[4]);
+void View_GetRect(float rect[4]);
+void View_Center(float x, float y);
+void *Mem_FrameAlloc(size_t size);
+
+static int minimapwindow;
+static int windoww;
+static int windowh;
+
+static GLuint texobj[1];
+static int texturew;		// the map size the texture was made for, in cells
+static int textureh;
+static int texelcells = 1;	// cells along each side of a texel
+
+static bool rebuild = true;
+static int dirtycells[MAX_DIRTY_CELLS][2];
+static int numdirtycells;
+
+// cell colour over a white background, as the main window clears to white
+static void CellColor(int x, int y, unsigned char rgba[4])
+{
+	float r = 1, g = 1, b = 1;
+
+	// nothing under the top opaque tile can be seen, its average alpha is
+	// only 255 if every texel is opaque
+	int firstlayer = 0;
+	for (int layer = Map_NumLayers() - 1; layer > 0; layer--)
+	{
+		unsigned char c[4];
+		Map_TileColor(Map_GetTile(layer, x, y), c);
+		if (c[3] == 255)
+		{
+			firstlayer = layer;
+			break;
+		}
+	}
+
+	for (int layer = firstlayer; layer < Map_NumLayers(); layer++)
+	{
+		int tile = Map_GetTile(layer, x, y);
+		unsigned char c[4];
+		Map_TileColor(tile, c);
+		if (!c[3])
+			continue;
+
+		float a = c[3] / 255.0f;
+		r = r * (1 - a) + (c[0] / 255.0f) * a;
+		g = g * (1 - a) + (c[1] / 255.0f) * a;
+		b = b * (1 - a) + (c[2] / 255.0f) * a;
+	}
+
+	rgba[0] = r * 255;
+	rgba[1] = g * 255;
+	rgba[2] = b * 255;
+	rgba[3] = 255;
+}
+
+static void RebuildTexture()
+{
+	int w = Map_Width();
+	int h = Map_Height();
+
+	GLint maxsize;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxsize);
+	texelcells = 1;
+	while ((w + texelcells - 1) / texelcells > maxsize || (h + texelcells - 1) / texelcells > maxsize)
+		texelcells *= 2;
+	if (texelcells > 1 && (w != texturew || h != textureh))
+		printf("minimap: %ix%i map is bigger than the max texture size %i, showing one cell in %i\n", w, h, maxsize, texelcells);
+
+	int tw = (w + texelcells - 1) / texelcells;
+	int th = (h + texelcells - 1) / texelcells;
+	unsigned char *pixels = (unsigned char*)Mem_FrameAlloc((size_t)tw * th * 4);
+	for (int y = 0; y < th; y++)
+		for (int x = 0; x < tw; x++)
+			CellColor(x * texelcells, y * texelcells, pixels + ((size_t)y * tw + x) * 4);
+
+	if (!texobj[0])
+		glGenTextures(1, texobj);
+	glBindTexture(GL_TEXTURE_2D, texobj[0]);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, tw, th, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	texturew = w;
+	textureh = h;
+	numdirtycells = 0;
+	rebuild = false;
+}
+
+static void UpdateDirtyCells()
+{
+	glBindTexture(GL_TEXTURE_2D, texobj[0]);
+
+	for (int i = 0; i < numdirtycells; i++)
+	{
+		unsigned char rgba[4];
+		int x = dirtycells[i][0];
+		int y = dirtycells[i][1];
+		if (x % texelcells || y % texelcells)
+			continue;
+
+		CellColor(x, y, rgba);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x / texelcells, y / texelcells, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+	}
+
+	numdirtycells = 0;
+}
+
+// ________________________________________________________________________________
+// external interface
+
+void Minimap_InitWindow();
+void Minimap_Reset();
+void Minimap_UpdateCell(int x, int y);
+void Minimap_Redisplay();
+
+// the map has been loaded or the tile colours have changed
+void Minimap_Reset()
+{
+	rebuild = true;
+	Minimap_Redisplay();
+}
+
+void Minimap_UpdateCell(int x, int y)
+{
+	if (rebuild)
+		return;
+
+	// dragging keeps painting the same cell
+	if (numdirtycells && dirtycells[numdirtycells - 1][0] == x && dirtycells[numdirtycells - 1][1] == y)
+		return;
+
+	if (numdirtycells == MAX_DIRTY_CELLS)
+	{
+		rebuild = true;
+		return;
+	}
+
+	dirtycells[numdirtycells][0] = x;
+	dirtycells[numdirtycells][1] = y;
+	numdirtycells++;
+}
+
+void Minimap_Redisplay()
+{
+	if (minimapwindow)
+		glutPostWindowRedisplay(minimapwindow);
+}
+
+// ________________________________________________________________________________
+// GLUT glue functions
+
+static void ReshapeFunc(int w, int h)
+{
+	windoww = w;
+	windowh = h;
+
+	glViewport(0, 0, w, h);
+}
+
+static void DrawViewRect()
+{
+	float rect[4];
+	View_GetRect(rect);
+
+	glColor3f(1, 0, 0);
+	glBegin(GL_LINE_LOOP);
+	glVertex2f(rect[0], rect[1]);
+	glVertex2f(rect[2], rect[1]);
+	glVertex2f(rect[2], rect[3]);
+	glVertex2f(rect[0], rect[3]);
+	glEnd();
+}
+
+static void DisplayFunc()
+{
+	if (rebuild || texturew != Map_Width() || textureh != Map_Height())
+		RebuildTexture();
+	else if (numdirtycells)
+		UpdateDirtyCells();
+
+	// map cells are the units
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glOrtho(0, texturew, 0, textureh, -1, 1);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+
+	glClearColor(0.3, 0.3, 0.3, 0.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, texobj[0]);
+	glColor3f(1, 1, 1);
+
+	// the last row and column of texels can reach past the map
+	int tw = (texturew + texelcells - 1) / texelcells;
+	int th = (textureh + texelcells - 1) / texelcells;
+	float s = (float)texturew / (tw * texelcells);
+	float t = (float)textureh / (th * texelcells);
+
+	glBegin(GL_TRIANGLE_STRIP);
+	glTexCoord2f(0.0f, 0.0f);
+	glVertex2f(0.0f, 0.0f);
+	glTexCoord2f(s, 0.0f);
+	glVertex2f(texturew, 0.0f);
+	glTexCoord2f(0.0f, t);
+	glVertex2f(0.0f, textureh);
+	glTexCoord2f(s, t);
+	glVertex2f(texturew, textureh);
+	glEnd();
+
+	glDisable(GL_TEXTURE_2D);
+
+	DrawViewRect();
+
+	glutSwapBuffers();
+}
+
+static void MouseFunc(int button, int state, int x, int y)
+{
+	if (button != GLUT_LEFT_BUTTON || state != GLUT_DOWN)
+		return;
+
+	// window pixels to map cells
+	float cellx = (float)x / windoww * Map_Width();
+	float celly = (float)(windowh - y) / windowh * Map_Height();
+
+	View_Center(cellx, celly);
+	Minimap_Redisplay();
+}
+
+static void MouseMotionFunc(int x, int y)
+{
+	MouseFunc(GLUT_LEFT_BUTTON, GLUT_DOWN, x, y);
+}
+
+void Minimap_InitWindow()
+{
+	int w = Map_Width();
+	int h = Map_Height();
+
+	// keep the map's aspect ratio
+	if (w >= h)
+		glutInitWindowSize(MINIMAP_SIZE, MINIMAP_SIZE * h / w);
+	else
+		glutInitWindowSize(MINIMAP_SIZE * w / h, MINIMAP_SIZE);
+
+	minimapwindow = glutCreateWindow("minimap");
+	glutDisplayFunc(DisplayFunc);
+	glutReshapeFunc(ReshapeFunc);
+	glutMouseFunc(MouseFunc);
+	glutMotionFunc(MouseMotionFunc);
+}
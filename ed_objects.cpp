@@ -0,0 +1,486 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <GL/gl.h>
+
+// ________________________________________________________________________________
+// Objects
+// freely positioned objects like spawn points, pickups and triggers. each one
+// is drawn with a tile from the tileset. they are kept in a hash of chunks so
+// picking and drawing only look at the chunks the area covers, and the
+// visible ones are drawn with a single vertex array
+
+#define TILE_SIZE	16
+
+// objects are tile sized and centred on their position
+#define OBJECT_SIZE	TILE_SIZE
+
+// the same size as the map's chunks, in map pixels
+#define OBJECT_CHUNK_PIXELS	256
+
+// power of two
+#define OBJECT_HASH_SIZE	4096
+
+#define OBJECTS_MAGIC	"objects"
+
+static void Error(const char *error, ...)
+{
+	va_list valist;
+	char buffer[2048];
+
+	va_start(valist, error);
+	vsprintf(buffer, error, valist);
+	va_end(valist);
+
+	fprintf(stderr, "\x1b[31m");
+	fprintf(stderr, "Error: %s", buffer);
+	fprintf(stderr, "\x1b[0m");
+	exit(1);
+}
+
+struct pool_t;
+pool_t *Pool_Create(const char *name, size_t itemsize, int itemsperblock);
+void *Pool_Alloc(pool_t *p);
+void Pool_Free(pool_t *p, void *item);
+void *Mem_FrameAlloc(size_t size);
+FILE *Sys_BeginWrite(const char *filename);
+bool Sys_EndWrite(FILE *fp, const char *filename);
+
+struct objchunk_t;
+
+struct object_t
+{
+	float x, y;		// centre in map pixels
+	int tile;
+	object_t *next;		// in the chunk
+	objchunk_t *chunk;
+};
+
+struct objchunk_t
+{
+	int cx, cy;
+	objchunk_t *next;	// in the hash bucket
+	object_t *objects;
+	int numobjects;
+};
+
+// what is written to the file for each object
+struct objectrecord_t
+{
+	float x, y;
+	int tile;
+};
+
+static objchunk_t *buckets[OBJECT_HASH_SIZE];
+static pool_t *objectpool;
+static pool_t *chunkpool;
+static int numobjects;
+
+static int ChunkCoord(float v)
+{
+	return (int)floorf(v / OBJECT_CHUNK_PIXELS);
+}
+
+static objchunk_t **Bucket(int cx, int cy)
+{
+	unsigned int h = (unsigned int)cx * 73856093u ^ (unsigned int)cy * 19349663u;
+	return &buckets[h & (OBJECT_HASH_SIZE - 1)];
+}
+
+static objchunk_t *FindChunk(int cx, int cy)
+{
+	for (objchunk_t *c = *Bucket(cx, cy); c; c = c->next)
+		if (c->cx == cx && c->cy == cy)
+			return c;
+
+	return NULL;
+}
+
+static objchunk_t *GetChunk(int cx, int cy)
+{
+	objchunk_t *c = FindChunk(cx, cy);
+	if (c)
+		return c;
+
+	objchunk_t **bucket = Bucket(cx, cy);
+	c = (objchunk_t*)Pool_Alloc(chunkpool);
+	c->cx = cx;
+	c->cy = cy;
+	c->objects = NULL;
+	c->numobjects = 0;
+	c->next = *bucket;
+	*bucket = c;
+
+	return c;
+}
+
+static void FreeChunk(objchunk_t *c)
+{
+	for (objchunk_t **link = Bucket(c->cx, c->cy); *link; link = &(*link)->next)
+	{
+		if (*link == c)
+		{
+			*link = c->next;
+			break;
+		}
+	}
+
+	Pool_Free(chunkpool, c);
+}
+
+static void LinkObject(object_t *o)
+{
+	objchunk_t *c = GetChunk(ChunkCoord(o->x), ChunkCoord(o->y));
+	o->chunk = c;
+	o->next = c->objects;
+	c->objects = o;
+	c->numobjects++;
+}
+
+// empty chunks are released so the hash only holds chunks with objects
+static void UnlinkObject(object_t *o)
+{
+	objchunk_t *c = o->chunk;
+	for (object_t **link = &c->objects; *link; link = &(*link)->next)
+	{
+		if (*link == o)
+		{
+			*link = o->next;
+			break;
+		}
+	}
+
+	if (!--c->numobjects)
+		FreeChunk(c);
+	o->chunk = NULL;
+}
+
+// objects are filed by their centre so they can reach half their size into
+// the neighbouring chunks
+static void ChunkRange(float x0, float y0, float x1, float y1, int *cx0, int *cy0, int *cx1, int *cy1)
+{
+	*cx0 = ChunkCoord(x0 - OBJECT_SIZE / 2);
+	*cy0 = ChunkCoord(y0 - OBJECT_SIZE / 2);
+	*cx1 = ChunkCoord(x1 + OBJECT_SIZE / 2);
+	*cy1 = ChunkCoord(y1 + OBJECT_SIZE / 2);
+}
+
+static bool Overlaps(const object_t *o, float x0, float y0, float x1, float y1)
+{
+	const float r = OBJECT_SIZE / 2;
+	return o->x + r > x0 && o->x - r < x1 && o->y + r > y0 && o->y - r < y1;
+}
+
+static void Clear()
+{
+	for (int i = 0; i < OBJECT_HASH_SIZE; i++)
+	{
+		for (objchunk_t *c = buckets[i], *nextchunk; c; c = nextchunk)
+		{
+			nextchunk = c->next;
+			for (object_t *o = c->objects, *next; o; o = next)
+			{
+				next = o->next;
+				Pool_Free(objectpool, o);
+			}
+
+			Pool_Free(chunkpool, c);
+		}
+
+		buckets[i] = NULL;
+	}
+
+	numobjects = 0;
+}
+
+// fills objects with up to maxobjects that overlap the rectangle, returns how
+// many overlap in total
+static int QueryObjects(float x0, float y0, float x1, float y1, object_t **objects, int maxobjects)
+{
+	int count = 0;
+
+	int cx0, cy0, cx1, cy1;
+	ChunkRange(x0, y0, x1, y1, &cx0, &cy0, &cx1, &cy1);
+
+	for (int cy = cy0; cy <= cy1; cy++)
+	{
+		for (int cx = cx0; cx <= cx1; cx++)
+		{
+			objchunk_t *c = FindChunk(cx, cy);
+			if (!c)
+				continue;
+
+			for (object_t *o = c->objects; o; o = o->next)
+			{
+				if (!Overlaps(o, x0, y0, x1, y1))
+					continue;
+
+				if (count < maxobjects)
+					objects[count] = o;
+				count++;
+			}
+		}
+	}
+
+	return count;
+}
+
+// ________________________________________________________________________________
+// external interface
+
+struct object_t;
+object_t *Objects_Place(float x, float y, int tile);
+void Objects_Remove(object_t *o);
+void Objects_Move(object_t *o, float x, float y);
+object_t *Objects_Pick(float x, float y);
+int Objects_Count();
+void Objects_Draw(float x0, float y0, float x1, float y1, GLuint atlas, int tilew, int tileh);
+void Objects_DrawSelection(object_t *o);
+bool Objects_Save(const char *mapname);
+void Objects_Load(const char *mapname);
+
+object_t *Objects_Place(float x, float y, int tile)
+{
+	if (!objectpool)
+	{
+		objectpool = Pool_Create("objects", sizeof(object_t), 1024);
+		chunkpool = Pool_Create("objects", sizeof(objchunk_t), 256);
+	}
+
+	object_t *o = (object_t*)Pool_Alloc(objectpool);
+	o->x = x;
+	o->y = y;
+	o->tile = tile;
+	LinkObject(o);
+	numobjects++;
+
+	return o;
+}
+
+void Objects_Remove(object_t *o)
+{
+	UnlinkObject(o);
+	Pool_Free(objectpool, o);
+	numobjects--;
+}
+
+void Objects_Move(object_t *o, float x, float y)
+{
+	o->x = x;
+	o->y = y;
+
+	// only refiled when it crosses into another chunk
+	if (o->chunk->cx != ChunkCoord(x) || o->chunk->cy != ChunkCoord(y))
+	{
+		UnlinkObject(o);
+		LinkObject(o);
+	}
+}
+
+// the object under the point with its centre nearest to it, x and y are in
+// map pixels
+object_t *Objects_Pick(float x, float y)
+{
+	object_t *best = NULL;
+	float bestdist = 0;
+
+	int cx0, cy0, cx1, cy1;
+	ChunkRange(x, y, x, y, &cx0, &cy0, &cx1, &cy1);
+
+	for (int cy = cy0; cy <= cy1; cy++)
+	{
+		for (int cx = cx0; cx <= cx1; cx++)
+		{
+			objchunk_t *c = FindChunk(cx, cy);
+			if (!c)
+				continue;
+
+			for (object_t *o = c->objects; o; o = o->next)
+			{
+				if (!Overlaps(o, x, y, x, y))
+					continue;
+
+				float dist = fabsf(o->x - x) + fabsf(o->y - y);
+				if (!best || dist < bestdist)
+				{
+					best = o;
+					bestdist = dist;
+				}
+			}
+		}
+	}
+
+	return best;
+}
+
+int Objects_Count()
+{
+	return numobjects;
+}
+
+struct objectvertex_t
+{
+	float s, t;
+	float x, y;
+};
+
+static void SetVertex(objectvertex_t *v, float s, float t, float x, float y)
+{
+	v->s = s;
+	v->t = t;
+	v->x = x;
+	v->y = y;
+}
+
+// x0, y0, x1, y1 is the visible area in map pixels. the quads are built in
+// frame memory and drawn with one call
+void Objects_Draw(float x0, float y0, float x1, float y1, GLuint atlas, int tilew, int tileh)
+{
+	if (!numobjects || !tilew || !tileh)
+		return;
+
+	int cx0, cy0, cx1, cy1;
+	ChunkRange(x0, y0, x1, y1, &cx0, &cy0, &cx1, &cy1);
+
+	// size the array from the chunks in view
+	int maxobjects = 0;
+	for (int cy = cy0; cy <= cy1; cy++)
+	{
+		for (int cx = cx0; cx <= cx1; cx++)
+		{
+			objchunk_t *c = FindChunk(cx, cy);
+			if (c)
+				maxobjects += c->numobjects;
+		}
+	}
+
+	if (!maxobjects)
+		return;
+
+	object_t **objects = (object_t**)Mem_FrameAlloc(maxobjects * sizeof(object_t*));
+	int numvisible = QueryObjects(x0, y0, x1, y1, objects, maxobjects);
+	if (!numvisible)
+		return;
+
+	objectvertex_t *vertices = (objectvertex_t*)Mem_FrameAlloc(numvisible * 4 * sizeof(objectvertex_t));
+	objectvertex_t *v = vertices;
+
+	const float tcsizex = 1.0f / tilew;
+	const float tcsizey = 1.0f / tileh;
+	const float r = OBJECT_SIZE / 2;
+
+	for (int i = 0; i < numvisible; i++)
+	{
+		const object_t *o = objects[i];
+		float s = (o->tile % tilew) * tcsizex;
+		float t = (o->tile / tilew) * tcsizey;
+
+		SetVertex(v++, s, t, o->x - r, o->y - r);
+		SetVertex(v++, s + tcsizex, t, o->x + r, o->y - r);
+		SetVertex(v++, s + tcsizex, t + tcsizey, o->x + r, o->y + r);
+		SetVertex(v++, s, t + tcsizey, o->x - r, o->y + r);
+	}
+
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, atlas);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glColor3f(1, 1, 1);
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glTexCoordPointer(2, GL_FLOAT, sizeof(objectvertex_t), &vertices[0].s);
+	glVertexPointer(2, GL_FLOAT, sizeof(objectvertex_t), &vertices[0].x);
+	glDrawArrays(GL_QUADS, 0, v - vertices);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+
+	glDisable(GL_TEXTURE_2D);
+	glDisable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ZERO);
+}
+
+void Objects_DrawSelection(object_t *o)
+{
+	if (!o)
+		return;
+
+	const float r = OBJECT_SIZE / 2;
+
+	glColor3f(1, 0, 0);
+	glBegin(GL_LINE_LOOP);
+	glVertex2f(o->x - r, o->y - r);
+	glVertex2f(o->x + r, o->y - r);
+	glVertex2f(o->x + r, o->y + r);
+	glVertex2f(o->x - r, o->y + r);
+	glEnd();
+}
+
+// objects are kept next to the map in the same style as its header
+// objects 100
+// data<records>
+// returns false if the file couldn't be written
+bool Objects_Save(const char *mapname)
+{
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "%s.objects", mapname);
+
+	if (!numobjects)
+	{
+		remove(filename);
+		return true;
+	}
+
+	// written beside the old file so a failed save leaves it intact
+	FILE *fp = Sys_BeginWrite(filename);
+	if (!fp)
+		return false;
+
+	fprintf(fp, "%s %i\ndata", OBJECTS_MAGIC, numobjects);
+	for (int i = 0; i < OBJECT_HASH_SIZE; i++)
+	{
+		for (objchunk_t *c = buckets[i]; c; c = c->next)
+		{
+			for (object_t *o = c->objects; o; o = o->next)
+			{
+				objectrecord_t r = { o->x, o->y, o->tile };
+				fwrite(&r, sizeof(r), 1, fp);
+			}
+		}
+	}
+
+	return Sys_EndWrite(fp, filename);
+}
+
+// a map without an objects file has no objects
+void Objects_Load(const char *mapname)
+{
+	Clear();
+
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "%s.objects", mapname);
+
+	FILE *fp = fopen(filename, "rb");
+	if (!fp)
+		return;
+
+	// fscanf only counts the conversion, %n tells if "data" matched too
+	int count;
+	int headerlength = 0;
+	if (fscanf(fp, OBJECTS_MAGIC " %i\ndata%n", &count, &headerlength) != 1 || !headerlength || count < 0)
+		Error("Objects file \"%s\" is corrupt\n", filename);
+
+	objectrecord_t r;
+	for (int i = 0; i < count; i++)
+	{
+		if (fread(&r, sizeof(r), 1, fp) != 1)
+			Error("Objects file \"%s\" is truncated\n", filename);
+
+		Objects_Place(r.x, r.y, r.tile);
+	}
+
+	fclose(fp);
+	printf("loaded %i objects\n", numobjects);
+}
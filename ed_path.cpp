@@ -0,0 +1,678 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// ________________________________________________________________________________
+// Pathfinding
+// a cell can be walked through unless its collision class is solid. short
+// queries run a grid A* inside a window around the two ends. long ones run
+// over an abstract graph built per chunk: wherever a chunk border can be
+// crossed there is an entrance node on each side, and each chunk stores the
+// walking distances between its own nodes. an edit only marks the chunks
+// whose cells or entrances it changed, and those are rebuilt when next used
+
+#define CHUNK_SIZE	16
+#define CHUNK_CELLS	(CHUNK_SIZE * CHUNK_SIZE)
+
+// at most 8 entrances on each border and a long one has a node at each end,
+// but only 8 nodes fit along a border so this can't overflow
+#define MAX_CHUNK_NODES	32
+
+// entrances this wide or wider get a node at each end instead of the middle
+#define LONG_ENTRANCE	6
+
+// queries closer than this try the grid search first
+#define SHORT_QUERY	(2 * CHUNK_SIZE)
+
+// how far the grid search window can grow around the two ends
+#define MAX_SHORT_MARGIN	(4 * CHUNK_SIZE)
+
+#define UNREACHABLE	0xffff
+
+char Map_GetClass(int x, int y);
+int Mem_Subsystem(const char *name);
+void *Mem_Alloc(int subsystem, size_t size);
+void *Mem_Calloc(int subsystem, size_t size);
+void Mem_Free(void *p);
+void *Mem_FrameAlloc(size_t size);
+
+struct pathchunk_t
+{
+	bool dirty;
+	int numnodes;
+	unsigned char nodex[MAX_CHUNK_NODES];	// in the chunk
+	unsigned char nodey[MAX_CHUNK_NODES];
+	unsigned short dist[MAX_CHUNK_NODES][MAX_CHUNK_NODES];
+	bool reachable[MAX_CHUNK_NODES];	// from the origin
+};
+
+static pathchunk_t *chunks;
+static int mapw;
+static int maph;
+static int chunksx;
+static int chunksy;
+
+static int originx = -1;
+static int originy;
+static bool reachdirty = true;
+
+static int pathmemory = -1;
+
+// search state for the abstract graph, the generation saves clearing it
+static unsigned int *nodecost;
+static unsigned int *nodegeneration;
+static unsigned int generation;
+
+static bool Passable(int x, int y)
+{
+	if (x < 0 || y < 0 || x >= mapw || y >= maph)
+		return false;
+
+	return Map_GetClass(x, y) != '#';
+}
+
+static int Abs(int v)
+{
+	return v < 0 ? -v : v;
+}
+
+static int Distance(int x0, int y0, int x1, int y1)
+{
+	return Abs(x1 - x0) + Abs(y1 - y0);
+}
+
+// ________________________________________________________________________________
+// Binary heap of keys ordered by cost
+
+struct heapitem_t
+{
+	unsigned int cost;
+	int key;
+};
+
+// kept between searches and grown as needed
+struct heap_t
+{
+	heapitem_t *items;
+	int numitems;
+	int maxitems;
+};
+
+static heap_t openlist;
+
+static void HeapPush(heap_t *h, unsigned int cost, int key)
+{
+	if (h->numitems == h->maxitems)
+	{
+		int maxitems = h->maxitems ? h->maxitems * 2 : 4096;
+		heapitem_t *items = (heapitem_t*)Mem_Alloc(pathmemory, maxitems * sizeof(heapitem_t));
+		memcpy(items, h->items, h->numitems * sizeof(heapitem_t));
+		Mem_Free(h->items);
+		h->items = items;
+		h->maxitems = maxitems;
+	}
+
+	int i = h->numitems++;
+	while (i > 0)
+	{
+		int parent = (i - 1) / 2;
+		if (h->items[parent].cost <= cost)
+			break;
+
+		h->items[i] = h->items[parent];
+		i = parent;
+	}
+
+	h->items[i].cost = cost;
+	h->items[i].key = key;
+}
+
+static heapitem_t HeapPop(heap_t *h)
+{
+	heapitem_t top = h->items[0];
+	heapitem_t last = h->items[--h->numitems];
+
+	int i = 0;
+	for (;;)
+	{
+		int child = 2 * i + 1;
+		if (child >= h->numitems)
+			break;
+		if (child + 1 < h->numitems && h->items[child + 1].cost < h->items[child].cost)
+			child++;
+		if (last.cost <= h->items[child].cost)
+			break;
+
+		h->items[i] = h->items[child];
+		i = child;
+	}
+
+	if (h->numitems)
+		h->items[i] = last;
+
+	return top;
+}
+
+// ________________________________________________________________________________
+// Chunks
+
+static const int offsets[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+
+// breadth first inside the chunk from the seeded cells, dist holds a
+// distance per cell and the seeds have theirs set, everything else is
+// UNREACHABLE
+static void ChunkFlood(int cx, int cy, unsigned short *dist)
+{
+	int queue[CHUNK_CELLS];
+	int head = 0, tail = 0;
+
+	for (int i = 0; i < CHUNK_CELLS; i++)
+		if (dist[i] != UNREACHABLE)
+			queue[tail++] = i;
+
+	int x0 = cx * CHUNK_SIZE;
+	int y0 = cy * CHUNK_SIZE;
+
+	while (head < tail)
+	{
+		int cell = queue[head++];
+		int x = cell % CHUNK_SIZE;
+		int y = cell / CHUNK_SIZE;
+
+		for (int i = 0; i < 4; i++)
+		{
+			int nx = x + offsets[i][0];
+			int ny = y + offsets[i][1];
+			if (nx < 0 || ny < 0 || nx >= CHUNK_SIZE || ny >= CHUNK_SIZE)
+				continue;
+
+			int next = ny * CHUNK_SIZE + nx;
+			if (dist[next] != UNREACHABLE || !Passable(x0 + nx, y0 + ny))
+				continue;
+
+			dist[next] = dist[cell] + 1;
+			queue[tail++] = next;
+		}
+	}
+}
+
+static void AddNode(pathchunk_t *c, int x, int y)
+{
+	for (int i = 0; i < c->numnodes; i++)
+		if (c->nodex[i] == x && c->nodey[i] == y)
+			return;
+
+	c->nodex[c->numnodes] = x;
+	c->nodey[c->numnodes] = y;
+	c->numnodes++;
+}
+
+// side is an index into offsets. the cells along the border are open where
+// both they and the cell across are passable, and each run of open cells is
+// an entrance. both chunks work this out the same way so their nodes pair up
+static void FindEntrances(pathchunk_t *c, int cx, int cy, int side)
+{
+	int dx = offsets[side][0];
+	int dy = offsets[side][1];
+
+	// the cell across the border has to be on the map
+	int across = dx ? cx + dx : cy + dy;
+	if (across < 0 || across >= (dx ? chunksx : chunksy))
+		return;
+
+	int runstart = -1;
+	for (int i = 0; i <= CHUNK_SIZE; i++)
+	{
+		// the border cell in the chunk, walking along the side
+		int lx = dx ? (dx < 0 ? 0 : CHUNK_SIZE - 1) : i;
+		int ly = dy ? (dy < 0 ? 0 : CHUNK_SIZE - 1) : i;
+		int x = cx * CHUNK_SIZE + lx;
+		int y = cy * CHUNK_SIZE + ly;
+
+		bool open = i < CHUNK_SIZE && Passable(x, y) && Passable(x + dx, y + dy);
+		if (open && runstart < 0)
+			runstart = i;
+		if (open || runstart < 0)
+			continue;
+
+		// the run has ended
+		int runend = i - 1;
+		int ends[2] = { runstart, runend };
+		int numends = runend - runstart + 1 >= LONG_ENTRANCE ? 2 : 1;
+		if (numends == 1)
+			ends[0] = (runstart + runend) / 2;
+
+		for (int j = 0; j < numends; j++)
+		{
+			int nx = dx ? lx : ends[j];
+			int ny = dy ? ly : ends[j];
+			AddNode(c, nx, ny);
+		}
+
+		runstart = -1;
+	}
+}
+
+static void BuildChunk(int cx, int cy)
+{
+	pathchunk_t *c = &chunks[cy * chunksx + cx];
+	c->numnodes = 0;
+
+	for (int side = 0; side < 4; side++)
+		FindEntrances(c, cx, cy, side);
+
+	for (int i = 0; i < c->numnodes; i++)
+	{
+		unsigned short dist[CHUNK_CELLS];
+		memset(dist, 0xff, sizeof(dist));
+		dist[c->nodey[i] * CHUNK_SIZE + c->nodex[i]] = 0;
+		ChunkFlood(cx, cy, dist);
+
+		for (int j = 0; j < c->numnodes; j++)
+			c->dist[i][j] = dist[c->nodey[j] * CHUNK_SIZE + c->nodex[j]];
+	}
+
+	c->dirty = false;
+}
+
+static pathchunk_t *GetChunk(int cx, int cy)
+{
+	pathchunk_t *c = &chunks[cy * chunksx + cx];
+	if (c->dirty)
+		BuildChunk(cx, cy);
+
+	return c;
+}
+
+static int FindNode(pathchunk_t *c, int lx, int ly)
+{
+	for (int i = 0; i < c->numnodes; i++)
+		if (c->nodex[i] == lx && c->nodey[i] == ly)
+			return i;
+
+	return -1;
+}
+
+// the node across the border from node i of the chunk, returns the chunk
+// index and node as a key or -1
+static int NodeAcross(int cx, int cy, pathchunk_t *c, int i, int side)
+{
+	int x = cx * CHUNK_SIZE + c->nodex[i] + offsets[side][0];
+	int y = cy * CHUNK_SIZE + c->nodey[i] + offsets[side][1];
+	int ncx = x / CHUNK_SIZE;
+	int ncy = y / CHUNK_SIZE;
+	if (x < 0 || y < 0 || x >= mapw || y >= maph || (ncx == cx && ncy == cy))
+		return -1;
+
+	int node = FindNode(GetChunk(ncx, ncy), x % CHUNK_SIZE, y % CHUNK_SIZE);
+	if (node < 0)
+		return -1;
+
+	return (ncy * chunksx + ncx) * MAX_CHUNK_NODES + node;
+}
+
+// ________________________________________________________________________________
+// Searches
+
+// A* over the cells inside the window, returns the path length or -1
+static int GridSearch(int sx, int sy, int gx, int gy, int wx0, int wy0, int wx1, int wy1)
+{
+	if (wx0 < 0)
+		wx0 = 0;
+	if (wy0 < 0)
+		wy0 = 0;
+	if (wx1 > mapw - 1)
+		wx1 = mapw - 1;
+	if (wy1 > maph - 1)
+		wy1 = maph - 1;
+
+	int w = wx1 - wx0 + 1;
+	int h = wy1 - wy0 + 1;
+	unsigned int *cost = (unsigned int*)Mem_FrameAlloc(w * h * sizeof(unsigned int));
+	memset(cost, 0xff, w * h * sizeof(unsigned int));
+
+	heap_t *heap = &openlist;
+	heap->numitems = 0;
+
+	int start = (sy - wy0) * w + (sx - wx0);
+	cost[start] = 0;
+	HeapPush(heap, Distance(sx, sy, gx, gy), start);
+
+	while (heap->numitems)
+	{
+		heapitem_t item = HeapPop(heap);
+		int x = item.key % w + wx0;
+		int y = item.key / w + wy0;
+		unsigned int g = cost[item.key];
+
+		if (x == gx && y == gy)
+			return g;
+		if (item.cost != g + Distance(x, y, gx, gy))
+			continue;	// superseded
+
+		for (int i = 0; i < 4; i++)
+		{
+			int nx = x + offsets[i][0];
+			int ny = y + offsets[i][1];
+			if (nx < wx0 || ny < wy0 || nx > wx1 || ny > wy1 || !Passable(nx, ny))
+				continue;
+
+			int next = (ny - wy0) * w + (nx - wx0);
+			if (cost[next] <= g + 1)
+				continue;
+
+			cost[next] = g + 1;
+			HeapPush(heap, g + 1 + Distance(nx, ny, gx, gy), next);
+		}
+	}
+
+	return -1;
+}
+
+static unsigned int NodeCost(int key)
+{
+	return nodegeneration[key] == generation ? nodecost[key] : 0xffffffff;
+}
+
+static bool SetNodeCost(int key, unsigned int cost)
+{
+	if (NodeCost(key) <= cost)
+		return false;
+
+	nodegeneration[key] = generation;
+	nodecost[key] = cost;
+	return true;
+}
+
+// distances from the cell to each node of its chunk
+static void CellToNodes(int x, int y, unsigned short *nodedist)
+{
+	int cx = x / CHUNK_SIZE;
+	int cy = y / CHUNK_SIZE;
+	pathchunk_t *c = GetChunk(cx, cy);
+
+	unsigned short dist[CHUNK_CELLS];
+	memset(dist, 0xff, sizeof(dist));
+	dist[(y % CHUNK_SIZE) * CHUNK_SIZE + x % CHUNK_SIZE] = 0;
+	ChunkFlood(cx, cy, dist);
+
+	for (int i = 0; i < c->numnodes; i++)
+		nodedist[i] = dist[c->nodey[i] * CHUNK_SIZE + c->nodex[i]];
+}
+
+// A* over the entrance nodes. the goal is a node of its own reached from the
+// nodes of its chunk
+static int AbstractSearch(int sx, int sy, int gx, int gy)
+{
+	int goalchunk = (gy / CHUNK_SIZE) * chunksx + gx / CHUNK_SIZE;
+	unsigned short startdist[MAX_CHUNK_NODES];
+	unsigned short goaldist[MAX_CHUNK_NODES];
+	CellToNodes(sx, sy, startdist);
+	CellToNodes(gx, gy, goaldist);
+
+	generation++;
+	unsigned int best = 0xffffffff;
+
+	heap_t *heap = &openlist;
+	heap->numitems = 0;
+
+	int startchunk = (sy / CHUNK_SIZE) * chunksx + sx / CHUNK_SIZE;
+	pathchunk_t *sc = GetChunk(sx / CHUNK_SIZE, sy / CHUNK_SIZE);
+	for (int i = 0; i < sc->numnodes; i++)
+	{
+		if (startdist[i] == UNREACHABLE)
+			continue;
+
+		int key = startchunk * MAX_CHUNK_NODES + i;
+		SetNodeCost(key, startdist[i]);
+		int x = (startchunk % chunksx) * CHUNK_SIZE + sc->nodex[i];
+		int y = (startchunk / chunksx) * CHUNK_SIZE + sc->nodey[i];
+		HeapPush(heap, startdist[i] + Distance(x, y, gx, gy), key);
+	}
+
+	while (heap->numitems)
+	{
+		heapitem_t item = HeapPop(heap);
+		if (item.cost >= best)
+			break;
+
+		int chunk = item.key / MAX_CHUNK_NODES;
+		int node = item.key % MAX_CHUNK_NODES;
+		int cx = chunk % chunksx;
+		int cy = chunk / chunksx;
+		pathchunk_t *c = GetChunk(cx, cy);
+		unsigned int g = NodeCost(item.key);
+
+		int x = cx * CHUNK_SIZE + c->nodex[node];
+		int y = cy * CHUNK_SIZE + c->nodey[node];
+		if (item.cost != g + Distance(x, y, gx, gy))
+			continue;	// superseded
+
+		if (chunk == goalchunk && goaldist[node] != UNREACHABLE && g + goaldist[node] < best)
+			best = g + goaldist[node];
+
+		// across the chunk
+		for (int i = 0; i < c->numnodes; i++)
+		{
+			if (c->dist[node][i] == UNREACHABLE)
+				continue;
+
+			int key = chunk * MAX_CHUNK_NODES + i;
+			unsigned int cost = g + c->dist[node][i];
+			if (SetNodeCost(key, cost))
+				HeapPush(heap, cost + Distance(cx * CHUNK_SIZE + c->nodex[i], cy * CHUNK_SIZE + c->nodey[i], gx, gy), key);
+		}
+
+		// into the neighbouring chunks
+		for (int side = 0; side < 4; side++)
+		{
+			int key = NodeAcross(cx, cy, c, node, side);
+			if (key < 0 || !SetNodeCost(key, g + 1))
+				continue;
+
+			int nx = x + offsets[side][0];
+			int ny = y + offsets[side][1];
+			HeapPush(heap, g + 1 + Distance(nx, ny, gx, gy), key);
+		}
+	}
+
+	return best == 0xffffffff ? -1 : (int)best;
+}
+
+// flood over the nodes from the ones the origin can walk to
+static void UpdateReachability()
+{
+	reachdirty = false;
+
+	for (int i = 0; i < chunksx * chunksy; i++)
+		memset(chunks[i].reachable, 0, sizeof(chunks[i].reachable));
+
+	if (originx < 0 || !Passable(originx, originy))
+		return;
+
+	int *queue = (int*)Mem_FrameAlloc(chunksx * chunksy * MAX_CHUNK_NODES * sizeof(int));
+	int head = 0, tail = 0;
+
+	unsigned short origindist[MAX_CHUNK_NODES];
+	CellToNodes(originx, originy, origindist);
+
+	int originchunk = (originy / CHUNK_SIZE) * chunksx + originx / CHUNK_SIZE;
+	pathchunk_t *oc = &chunks[originchunk];
+	for (int i = 0; i < oc->numnodes; i++)
+	{
+		if (origindist[i] == UNREACHABLE)
+			continue;
+
+		oc->reachable[i] = true;
+		queue[tail++] = originchunk * MAX_CHUNK_NODES + i;
+	}
+
+	while (head < tail)
+	{
+		int key = queue[head++];
+		int chunk = key / MAX_CHUNK_NODES;
+		int node = key % MAX_CHUNK_NODES;
+		int cx = chunk % chunksx;
+		int cy = chunk / chunksx;
+		pathchunk_t *c = GetChunk(cx, cy);
+
+		for (int i = 0; i < c->numnodes; i++)
+		{
+			if (c->dist[node][i] == UNREACHABLE || c->reachable[i])
+				continue;
+
+			c->reachable[i] = true;
+			queue[tail++] = chunk * MAX_CHUNK_NODES + i;
+		}
+
+		for (int side = 0; side < 4; side++)
+		{
+			int across = NodeAcross(cx, cy, c, node, side);
+			if (across < 0)
+				continue;
+
+			pathchunk_t *n = &chunks[across / MAX_CHUNK_NODES];
+			if (n->reachable[across % MAX_CHUNK_NODES])
+				continue;
+
+			n->reachable[across % MAX_CHUNK_NODES] = true;
+			queue[tail++] = across;
+		}
+	}
+}
+
+// ________________________________________________________________________________
+// external interface
+
+void Path_Reset(int w, int h);
+void Path_CellChanged(int x, int y);
+int Path_Find(int sx, int sy, int gx, int gy);
+void Path_SetOrigin(int x, int y);
+bool Path_GetOrigin(int *x, int *y);
+void Path_ChunkReachability(int cx, int cy, unsigned char *cells);
+
+// the map has been loaded or resized, everything is rebuilt as it's used
+void Path_Reset(int w, int h)
+{
+	if (pathmemory < 0)
+		pathmemory = Mem_Subsystem("path");
+
+	Mem_Free(chunks);
+	Mem_Free(nodecost);
+	Mem_Free(nodegeneration);
+
+	mapw = w;
+	maph = h;
+	chunksx = w / CHUNK_SIZE;
+	chunksy = h / CHUNK_SIZE;
+
+	int numchunks = chunksx * chunksy;
+	chunks = (pathchunk_t*)Mem_Calloc(pathmemory, numchunks * sizeof(pathchunk_t));
+	nodecost = (unsigned int*)Mem_Calloc(pathmemory, numchunks * MAX_CHUNK_NODES * sizeof(unsigned int));
+	nodegeneration = (unsigned int*)Mem_Calloc(pathmemory, numchunks * MAX_CHUNK_NODES * sizeof(unsigned int));
+	generation = 0;
+
+	for (int i = 0; i < numchunks; i++)
+		chunks[i].dirty = true;
+
+	if (originx >= w || originy >= h)
+		originx = -1;
+	reachdirty = true;
+}
+
+// the cell's collision class has changed. a border cell also changes the
+// entrances of the chunk across the border
+void Path_CellChanged(int x, int y)
+{
+	int cx = x / CHUNK_SIZE;
+	int cy = y / CHUNK_SIZE;
+	int lx = x % CHUNK_SIZE;
+	int ly = y % CHUNK_SIZE;
+
+	chunks[cy * chunksx + cx].dirty = true;
+	if (lx == 0 && cx > 0)
+		chunks[cy * chunksx + cx - 1].dirty = true;
+	if (lx == CHUNK_SIZE - 1 && cx < chunksx - 1)
+		chunks[cy * chunksx + cx + 1].dirty = true;
+	if (ly == 0 && cy > 0)
+		chunks[(cy - 1) * chunksx + cx].dirty = true;
+	if (ly == CHUNK_SIZE - 1 && cy < chunksy - 1)
+		chunks[(cy + 1) * chunksx + cx].dirty = true;
+
+	reachdirty = true;
+}
+
+// length of the shortest walk between the cells, -1 if there isn't one. long
+// walks through the abstract graph can be slightly longer than the shortest
+int Path_Find(int sx, int sy, int gx, int gy)
+{
+	if (!Passable(sx, sy) || !Passable(gx, gy))
+		return -1;
+
+	// a walk that leaves the window is at least twice the margin longer than
+	// the straight distance, so anything shorter found inside it is the
+	// shortest. otherwise the window is widened
+	int distance = Distance(sx, sy, gx, gy);
+	int length = -1;
+	if (distance <= SHORT_QUERY)
+	{
+		for (int margin = CHUNK_SIZE; margin <= MAX_SHORT_MARGIN; margin *= 2)
+		{
+			int x0 = (sx < gx ? sx : gx) - margin;
+			int y0 = (sy < gy ? sy : gy) - margin;
+			int x1 = (sx > gx ? sx : gx) + margin;
+			int y1 = (sy > gy ? sy : gy) + margin;
+
+			length = GridSearch(sx, sy, gx, gy, x0, y0, x1, y1);
+			if (length >= 0 && length <= distance + 2 * margin)
+				return length;
+		}
+	}
+
+	int abstract = AbstractSearch(sx, sy, gx, gy);
+	if (length >= 0 && (abstract < 0 || length < abstract))
+		return length;
+
+	return abstract;
+}
+
+void Path_SetOrigin(int x, int y)
+{
+	originx = x;
+	originy = y;
+	reachdirty = true;
+}
+
+bool Path_GetOrigin(int *x, int *y)
+{
+	*x = originx;
+	*y = originy;
+	return originx >= 0;
+}
+
+// fills cells with 0 for solid, 1 for cells that can't be reached from the
+// origin and 2 for cells that can
+void Path_ChunkReachability(int cx, int cy, unsigned char *cells)
+{
+	if (reachdirty)
+		UpdateReachability();
+
+	pathchunk_t *c = GetChunk(cx, cy);
+
+	unsigned short dist[CHUNK_CELLS];
+	memset(dist, 0xff, sizeof(dist));
+	for (int i = 0; i < c->numnodes; i++)
+		if (c->reachable[i])
+			dist[c->nodey[i] * CHUNK_SIZE + c->nodex[i]] = 0;
+	if (originx >= 0 && originx / CHUNK_SIZE == cx && originy / CHUNK_SIZE == cy && Passable(originx, originy))
+		dist[(originy % CHUNK_SIZE) * CHUNK_SIZE + originx % CHUNK_SIZE] = 0;
+	ChunkFlood(cx, cy, dist);
+
+	for (int i = 0; i < CHUNK_CELLS; i++)
+	{
+		if (!Passable(cx * CHUNK_SIZE + i % CHUNK_SIZE, cy * CHUNK_SIZE + i / CHUNK_SIZE))
+			cells[i] = 0;
+		else
+			cells[i] = dist[i] == UNREACHABLE ? 1 : 2;
+	}
+}
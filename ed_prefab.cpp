@@ -0,0 +1,1068 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <GL/gl.h>
+
+// ________________________________________________________________________________
+// Prefabs
+// a prefab is a block of cells on every layer, a building or a rock cluster,
+// that is placed by reference. an instance only keeps where it is and the
+// cells painted over on it, its tiles are written into the map from the
+// prefab when it's placed, and again whenever the prefab is edited. a cell
+// the prefab leaves at 0 keeps the map's tile. later instances cover earlier
+// ones where they overlap. each instance also keeps the tiles it covered
+// where it has a tile of its own, so they come back when it's removed. only
+// the tiles that weren't 0 are kept, and as instances come and go each one
+// keeps what is showing beneath it
+//
+// placing, removing and editing through an instance go in the journal as
+// one operation. placing and removing also record the instance itself by
+// its serial, so undo and redo take it away or bring it back along with its
+// tiles. the serials are kept in the instances file so the journal still
+// finds them after a crash
+//
+// the library belongs to the tileset, the tile numbers only mean something
+// there, and is kept next to it. the instances are kept next to the map. the
+// map file still holds the written out tiles so the game and the tools read
+// it as before
+
+#define NUM_LAYERS	4
+#define CHUNK_SIZE	16
+
+#define MAX_PREFABS	1024
+#define MAX_PREFAB_SIZE	64
+
+#define PREFABS_MAGIC	"prefabs"
+#define INSTANCES_MAGIC	"instances"
+#define INSTANCES_VERSION	3
+
+static void Error(const char *error, ...)
+{
+	va_list valist;
+	char buffer[2048];
+
+	va_start(valist, error);
+	vsprintf(buffer, error, valist);
+	va_end(valist);
+
+	fprintf(stderr, "\x1b[31m");
+	fprintf(stderr, "Error: %s", buffer);
+	fprintf(stderr, "\x1b[0m");
+	exit(1);
+}
+
+int Map_Width();
+int Map_Height();
+int Map_GetTile(int layer, int x, int y);
+void Map_SetTile(int layer, int x, int y, int tile);
+int Mem_Subsystem(const char *name);
+void *Mem_Alloc(int subsystem, size_t size);
+void *Mem_Calloc(int subsystem, size_t size);
+void Mem_Free(void *p);
+void *Mem_FrameAlloc(size_t size);
+struct pool_t;
+pool_t *Pool_Create(const char *name, size_t itemsize, int itemsperblock);
+void *Pool_Alloc(pool_t *p);
+void Pool_Free(pool_t *p, void *item);
+void Journal_BeginGroup();
+void Journal_EndGroup();
+void Journal_Record(int layer, int x, int y, int oldtile, int newtile);
+void Journal_RecordInstance(bool placed, int prefab, int x, int y, int serial, bool mapisbase);
+FILE *Sys_BeginWrite(const char *filename);
+bool Sys_EndWrite(FILE *fp, const char *filename);
+
+struct instance_t;
+
+struct prefab_t
+{
+	int w, h;
+	int *tiles;		// layer by layer, each row by row from the bottom
+	instance_t *instances;
+	int numinstances;
+};
+
+// a tile kept for one cell of an instance
+struct override_t
+{
+	int layer;
+	int cell;		// y * w + x in the prefab
+	int tile;
+};
+
+struct celllist_t
+{
+	override_t *cells;
+	int numcells;
+	int maxcells;
+};
+
+struct instance_t
+{
+	int prefab;
+	int x, y;		// bottom left cell on the map
+	int serial;		// order of placement
+	celllist_t overrides;	// cells painted over on this instance
+	celllist_t base;	// what it covers where it has a say, if not 0
+	instance_t *next;	// of the prefab
+	unsigned int drawframe;
+};
+
+// the instances reaching into each map chunk
+struct instref_t
+{
+	instance_t *instance;
+	instref_t *next;
+};
+
+// what is written to the instances file for each instance, followed by its
+// overrides and then its base, in the same form. version 1 files have no base
+// and version 2 files no serial
+struct instancerecord_t
+{
+	int prefab;
+	int x, y;
+	int numoverrides;
+	int numbases;
+	int serial;
+};
+
+static prefab_t prefabs[MAX_PREFABS];
+static int numprefabs;
+static bool librarychanged;
+static char libraryname[1024];
+
+static instref_t **chunkrefs;
+static int mapw;
+static int maph;
+static int chunksx;
+static int numinstances;
+static int nextserial;
+
+// set while the map is written from the instances, so those writes aren't
+// taken as painting over them
+static bool materializing;
+
+// set while an edit is being made, so the map writes go in the journal.
+// loading writes the instances out again without it
+static bool journaling;
+
+static unsigned int drawframe;
+
+static int prefabmemory = -1;
+static pool_t *instancepool;
+static pool_t *refpool;
+
+static void InitMemory()
+{
+	if (prefabmemory >= 0)
+		return;
+
+	prefabmemory = Mem_Subsystem("prefabs");
+	instancepool = Pool_Create("prefabs", sizeof(instance_t), 1024);
+	refpool = Pool_Create("prefabs", sizeof(instref_t), 1024);
+}
+
+static int PrefabTile(const prefab_t *p, int layer, int cell)
+{
+	return p->tiles[layer * p->w * p->h + cell];
+}
+
+static override_t *FindCell(celllist_t *l, int layer, int cell)
+{
+	for (int i = 0; i < l->numcells; i++)
+		if (l->cells[i].layer == layer && l->cells[i].cell == cell)
+			return &l->cells[i];
+
+	return NULL;
+}
+
+static void SetCell(celllist_t *l, int layer, int cell, int tile)
+{
+	override_t *o = FindCell(l, layer, cell);
+	if (o)
+	{
+		o->tile = tile;
+		return;
+	}
+
+	if (l->numcells == l->maxcells)
+	{
+		int max = l->maxcells ? l->maxcells * 2 : 8;
+		override_t *cells = (override_t*)Mem_Alloc(prefabmemory, max * sizeof(override_t));
+		memcpy(cells, l->cells, l->numcells * sizeof(override_t));
+		Mem_Free(l->cells);
+		l->cells = cells;
+		l->maxcells = max;
+	}
+
+	o = &l->cells[l->numcells++];
+	o->layer = layer;
+	o->cell = cell;
+	o->tile = tile;
+}
+
+static void RemoveCell(celllist_t *l, int layer, int cell)
+{
+	override_t *o = FindCell(l, layer, cell);
+	if (o)
+		*o = l->cells[--l->numcells];
+}
+
+static bool Covers(const instance_t *inst, int x, int y)
+{
+	const prefab_t *p = &prefabs[inst->prefab];
+	return x >= inst->x && x < inst->x + p->w && y >= inst->y && y < inst->y + p->h;
+}
+
+// the instance has a say in the cell if it has a tile there or it has been
+// painted over
+static bool InstanceTile(instance_t *inst, int layer, int x, int y, int *tile)
+{
+	if (!Covers(inst, x, y))
+		return false;
+
+	const prefab_t *p = &prefabs[inst->prefab];
+	int cell = (y - inst->y) * p->w + x - inst->x;
+
+	const override_t *o = FindCell(&inst->overrides, layer, cell);
+	if (o)
+	{
+		*tile = o->tile;
+		return true;
+	}
+
+	*tile = PrefabTile(p, layer, cell);
+	return *tile != 0;
+}
+
+// the last placed instance with a say in the cell
+static instance_t *TopInstance(int layer, int x, int y, int *tile)
+{
+	if (!chunkrefs || x < 0 || x >= mapw || y < 0 || y >= maph)
+		return NULL;
+
+	instance_t *top = NULL;
+	for (instref_t *r = chunkrefs[(y / CHUNK_SIZE) * chunksx + x / CHUNK_SIZE]; r; r = r->next)
+	{
+		int t;
+		if ((!top || r->instance->serial > top->serial) && InstanceTile(r->instance, layer, x, y, &t))
+		{
+			top = r->instance;
+			*tile = t;
+		}
+	}
+
+	return top;
+}
+
+// the first instance placed after this one with a say in the cell, its base
+// there is what this one shows
+static instance_t *InstanceAbove(const instance_t *inst, int layer, int x, int y)
+{
+	instance_t *above = NULL;
+	for (instref_t *r = chunkrefs[(y / CHUNK_SIZE) * chunksx + x / CHUNK_SIZE]; r; r = r->next)
+	{
+		int t;
+		if (r->instance->serial > inst->serial && (!above || r->instance->serial < above->serial) &&
+			InstanceTile(r->instance, layer, x, y, &t))
+			above = r->instance;
+	}
+
+	return above;
+}
+
+static int InstanceCell(const instance_t *inst, int x, int y)
+{
+	return (y - inst->y) * prefabs[inst->prefab].w + x - inst->x;
+}
+
+static int BaseTile(instance_t *inst, int layer, int x, int y)
+{
+	const override_t *o = FindCell(&inst->base, layer, InstanceCell(inst, x, y));
+	return o ? o->tile : 0;
+}
+
+static void SetBaseTile(instance_t *inst, int layer, int x, int y, int tile)
+{
+	if (tile)
+		SetCell(&inst->base, layer, InstanceCell(inst, x, y), tile);
+	else
+		RemoveCell(&inst->base, layer, InstanceCell(inst, x, y));
+}
+
+// the instance has just got a say in the cell. it covers whatever was
+// showing there, or slots in under the instance above it and takes over its
+// base
+static void InsertBase(instance_t *inst, int layer, int x, int y)
+{
+	if (x < 0 || x >= mapw || y < 0 || y >= maph)
+		return;
+
+	int tile;
+	InstanceTile(inst, layer, x, y, &tile);
+
+	instance_t *above = InstanceAbove(inst, layer, x, y);
+	if (above)
+	{
+		SetBaseTile(inst, layer, x, y, BaseTile(above, layer, x, y));
+		SetBaseTile(above, layer, x, y, tile);
+	}
+	else
+		SetBaseTile(inst, layer, x, y, Map_GetTile(layer, x, y));
+}
+
+// the instance is losing its say in the cell, the instance above it covers
+// its base from now on. returns the base
+static int RemoveBase(instance_t *inst, int layer, int x, int y)
+{
+	if (x < 0 || x >= mapw || y < 0 || y >= maph)
+		return 0;
+
+	int base = BaseTile(inst, layer, x, y);
+	SetBaseTile(inst, layer, x, y, 0);
+
+	instance_t *above = InstanceAbove(inst, layer, x, y);
+	if (above)
+		SetBaseTile(above, layer, x, y, base);
+
+	return base;
+}
+
+// the cell gets the tile of whichever instance is on top there, or goes back
+// to the base if none of them has a say any more
+static void ResolveCell(int layer, int x, int y, int base)
+{
+	if (x < 0 || x >= mapw || y < 0 || y >= maph)
+		return;
+
+	int tile = base;
+	TopInstance(layer, x, y, &tile);
+
+	int oldtile = Map_GetTile(layer, x, y);
+	if (oldtile == tile)
+		return;
+
+	if (journaling)
+		Journal_Record(layer, x, y, oldtile, tile);
+
+	materializing = true;
+	Map_SetTile(layer, x, y, tile);
+	materializing = false;
+}
+
+// the map writes of one edit are undone together
+static void BeginEdit()
+{
+	Journal_BeginGroup();
+	journaling = true;
+}
+
+static void EndEdit()
+{
+	journaling = false;
+	Journal_EndGroup();
+}
+
+static void ChunkRange(const instance_t *inst, int *cx0, int *cy0, int *cx1, int *cy1)
+{
+	const prefab_t *p = &prefabs[inst->prefab];
+	int x0 = inst->x < 0 ? 0 : inst->x;
+	int y0 = inst->y < 0 ? 0 : inst->y;
+	int x1 = inst->x + p->w - 1 < mapw - 1 ? inst->x + p->w - 1 : mapw - 1;
+	int y1 = inst->y + p->h - 1 < maph - 1 ? inst->y + p->h - 1 : maph - 1;
+
+	*cx0 = x0 / CHUNK_SIZE;
+	*cy0 = y0 / CHUNK_SIZE;
+	*cx1 = x1 / CHUNK_SIZE;
+	*cy1 = y1 / CHUNK_SIZE;
+}
+
+static void LinkInstance(instance_t *inst)
+{
+	prefab_t *p = &prefabs[inst->prefab];
+	inst->next = p->instances;
+	p->instances = inst;
+	p->numinstances++;
+	numinstances++;
+
+	int cx0, cy0, cx1, cy1;
+	ChunkRange(inst, &cx0, &cy0, &cx1, &cy1);
+	for (int cy = cy0; cy <= cy1; cy++)
+	{
+		for (int cx = cx0; cx <= cx1; cx++)
+		{
+			instref_t *r = (instref_t*)Pool_Alloc(refpool);
+			r->instance = inst;
+			r->next = chunkrefs[cy * chunksx + cx];
+			chunkrefs[cy * chunksx + cx] = r;
+		}
+	}
+}
+
+static void UnlinkInstance(instance_t *inst)
+{
+	prefab_t *p = &prefabs[inst->prefab];
+	for (instance_t **link = &p->instances; *link; link = &(*link)->next)
+	{
+		if (*link == inst)
+		{
+			*link = inst->next;
+			break;
+		}
+	}
+	p->numinstances--;
+	numinstances--;
+
+	int cx0, cy0, cx1, cy1;
+	ChunkRange(inst, &cx0, &cy0, &cx1, &cy1);
+	for (int cy = cy0; cy <= cy1; cy++)
+	{
+		for (int cx = cx0; cx <= cx1; cx++)
+		{
+			for (instref_t **link = &chunkrefs[cy * chunksx + cx]; *link; link = &(*link)->next)
+			{
+				if ((*link)->instance == inst)
+				{
+					instref_t *r = *link;
+					*link = r->next;
+					Pool_Free(refpool, r);
+					break;
+				}
+			}
+		}
+	}
+}
+
+static instance_t *NewInstance(int prefab, int x, int y, int serial)
+{
+	instance_t *inst = (instance_t*)Pool_Alloc(instancepool);
+	memset(inst, 0, sizeof(*inst));
+	inst->prefab = prefab;
+	inst->x = x;
+	inst->y = y;
+	inst->serial = serial;
+	if (nextserial <= serial)
+		nextserial = serial + 1;
+	LinkInstance(inst);
+
+	return inst;
+}
+
+static void FreeInstance(instance_t *inst)
+{
+	Mem_Free(inst->overrides.cells);
+	Mem_Free(inst->base.cells);
+	Pool_Free(instancepool, inst);
+}
+
+static instance_t *FindInstance(int prefab, int serial)
+{
+	for (instance_t *inst = prefabs[prefab].instances; inst; inst = inst->next)
+		if (inst->serial == serial)
+			return inst;
+
+	return NULL;
+}
+
+// keeps what the instance covers in every cell it has a say in
+static void InsertBases(instance_t *inst)
+{
+	const prefab_t *p = &prefabs[inst->prefab];
+	for (int layer = 0; layer < NUM_LAYERS; layer++)
+	{
+		for (int cell = 0; cell < p->w * p->h; cell++)
+		{
+			int tile;
+			int x = inst->x + cell % p->w;
+			int y = inst->y + cell / p->w;
+			if (InstanceTile(inst, layer, x, y, &tile))
+				InsertBase(inst, layer, x, y);
+		}
+	}
+}
+
+// writes every cell the instance has a say in
+static void MaterializeInstance(instance_t *inst)
+{
+	const prefab_t *p = &prefabs[inst->prefab];
+	for (int layer = 0; layer < NUM_LAYERS; layer++)
+	{
+		for (int cell = 0; cell < p->w * p->h; cell++)
+		{
+			int tile;
+			int x = inst->x + cell % p->w;
+			int y = inst->y + cell / p->w;
+			if (InstanceTile(inst, layer, x, y, &tile))
+				ResolveCell(layer, x, y, BaseTile(inst, layer, x, y));
+		}
+	}
+}
+
+// the instance had a say in the cell and may not now, or the other way round
+static void SayChanged(instance_t *inst, int layer, int x, int y, bool hadsay)
+{
+	int tile;
+	bool hassay = InstanceTile(inst, layer, x, y, &tile);
+	int base = BaseTile(inst, layer, x, y);
+	if (!hadsay && hassay)
+		InsertBase(inst, layer, x, y);
+	else if (hadsay && !hassay)
+		base = RemoveBase(inst, layer, x, y);
+
+	ResolveCell(layer, x, y, base);
+}
+
+static void ClearInstances()
+{
+	for (int i = 0; i < numprefabs; i++)
+	{
+		for (instance_t *inst = prefabs[i].instances, *next; inst; inst = next)
+		{
+			next = inst->next;
+			FreeInstance(inst);
+		}
+
+		prefabs[i].instances = NULL;
+		prefabs[i].numinstances = 0;
+	}
+
+	if (chunkrefs)
+	{
+		for (int i = 0; i < chunksx * (maph / CHUNK_SIZE); i++)
+		{
+			for (instref_t *r = chunkrefs[i], *next; r; r = next)
+			{
+				next = r->next;
+				Pool_Free(refpool, r);
+			}
+		}
+		Mem_Free(chunkrefs);
+		chunkrefs = NULL;
+	}
+
+	numinstances = 0;
+	nextserial = 0;
+}
+
+static int CompareSerials(const void *a, const void *b)
+{
+	return (*(instance_t**)a)->serial - (*(instance_t**)b)->serial;
+}
+
+// ________________________________________________________________________________
+// external interface
+
+struct instance_t;
+void Prefab_Init(const char *tilesetname);
+void Prefab_Reset(int w, int h);
+void Prefab_CellChanged(int layer, int x, int y, int tile);
+int Prefab_Create(int x0, int y0, int x1, int y1);
+instance_t *Prefab_Place(int prefab, int x, int y);
+instance_t *Prefab_Pick(int x, int y);
+void Prefab_Remove(instance_t *inst);
+bool Prefab_EditCell(int layer, int x, int y, int tile);
+int Prefab_Count();
+int Prefab_NumInstances();
+void Prefab_Draw(float x0, float y0, float x1, float y1, int tilesize, instance_t *selected);
+bool Prefab_Save(const char *mapname);
+void Prefab_Load(const char *mapname);
+void Prefab_SetInstance(bool placed, int prefab, int x, int y, int serial, bool mapisbase);
+
+// the library is kept next to the tileset in the same style as the map header
+// prefabs 10
+// data<w h tiles>...
+void Prefab_Init(const char *tilesetname)
+{
+	InitMemory();
+	snprintf(libraryname, sizeof(libraryname), "%s.prefabs", tilesetname);
+
+	FILE *fp = fopen(libraryname, "rb");
+	if (!fp)
+		return;
+
+	// fscanf only counts the conversion, %n tells if "data" matched too
+	int count;
+	int headerlength = 0;
+	if (fscanf(fp, PREFABS_MAGIC " %i\ndata%n", &count, &headerlength) != 1 || !headerlength ||
+		count < 0 || count > MAX_PREFABS)
+		Error("Prefab library \"%s\" is corrupt\n", libraryname);
+
+	for (int i = 0; i < count; i++)
+	{
+		int size[2];
+		if (fread(size, sizeof(size), 1, fp) != 1)
+			Error("Prefab library \"%s\" is truncated\n", libraryname);
+		if (size[0] <= 0 || size[1] <= 0 || size[0] > MAX_PREFAB_SIZE || size[1] > MAX_PREFAB_SIZE)
+			Error("Prefab library \"%s\" is corrupt\n", libraryname);
+
+		prefab_t *p = &prefabs[i];
+		p->w = size[0];
+		p->h = size[1];
+		p->tiles = (int*)Mem_Alloc(prefabmemory, NUM_LAYERS * p->w * p->h * sizeof(int));
+		if (fread(p->tiles, NUM_LAYERS * p->w * p->h * sizeof(int), 1, fp) != 1)
+			Error("Prefab library \"%s\" is truncated\n", libraryname);
+	}
+
+	numprefabs = count;
+	fclose(fp);
+	printf("loaded %i prefabs\n", numprefabs);
+}
+
+// called when the map is allocated, the instances go with the old map
+void Prefab_Reset(int w, int h)
+{
+	InitMemory();
+	ClearInstances();
+
+	mapw = w;
+	maph = h;
+	chunksx = w / CHUNK_SIZE;
+	chunkrefs = (instref_t**)Mem_Calloc(prefabmemory, chunksx * (h / CHUNK_SIZE) * sizeof(instref_t*));
+}
+
+// called after every change to the map. painting over an instance's cell
+// keeps the tile on that instance alone, painting the prefab's own tile back
+// drops it again. undo comes through here as well
+void Prefab_CellChanged(int layer, int x, int y, int tile)
+{
+	if (materializing)
+		return;
+
+	int current;
+	instance_t *inst = TopInstance(layer, x, y, &current);
+	if (!inst)
+		return;
+
+	const prefab_t *p = &prefabs[inst->prefab];
+	int cell = InstanceCell(inst, x, y);
+	if (tile != PrefabTile(p, layer, cell))
+	{
+		SetCell(&inst->overrides, layer, cell, tile);
+		return;
+	}
+
+	// painting 0 back where the prefab has none takes its say away
+	RemoveCell(&inst->overrides, layer, cell);
+	if (!tile)
+		RemoveBase(inst, layer, x, y);
+}
+
+// makes a prefab of the cells in the rectangle, which become its first
+// instance. returns the prefab, or -1 if there's nothing there
+int Prefab_Create(int x0, int y0, int x1, int y1)
+{
+	if (x0 > x1)
+	{
+		int t = x0;
+		x0 = x1;
+		x1 = t;
+	}
+	if (y0 > y1)
+	{
+		int t = y0;
+		y0 = y1;
+		y1 = t;
+	}
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 > mapw - 1)
+		x1 = mapw - 1;
+	if (y1 > maph - 1)
+		y1 = maph - 1;
+
+	int w = x1 - x0 + 1;
+	int h = y1 - y0 + 1;
+	if (w <= 0 || h <= 0 || numprefabs == MAX_PREFABS)
+		return -1;
+	if (w > MAX_PREFAB_SIZE || h > MAX_PREFAB_SIZE)
+	{
+		printf("prefabs can be at most %ix%i\n", MAX_PREFAB_SIZE, MAX_PREFAB_SIZE);
+		return -1;
+	}
+
+	int *tiles = (int*)Mem_Alloc(prefabmemory, NUM_LAYERS * w * h * sizeof(int));
+	bool empty = true;
+	for (int layer = 0; layer < NUM_LAYERS; layer++)
+	{
+		for (int y = 0; y < h; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				int tile = Map_GetTile(layer, x0 + x, y0 + y);
+				tiles[(layer * h + y) * w + x] = tile;
+				if (tile)
+					empty = false;
+			}
+		}
+	}
+
+	if (empty)
+	{
+		Mem_Free(tiles);
+		return -1;
+	}
+
+	prefab_t *p = &prefabs[numprefabs];
+	p->w = w;
+	p->h = h;
+	p->tiles = tiles;
+	p->instances = NULL;
+	p->numinstances = 0;
+	librarychanged = true;
+
+	// the cells are already there, so nothing changes on the map. the tiles
+	// under them aren't known, removing it clears them
+	instance_t *inst = NewInstance(numprefabs, x0, y0, nextserial);
+	Journal_RecordInstance(true, inst->prefab, inst->x, inst->y, inst->serial, false);
+	return numprefabs++;
+}
+
+// x and y are the bottom left cell, the prefab can hang off the map
+instance_t *Prefab_Place(int prefab, int x, int y)
+{
+	if (prefab < 0 || prefab >= numprefabs)
+		return NULL;
+
+	instance_t *inst = NewInstance(prefab, x, y, nextserial);
+	InsertBases(inst);
+	BeginEdit();
+	Journal_RecordInstance(true, prefab, x, y, inst->serial, true);
+	MaterializeInstance(inst);
+	EndEdit();
+
+	return inst;
+}
+
+// the last placed instance over the cell, whether it has a tile there or not
+instance_t *Prefab_Pick(int x, int y)
+{
+	if (!chunkrefs || x < 0 || x >= mapw || y < 0 || y >= maph)
+		return NULL;
+
+	instance_t *top = NULL;
+	for (instref_t *r = chunkrefs[(y / CHUNK_SIZE) * chunksx + x / CHUNK_SIZE]; r; r = r->next)
+		if ((!top || r->instance->serial > top->serial) && Covers(r->instance, x, y))
+			top = r->instance;
+
+	return top;
+}
+
+// the cells go back to what the instances beneath have, or to the base
+void Prefab_Remove(instance_t *inst)
+{
+	// the instances above take over its base while it's still there to
+	// find them from
+	const prefab_t *p = &prefabs[inst->prefab];
+	int *bases = (int*)Mem_FrameAlloc(NUM_LAYERS * p->w * p->h * sizeof(int));
+	bool *says = (bool*)Mem_FrameAlloc(NUM_LAYERS * p->w * p->h * sizeof(bool));
+	for (int layer = 0; layer < NUM_LAYERS; layer++)
+	{
+		for (int cell = 0; cell < p->w * p->h; cell++)
+		{
+			int tile;
+			int x = inst->x + cell % p->w;
+			int y = inst->y + cell / p->w;
+			int i = layer * p->w * p->h + cell;
+			says[i] = InstanceTile(inst, layer, x, y, &tile);
+			if (says[i])
+				bases[i] = RemoveBase(inst, layer, x, y);
+		}
+	}
+
+	UnlinkInstance(inst);
+
+	BeginEdit();
+	for (int layer = 0; layer < NUM_LAYERS; layer++)
+	{
+		for (int cell = 0; cell < p->w * p->h; cell++)
+		{
+			int i = layer * p->w * p->h + cell;
+			if (says[i])
+				ResolveCell(layer, inst->x + cell % p->w, inst->y + cell / p->w, bases[i]);
+		}
+	}
+	Journal_RecordInstance(false, inst->prefab, inst->x, inst->y, inst->serial, true);
+	EndEdit();
+
+	FreeInstance(inst);
+}
+
+// changes the prefab under the cell, and so every instance of it that hasn't
+// been painted over there. returns false if there's no instance at the cell
+bool Prefab_EditCell(int layer, int x, int y, int tile)
+{
+	instance_t *inst = Prefab_Pick(x, y);
+	if (!inst)
+		return false;
+
+	prefab_t *p = &prefabs[inst->prefab];
+	int px = x - inst->x;
+	int py = y - inst->y;
+	int cell = py * p->w + px;
+
+	int oldtile = PrefabTile(p, layer, cell);
+	int t;
+	bool hadsay = InstanceTile(inst, layer, x, y, &t);
+
+	// the instance edited through shows the edit
+	BeginEdit();
+	RemoveCell(&inst->overrides, layer, cell);
+	if (oldtile != tile)
+	{
+		p->tiles[layer * p->w * p->h + cell] = tile;
+		librarychanged = true;
+
+		for (instance_t *i = p->instances; i; i = i->next)
+			if (i != inst && !FindCell(&i->overrides, layer, cell))
+				SayChanged(i, layer, i->x + px, i->y + py, oldtile != 0);
+	}
+	SayChanged(inst, layer, x, y, hadsay);
+	EndEdit();
+
+	return true;
+}
+
+int Prefab_Count()
+{
+	return numprefabs;
+}
+
+int Prefab_NumInstances()
+{
+	return numinstances;
+}
+
+// outlines the instances in the area, in map pixels
+void Prefab_Draw(float x0, float y0, float x1, float y1, int tilesize, instance_t *selected)
+{
+	if (!numinstances)
+		return;
+
+	int cx0 = (int)(x0 / tilesize) / CHUNK_SIZE;
+	int cy0 = (int)(y0 / tilesize) / CHUNK_SIZE;
+	int cx1 = (int)(x1 / tilesize) / CHUNK_SIZE;
+	int cy1 = (int)(y1 / tilesize) / CHUNK_SIZE;
+	if (cx0 < 0)
+		cx0 = 0;
+	if (cy0 < 0)
+		cy0 = 0;
+	if (cx1 > chunksx - 1)
+		cx1 = chunksx - 1;
+	if (cy1 > maph / CHUNK_SIZE - 1)
+		cy1 = maph / CHUNK_SIZE - 1;
+
+	// an instance across several chunks is only drawn once
+	drawframe++;
+
+	glBegin(GL_LINES);
+	for (int cy = cy0; cy <= cy1; cy++)
+	{
+		for (int cx = cx0; cx <= cx1; cx++)
+		{
+			for (instref_t *r = chunkrefs[cy * chunksx + cx]; r; r = r->next)
+			{
+				instance_t *inst = r->instance;
+				if (inst->drawframe == drawframe)
+					continue;
+				inst->drawframe = drawframe;
+
+				const prefab_t *p = &prefabs[inst->prefab];
+				float ix0 = inst->x * tilesize;
+				float iy0 = inst->y * tilesize;
+				float ix1 = (inst->x + p->w) * tilesize;
+				float iy1 = (inst->y + p->h) * tilesize;
+
+				if (inst == selected)
+					glColor3f(1, 0, 0);
+				else
+					glColor3f(0, 0.5f, 1);
+				glVertex2f(ix0, iy0);
+				glVertex2f(ix1, iy0);
+				glVertex2f(ix1, iy0);
+				glVertex2f(ix1, iy1);
+				glVertex2f(ix1, iy1);
+				glVertex2f(ix0, iy1);
+				glVertex2f(ix0, iy1);
+				glVertex2f(ix0, iy0);
+			}
+		}
+	}
+	glEnd();
+}
+
+// the instances are kept next to the map, in the order they were placed
+// instances 100 version 2
+// data<record overrides base>...
+// the library is only written when a prefab has been added or changed. both
+// are written beside the old files so a failed save leaves them intact.
+// returns false if either couldn't be written
+bool Prefab_Save(const char *mapname)
+{
+	FILE *fp;
+	if (librarychanged)
+	{
+		fp = Sys_BeginWrite(libraryname);
+		if (!fp)
+			return false;
+
+		fprintf(fp, "%s %i\ndata", PREFABS_MAGIC, numprefabs);
+		for (int i = 0; i < numprefabs; i++)
+		{
+			int size[2] = { prefabs[i].w, prefabs[i].h };
+			fwrite(size, sizeof(size), 1, fp);
+			fwrite(prefabs[i].tiles, NUM_LAYERS * prefabs[i].w * prefabs[i].h * sizeof(int), 1, fp);
+		}
+
+		if (!Sys_EndWrite(fp, libraryname))
+			return false;
+		librarychanged = false;
+	}
+
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "%s.instances", mapname);
+
+	if (!numinstances)
+	{
+		remove(filename);
+		return true;
+	}
+
+	instance_t **order = (instance_t**)Mem_FrameAlloc(numinstances * sizeof(instance_t*));
+	int count = 0;
+	for (int i = 0; i < numprefabs; i++)
+		for (instance_t *inst = prefabs[i].instances; inst; inst = inst->next)
+			order[count++] = inst;
+	qsort(order, count, sizeof(instance_t*), CompareSerials);
+
+	fp = Sys_BeginWrite(filename);
+	if (!fp)
+		return false;
+
+	fprintf(fp, "%s %i version %i\ndata", INSTANCES_MAGIC, count, INSTANCES_VERSION);
+	for (int i = 0; i < count; i++)
+	{
+		instance_t *inst = order[i];
+		instancerecord_t r = { inst->prefab, inst->x, inst->y, inst->overrides.numcells, inst->base.numcells, inst->serial };
+		fwrite(&r, sizeof(r), 1, fp);
+		fwrite(inst->overrides.cells, sizeof(override_t), inst->overrides.numcells, fp);
+		fwrite(inst->base.cells, sizeof(override_t), inst->base.numcells, fp);
+	}
+
+	return Sys_EndWrite(fp, filename);
+}
+
+// a map without an instances file has none. the prefabs may have been edited
+// since the map was saved, so the instances are written out again
+void Prefab_Load(const char *mapname)
+{
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "%s.instances", mapname);
+
+	FILE *fp = fopen(filename, "rb");
+	if (!fp)
+		return;
+
+	// version 1 files have no version key
+	int count;
+	int version = 1;
+	int headerlength = 0;
+	if (fscanf(fp, INSTANCES_MAGIC " %i", &count) != 1 || count < 0)
+		Error("Instances file \"%s\" is corrupt\n", filename);
+	fscanf(fp, " version %i", &version);
+	fscanf(fp, " data%n", &headerlength);
+	if (!headerlength || version < 1 || version > INSTANCES_VERSION)
+		Error("Instances file \"%s\" is corrupt\n", filename);
+
+	// version 1 records end before numbases and version 2 before serial,
+	// the serials then follow the order they are in
+	size_t recordsize = sizeof(instancerecord_t);
+	if (version < 2)
+		recordsize = offsetof(instancerecord_t, numbases);
+	else if (version < 3)
+		recordsize = offsetof(instancerecord_t, serial);
+
+	int dropped = 0;
+	for (int i = 0; i < count; i++)
+	{
+		instancerecord_t r = {};
+		r.serial = i;
+		if (fread(&r, recordsize, 1, fp) != 1 || r.numoverrides < 0 || r.numbases < 0)
+			Error("Instances file \"%s\" is truncated\n", filename);
+		if (r.serial < 0)
+			Error("Instances file \"%s\" is corrupt\n", filename);
+		if (r.numoverrides > NUM_LAYERS * MAX_PREFAB_SIZE * MAX_PREFAB_SIZE || r.numbases > NUM_LAYERS * MAX_PREFAB_SIZE * MAX_PREFAB_SIZE)
+			Error("Instances file \"%s\" is corrupt\n", filename);
+
+		override_t *overrides = (override_t*)Mem_FrameAlloc((r.numoverrides + r.numbases) * sizeof(override_t) + 1);
+		override_t *bases = overrides + r.numoverrides;
+		if (fread(overrides, sizeof(override_t), r.numoverrides + r.numbases, fp) != (size_t)(r.numoverrides + r.numbases))
+			Error("Instances file \"%s\" is truncated\n", filename);
+
+		// the library may have lost prefabs since
+		if (r.prefab < 0 || r.prefab >= numprefabs)
+		{
+			dropped++;
+			continue;
+		}
+
+		const prefab_t *p = &prefabs[r.prefab];
+		instance_t *inst = NewInstance(r.prefab, r.x, r.y, r.serial);
+		for (int j = 0; j < r.numoverrides; j++)
+			if (overrides[j].layer >= 0 && overrides[j].layer < NUM_LAYERS && overrides[j].cell >= 0 && overrides[j].cell < p->w * p->h)
+				SetCell(&inst->overrides, overrides[j].layer, overrides[j].cell, overrides[j].tile);
+		for (int j = 0; j < r.numbases; j++)
+			if (bases[j].layer >= 0 && bases[j].layer < NUM_LAYERS && bases[j].cell >= 0 && bases[j].cell < p->w * p->h && bases[j].tile)
+				SetCell(&inst->base, bases[j].layer, bases[j].cell, bases[j].tile);
+		MaterializeInstance(inst);
+	}
+
+	fclose(fp);
+	printf("loaded %i instances of %i prefabs\n", numinstances, numprefabs);
+	if (dropped)
+		printf("%i instances of prefabs that aren't in %s were dropped\n", dropped, libraryname);
+}
+
+// undo, redo and the journal replay put an instance back or take it away
+// again, the tiles around it are in the journal as well. one put back over
+// the map it covered keeps that as its base, one that was made from the
+// tiles has none
+void Prefab_SetInstance(bool placed, int prefab, int x, int y, int serial, bool mapisbase)
+{
+	if (prefab < 0 || prefab >= numprefabs)
+		return;
+
+	instance_t *inst = FindInstance(prefab, serial);
+	if (placed)
+	{
+		if (inst)
+			return;
+
+		inst = NewInstance(prefab, x, y, serial);
+		if (mapisbase)
+			InsertBases(inst);
+		return;
+	}
+
+	if (!inst)
+		return;
+
+	const prefab_t *p = &prefabs[prefab];
+	for (int layer = 0; layer < NUM_LAYERS; layer++)
+	{
+		for (int cell = 0; cell < p->w * p->h; cell++)
+		{
+			int tile;
+			int cx = inst->x + cell % p->w;
+			int cy = inst->y + cell / p->w;
+			if (InstanceTile(inst, layer, cx, cy, &tile))
+				RemoveBase(inst, layer, cx, cy);
+		}
+	}
+
+	UnlinkInstance(inst);
+	FreeInstance(inst);
+}
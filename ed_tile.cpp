@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
 #include <GL/freeglut.h>
 
@@ -76,6 +77,9 @@ static void FileClose(FILE *fp)
 }
 
 
+void *Mem_FrameAlloc(size_t size);
+
+// the data is frame scratch memory and is gone at the end of the frame
 static int ReadFile(const char* filename, void **data)
 {
 	FILE *fp = fopen(filename, "rb");
@@ -84,7 +88,7 @@ static int ReadFile(const char* filename, void **data)
 
 	int size = FileSize(fp);
 	
-	*data = malloc(size);
+	*data = Mem_FrameAlloc(size);
 	fread(*data, size, 1, fp);
 	fclose(fp);
 	
@@ -104,50 +108,171 @@ static void WriteBytes(void *data, int numbytes, FILE *fp)
 
 // out current tile
 
+static const char *tilesetname;
+static int tilesetstream = -1;
 static GLuint texobj[1];
 static int selectedtile;
 static int tilew;
 static int tileh;
 static int windoww;
 static int windowh;
+static int palettewindow;
+
+// ________________________________________________________________________________
+// Palette view
+// the window is capped in size and shows part of the atlas, scrolled and
+// zoomed. only the rows and columns of tiles in view are drawn, and clicks go
+// back through the same transform. recently used tiles are kept in a strip
+// along the top of the window
+
+#define PALETTE_MAX_WIDTH	512
+#define PALETTE_MAX_HEIGHT	768
+
+#define MIN_ZOOM	0.25f
+#define MAX_ZOOM	8.0f
+
+// rows scrolled by a wheel notch or an arrow key
+#define SCROLL_ROWS	2
 
+#define MAX_RECENT		16
+#define RECENT_TILE_SIZE	32
+#define RECENT_MARGIN		4
+#define RECENT_STRIP_HEIGHT	(RECENT_TILE_SIZE + 2 * RECENT_MARGIN)
 
-// fixme: might be better to draw a texture quad for each tile?
-static void DrawTexturedQuad()
+// window pixels per atlas pixel
+static float zoom = 2;
+
+// the atlas pixel at the bottom left of the palette area
+static float scrollx;
+static float scrolly;
+
+// most recent first
+static int recenttiles[MAX_RECENT];
+static int numrecent;
+
+static int PaletteHeight()
 {
-	float sizex = tilew * TILE_SIZE;
-	float sizey = tileh * TILE_SIZE;
+	int h = windowh - RECENT_STRIP_HEIGHT;
+	return h > 0 ? h : 0;
+}
 
-	glColor3f(1, 1, 1);
-	glBegin(GL_TRIANGLE_STRIP);
+static void Redisplay()
+{
+	if (palettewindow)
+		glutPostWindowRedisplay(palettewindow);
+}
 
-	glTexCoord2f(0.0f, 0.0f);
-	glVertex2f(0.0f, 0.0f);
+static void ClampScroll()
+{
+	float maxx = tilew * TILE_SIZE - windoww / zoom;
+	float maxy = tileh * TILE_SIZE - PaletteHeight() / zoom;
+
+	if (scrollx > maxx)
+		scrollx = maxx;
+	if (scrolly > maxy)
+		scrolly = maxy;
+	if (scrollx < 0)
+		scrollx = 0;
+	if (scrolly < 0)
+		scrolly = 0;
+}
 
-	glTexCoord2f(1.0f, 0.0f);
-	glVertex2f(sizex, 0.0f);
+static void Scroll(float dx, float dy)
+{
+	scrollx += dx;
+	scrolly += dy;
+	ClampScroll();
+	Redisplay();
+}
 
-	glTexCoord2f(0.0f, 1.0f);
-	glVertex2f(0.0f, sizey);
+// x and y are window pixels with the origin at the bottom left, the atlas
+// pixel under them stays put
+static void ZoomAt(float scale, int x, int y)
+{
+	float ax = x / zoom + scrollx;
+	float ay = y / zoom + scrolly;
+
+	zoom *= scale;
+	if (zoom < MIN_ZOOM)
+		zoom = MIN_ZOOM;
+	if (zoom > MAX_ZOOM)
+		zoom = MAX_ZOOM;
+
+	scrollx = ax - x / zoom;
+	scrolly = ay - y / zoom;
+	ClampScroll();
+	Redisplay();
+}
 
-	glTexCoord2f(1.0f, 1.0f);
-	glVertex2f(sizex, sizey);
+// scrolls just far enough to bring the selected tile into view
+static void ScrollToSelected()
+{
+	float x0 = (selectedtile % tilew) * TILE_SIZE;
+	float y0 = (selectedtile / tilew) * TILE_SIZE;
+	float vieww = windoww / zoom;
+	float viewh = PaletteHeight() / zoom;
+
+	if (x0 < scrollx)
+		scrollx = x0;
+	if (x0 + TILE_SIZE > scrollx + vieww)
+		scrollx = x0 + TILE_SIZE - vieww;
+	if (y0 < scrolly)
+		scrolly = y0;
+	if (y0 + TILE_SIZE > scrolly + viewh)
+		scrolly = y0 + TILE_SIZE - viewh;
+
+	ClampScroll();
+}
 
-	glEnd();
+static void AddRecentTile(int tile)
+{
+	if (numrecent && recenttiles[0] == tile)
+		return;
+
+	// move it to the front, dropping the oldest if it's new
+	int i;
+	for (i = 0; i < numrecent; i++)
+		if (recenttiles[i] == tile)
+			break;
+	if (i == numrecent)
+	{
+		if (numrecent < MAX_RECENT)
+			numrecent++;
+		i = numrecent - 1;
+	}
+
+	memmove(recenttiles + 1, recenttiles, i * sizeof(int));
+	recenttiles[0] = tile;
+	Redisplay();
 }
 
-static void DrawSelectedTile()
+static int NumVisibleRecent()
 {
-	int x = selectedtile % tilew;
-	int y = selectedtile / tilew;
+	int n = (windoww - RECENT_MARGIN) / (RECENT_TILE_SIZE + RECENT_MARGIN);
+	return n < numrecent ? n : numrecent;
+}
 
-	float xl = (x + 0) * TILE_SIZE;
-	float xr = (x + 1) * TILE_SIZE;
-	float yl = (y + 0) * TILE_SIZE;
-	float yr = (y + 1) * TILE_SIZE;
+static void DrawTileQuad(int tile, float x0, float y0, float size)
+{
+	float tcsizex = 1.0f / tilew;
+	float tcsizey = 1.0f / tileh;
+	float tcx = (tile % tilew) * tcsizex;
+	float tcy = (tile / tilew) * tcsizey;
 
-	glColor3f(0, 0, 0);
+	glBegin(GL_TRIANGLE_STRIP);
+	glTexCoord2f(tcx, tcy);
+	glVertex2f(x0, y0);
+	glTexCoord2f(tcx + tcsizex, tcy);
+	glVertex2f(x0 + size, y0);
+	glTexCoord2f(tcx, tcy + tcsizey);
+	glVertex2f(x0, y0 + size);
+	glTexCoord2f(tcx + tcsizex, tcy + tcsizey);
+	glVertex2f(x0 + size, y0 + size);
+	glEnd();
+}
 
+static void DrawOutline(float xl, float yl, float xr, float yr)
+{
 	glBegin(GL_LINE_LOOP);
 	glVertex2f(xl, yl);
 	glVertex2f(xr, yl);
@@ -156,6 +281,105 @@ static void DrawSelectedTile()
 	glEnd();
 }
 
+// one quad over the rows and columns of tiles in view
+static void DrawVisibleTiles()
+{
+	float vieww = windoww / zoom;
+	float viewh = PaletteHeight() / zoom;
+
+	int col0 = scrollx / TILE_SIZE;
+	int row0 = scrolly / TILE_SIZE;
+	int col1 = (scrollx + vieww) / TILE_SIZE + 1;
+	int row1 = (scrolly + viewh) / TILE_SIZE + 1;
+	if (col1 > tilew)
+		col1 = tilew;
+	if (row1 > tileh)
+		row1 = tileh;
+
+	float s0 = (float)col0 / tilew;
+	float s1 = (float)col1 / tilew;
+	float t0 = (float)row0 / tileh;
+	float t1 = (float)row1 / tileh;
+	float x0 = col0 * TILE_SIZE;
+	float x1 = col1 * TILE_SIZE;
+	float y0 = row0 * TILE_SIZE;
+	float y1 = row1 * TILE_SIZE;
+
+	glColor3f(1, 1, 1);
+	glBegin(GL_TRIANGLE_STRIP);
+	glTexCoord2f(s0, t0);
+	glVertex2f(x0, y0);
+	glTexCoord2f(s1, t0);
+	glVertex2f(x1, y0);
+	glTexCoord2f(s0, t1);
+	glVertex2f(x0, y1);
+	glTexCoord2f(s1, t1);
+	glVertex2f(x1, y1);
+	glEnd();
+}
+
+static void DrawSelectedTile()
+{
+	int x = selectedtile % tilew;
+	int y = selectedtile / tilew;
+
+	glColor3f(0, 0, 0);
+	DrawOutline(x * TILE_SIZE, y * TILE_SIZE, (x + 1) * TILE_SIZE, (y + 1) * TILE_SIZE);
+}
+
+static void DrawPalette()
+{
+	int h = PaletteHeight();
+
+	glViewport(0, 0, windoww, h);
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glOrtho(scrollx, scrollx + windoww / zoom, scrolly, scrolly + h / zoom, -1, 1);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, texobj[0]);
+	DrawVisibleTiles();
+	glDisable(GL_TEXTURE_2D);
+
+	DrawSelectedTile();
+}
+
+static void DrawRecentStrip()
+{
+	int y = PaletteHeight();
+
+	glViewport(0, y, windoww, RECENT_STRIP_HEIGHT);
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glOrtho(0, windoww, 0, RECENT_STRIP_HEIGHT, -1, 1);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+
+	glColor3f(0.2, 0.2, 0.2);
+	glRectf(0, 0, windoww, RECENT_STRIP_HEIGHT);
+
+	int n = NumVisibleRecent();
+
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, texobj[0]);
+	glColor3f(1, 1, 1);
+	for (int i = 0; i < n; i++)
+		DrawTileQuad(recenttiles[i], RECENT_MARGIN + i * (RECENT_TILE_SIZE + RECENT_MARGIN), RECENT_MARGIN, RECENT_TILE_SIZE);
+	glDisable(GL_TEXTURE_2D);
+
+	glColor3f(1, 1, 1);
+	for (int i = 0; i < n; i++)
+	{
+		if (recenttiles[i] != selectedtile)
+			continue;
+
+		float x = RECENT_MARGIN + i * (RECENT_TILE_SIZE + RECENT_MARGIN);
+		DrawOutline(x, RECENT_MARGIN, x + RECENT_TILE_SIZE, RECENT_MARGIN + RECENT_TILE_SIZE);
+	}
+}
+
 #if 0
 static void DrawSelectedTile()
 {
@@ -243,12 +467,44 @@ static void FlipRasterOrder(int imagew, int imageh, char* pixels)
 	}
 }
 
+bool Image_IsImageFile(const char *filename);
+void Image_Open(const char *filename, int *w, int *h);
+int Image_BeginStream(GLuint texture);
+bool Image_UpdateStream(int stream);
+
+// the window size depends on the tileset so this is read before the window
+// and its gl context exist
+static void LoadTilesetSize()
+{
+	if (Image_IsImageFile(tilesetname))
+	{
+		int imagew, imageh;
+		Image_Open(tilesetname, &imagew, &imageh);
+		tilew = imagew / TILE_SIZE;
+		tileh = imageh / TILE_SIZE;
+		return;
+	}
+
+	char *buffer = NULL;
+	ReadFile(tilesetname, (void**)&buffer);
+	tilew = KeyInt(buffer, "tilew");
+	tileh = KeyInt(buffer, "tileh");
+}
+
 static void LoadTileset()
 {
+	if (Image_IsImageFile(tilesetname))
+	{
+		// the image is already decoding, stream it into this context's texture
+		MakeTexture(tilew * TILE_SIZE, tileh * TILE_SIZE, NULL);
+		tilesetstream = Image_BeginStream(texobj[0]);
+		return;
+	}
+
 	char *buffer = NULL, *end = NULL;
 	
 	// read the file
-	int numbytes = ReadFile("tiles", (void**)&buffer);
+	int numbytes = ReadFile(tilesetname, (void**)&buffer);
 	end = buffer + numbytes;
 
 	// decode the key data
@@ -275,10 +531,10 @@ static void LoadTileset()
 
 // ________________________________________________________________________________ 
 // external interface
-// the window is twice the size which automatically scales the texture
 
-void InitWindow();
+void InitWindow(const char *filename);
 int GetSelectedTile();
+void TileUsed(int tile);
 int GetTileIndex(int tilenum);
 void SelectClick(int x, int y);
 void SelectUp();
@@ -297,46 +553,73 @@ int ClampSelected(int newtile, int oldtile)
 	return newtile;
 }
 
-// called to set the current tile in the palette
+// called to set the current tile in the palette, x and y are window pixels
 void SelectClick(int x, int y)
 {
 	// flip the y coordinate
 	y = windowh - y;
-	printf("%d, %d\n", x, y);
 
-	// scale x and y since the tile palette is scaled up
-	x /= 2;
-	y /= 2;
+	// the strip of recent tiles
+	if (y >= PaletteHeight())
+	{
+		int slot = (x - RECENT_MARGIN) / (RECENT_TILE_SIZE + RECENT_MARGIN);
+		if (x >= RECENT_MARGIN && slot < NumVisibleRecent())
+		{
+			selectedtile = recenttiles[slot];
+			ScrollToSelected();
+			Redisplay();
+		}
+		return;
+	}
+
+	// back through the view to atlas pixels
+	float ax = x / zoom + scrollx;
+	float ay = y / zoom + scrolly;
+	if (ax < 0 || ay < 0 || ax >= tilew * TILE_SIZE || ay >= tileh * TILE_SIZE)
+		return;
 
 	// convert to tile x, y
-	x /= TILE_SIZE;
-	y /= TILE_SIZE;
+	x = ax / TILE_SIZE;
+	y = ay / TILE_SIZE;
 
 	// convert to tile addr
 	selectedtile = y * tilew + x;
 	
 	printf("tilex: %i, tiley %i, tilenum %i\n", x, y, selectedtile);
-	glutPostRedisplay();
+	Redisplay();
+}
+
+static void SelectTile(int tile)
+{
+	selectedtile = ClampSelected(tile, selectedtile);
+	ScrollToSelected();
+	Redisplay();
 }
 
 void SelectUp()
 {
-	selectedtile = ClampSelected(selectedtile + tilew, selectedtile);
+	SelectTile(selectedtile + tilew);
 }
 
 void SelectDown()
 {
-	selectedtile = ClampSelected(selectedtile - tilew, selectedtile);
+	SelectTile(selectedtile - tilew);
 }
 
 void SelectLeft()
 {
-	selectedtile = ClampSelected(selectedtile - 1, selectedtile);
+	SelectTile(selectedtile - 1);
 }
 
 void SelectRight()
 {
-	selectedtile = ClampSelected(selectedtile + 1, selectedtile);
+	SelectTile(selectedtile + 1);
+}
+
+// called when the tile is placed so it shows in the recent strip
+void TileUsed(int tile)
+{
+	AddRecentTile(tile);
 }
 
 int GetSelectedTile()
@@ -348,65 +631,104 @@ int GetSelectedTile()
 // ________________________________________________________________________________ 
 // GLUT glue functions
 
+// the projection is set per area when drawing
 static void ReshapeFunc(int w, int h)
 {
 	windoww = w;
 	windowh = h;
 
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
-
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	glOrtho(0, tilew * TILE_SIZE, 0, tileh * TILE_SIZE, -1, 1);
-
-	glViewport(0, 0, w, h);
+	ClampScroll();
 }
 
 static void DisplayFunc()
 {
+	glViewport(0, 0, windoww, windowh);
 	glClearColor(0.3, 0.3, 0.3, 0.0);
 	glClear(GL_COLOR_BUFFER_BIT);
 	glDisable(GL_DEPTH_TEST);
 
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, texobj[0]);
-	DrawTexturedQuad();
-	glDisable(GL_TEXTURE_2D);
+	if (tilesetstream >= 0 && Image_UpdateStream(tilesetstream))
+		tilesetstream = -1;
 
-	DrawSelectedTile();
+	DrawPalette();
+	DrawRecentStrip();
 
 	glutSwapBuffers();
-	glutPostRedisplay();
+
+	// only redrawn continuously while the tileset is arriving
+	if (tilesetstream >= 0)
+		glutPostRedisplay();
 }
 
 static void KeyDownFunc(unsigned char key, int x, int y)
 {
+	y = windowh - y;
+
+	if (key == '+' || key == '=')
+		ZoomAt(2, x, y);
+	if (key == '-')
+		ZoomAt(0.5f, x, y);
 }
 
 static void KeyUpFunc(unsigned char key, int x, int y)
 {
 }
 
+static void SpecialDownFunc(int key, int x, int y)
+{
+	float row = TILE_SIZE * SCROLL_ROWS;
+	float page = PaletteHeight() / zoom;
+
+	if (key == GLUT_KEY_UP)
+		Scroll(0, row);
+	if (key == GLUT_KEY_DOWN)
+		Scroll(0, -row);
+	if (key == GLUT_KEY_LEFT)
+		Scroll(-row, 0);
+	if (key == GLUT_KEY_RIGHT)
+		Scroll(row, 0);
+	if (key == GLUT_KEY_PAGE_UP)
+		Scroll(0, page);
+	if (key == GLUT_KEY_PAGE_DOWN)
+		Scroll(0, -page);
+}
+
 static void MouseFunc(int button, int state, int x, int y)
 {
 	if (button == GLUT_LEFT_BUTTON && state == GLUT_UP)
 		SelectClick(x, y);
 }
 
-void InitWindow()
+// the wheel scrolls, with ctrl held it zooms about the cursor
+static void MouseWheelFunc(int wheel, int direction, int x, int y)
 {
-	LoadTileset();
+	if (glutGetModifiers() & GLUT_ACTIVE_CTRL)
+		ZoomAt(direction > 0 ? 2 : 0.5f, x, windowh - y);
+	else if (glutGetModifiers() & GLUT_ACTIVE_SHIFT)
+		Scroll(direction * TILE_SIZE * SCROLL_ROWS, 0);
+	else
+		Scroll(0, direction * TILE_SIZE * SCROLL_ROWS);
+}
 
-	glutInitWindowSize(2 * tilew * TILE_SIZE, 2 * tileh * TILE_SIZE);
-	glutCreateWindow("tile window");
+void InitWindow(const char *filename)
+{
+	tilesetname = filename;
+	LoadTilesetSize();
+
+	// the atlas at twice its size, up to the window cap
+	int w = zoom * tilew * TILE_SIZE;
+	int h = zoom * tileh * TILE_SIZE + RECENT_STRIP_HEIGHT;
+	glutInitWindowSize(w < PALETTE_MAX_WIDTH ? w : PALETTE_MAX_WIDTH, h < PALETTE_MAX_HEIGHT ? h : PALETTE_MAX_HEIGHT);
+	palettewindow = glutCreateWindow("tile window");
 	glutDisplayFunc(DisplayFunc);
 	glutReshapeFunc(ReshapeFunc);
 	glutKeyboardFunc(KeyDownFunc);
 	glutKeyboardUpFunc(KeyUpFunc);
+	glutSpecialFunc(SpecialDownFunc);
 	glutMouseFunc(MouseFunc);
+	glutMouseWheelFunc(MouseWheelFunc);
 
-	// need to load again to get the texture
+	// the texture belongs to this window's context
 	LoadTileset();
 }
 
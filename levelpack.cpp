@@ -0,0 +1,542 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// ________________________________________________________________________________
+// Level packs
+// everything the game needs to run a level, laid out so the file can be
+// mapped and used where it lies. there are no pointers, each section is found
+// by its offset from the start of the file and starts on a cache line.
+// opening a pack is a map of the file and a check of the header, the section
+// sizes and the checksum
+//
+// the sections are
+// layers     NUM_LAYERS * mapw * maph ints, layer by layer, each row by row
+//            from the bottom like the editor keeps them
+// collision  a bit per cell for each of SOLID, WATER, LADDER and FIELD, one
+//            plane after another. cell y * mapw + x is bit x % 64 of word
+//            (y * mapw + x) / 64
+// chunks     the vertices of each layer of each chunk, chunk by chunk, each
+//            row by row from the bottom
+// vertices   4 per tile in strip order, bottom left, bottom right, top left,
+//            top right. drawn with the indices 0 1 2 2 1 3 per tile. tiles
+//            that are empty, fully transparent or under an opaque tile on a
+//            higher layer are left out
+// atlas      the tileset the uvs are for
+//
+// the builder and the loader are both here so the layout is only in one place
+
+#define PACK_MAGIC	0x4b415054	// "TPAK"
+#define PACK_VERSION	1
+#define PACK_BYTEORDER	0x01020304
+
+#define PACK_ALIGN	64
+
+#define CHUNK_SIZE	16
+#define NUM_LAYERS	4
+#define TILE_SIZE	16
+
+// collision flags, the same as the editor's type flags
+#define PACK_SOLID	(1 << 0)
+#define PACK_WATER	(1 << 1)
+#define PACK_LADDER	(1 << 2)
+#define PACK_FIELD	(1 << 3)
+#define PACK_FLAGS	4
+
+enum
+{
+	SECTION_LAYERS,
+	SECTION_COLLISION,
+	SECTION_CHUNKS,
+	SECTION_VERTICES,
+	SECTION_ATLAS,
+	NUM_SECTIONS
+};
+
+struct packsection_t
+{
+	long long offset;
+	long long size;
+};
+
+struct packheader_t
+{
+	int magic;
+	int version;
+	int byteorder;
+	int headersize;
+	long long filesize;
+
+	int mapw;
+	int maph;
+	int numlayers;
+	int chunksize;
+	int chunksx;
+	int chunksy;
+
+	unsigned int crc;	// of everything after the header
+	int numsections;
+	packsection_t sections[NUM_SECTIONS];
+};
+
+struct packchunk_t
+{
+	int firstvertex[NUM_LAYERS];
+	int numvertices[NUM_LAYERS];
+};
+
+// x and y are map pixels from the chunk's bottom left corner, u and v are
+// normalized across the atlas, 65535 is the far edge
+struct packvertex_t
+{
+	unsigned short x;
+	unsigned short y;
+	unsigned short u;
+	unsigned short v;
+};
+
+struct packatlas_t
+{
+	char name[256];		// file name of the tileset, no directory
+	int tilew;		// in tiles
+	int tileh;
+	int tilesize;		// pixels across a tile
+	unsigned int crc;	// of the tileset's pixels
+};
+
+struct levelpack_t
+{
+	void *base;
+	long long size;
+
+	const packheader_t *header;
+	const int *layers;
+	const unsigned long long *collision;
+	const packchunk_t *chunks;
+	const packvertex_t *vertices;
+	const packatlas_t *atlas;
+};
+
+static void SetError(char *error, int errorsize, const char *format, ...)
+{
+	if (!error)
+		return;
+
+	va_list valist;
+	va_start(valist, format);
+	vsnprintf(error, errorsize, format, valist);
+	va_end(valist);
+}
+
+static long long AlignSize(long long size)
+{
+	return (size + PACK_ALIGN - 1) & ~(long long)(PACK_ALIGN - 1);
+}
+
+// crc32 eight bytes at a time, the checksum is most of the cost of opening
+// a pack. table[k] is the crc of a byte followed by k zero bytes. it's the
+// same crc as zip and png use, and the tools check their files with it too
+static bool BuildCrcTable(unsigned int (*table)[256])
+{
+	for (unsigned int i = 0; i < 256; i++)
+	{
+		unsigned int c = i;
+		for (int k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		table[0][i] = c;
+	}
+
+	for (int k = 1; k < 8; k++)
+		for (int i = 0; i < 256; i++)
+			table[k][i] = table[0][table[k - 1][i] & 0xff] ^ (table[k - 1][i] >> 8);
+
+	return true;
+}
+
+static long long PlaneWords(int mapw, int maph)
+{
+	return ((long long)mapw * maph + 63) / 64;
+}
+
+static int ClassFlags(char c)
+{
+	if (c == '#')
+		return PACK_SOLID;
+	if (c == 'w')
+		return PACK_WATER;
+	if (c == 'l')
+		return PACK_LADDER;
+	if (c == 'f')
+		return PACK_FIELD;
+
+	return 0;
+}
+
+// the tile is worth drawing at the cell, it isn't empty or transparent and
+// isn't hidden under an opaque tile
+static bool TileVisible(const int *layers, int mapw, int maph, const unsigned char (*tilealpha)[2], int layer, long long cell)
+{
+	int tile = layers[layer * (long long)mapw * maph + cell];
+	if (tile <= 0 || !tilealpha[tile][1])
+		return false;
+
+	for (int above = layer + 1; above < NUM_LAYERS; above++)
+	{
+		int t = layers[above * (long long)mapw * maph + cell];
+		if (t > 0 && tilealpha[t][0] == 255)
+			return false;
+	}
+
+	return true;
+}
+
+// ________________________________________________________________________________
+// external interface
+
+void *LevelPack_Build(int mapw, int maph, const int *layers, const char *classes,
+	const char *atlasname, int tilew, int tileh, unsigned int atlascrc, const unsigned char (*tilealpha)[2],
+	long long *size, char *error, int errorsize);
+levelpack_t *LevelPack_Open(const char *filename, bool checkcrc, char *error, int errorsize);
+void LevelPack_Close(levelpack_t *pack);
+int LevelPack_Tile(const levelpack_t *pack, int layer, int x, int y);
+int LevelPack_CellFlags(const levelpack_t *pack, int x, int y);
+const packvertex_t *LevelPack_ChunkVertices(const levelpack_t *pack, int cx, int cy, int layer, int *numvertices);
+unsigned int LevelPack_Crc(unsigned int crc, const unsigned char *data, long long size);
+
+// crc is 0 to start, or what an earlier call returned to carry on from it
+unsigned int LevelPack_Crc(unsigned int crc, const unsigned char *data, long long size)
+{
+	// built the first time, any thread may get there first
+	static unsigned int table[8][256];
+	static bool built = BuildCrcTable(table);
+	(void)built;
+
+	crc = ~crc;
+	long long i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		unsigned int lo, hi;
+		memcpy(&lo, data + i, 4);
+		memcpy(&hi, data + i + 4, 4);
+		lo ^= crc;
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+			table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+	}
+	for (; i < size; i++)
+		crc = table[0][(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+// returns the pack in a block from malloc, or NULL if the map doesn't fit the
+// tileset. tilealpha has the lowest and highest alpha of each tile's texels
+void *LevelPack_Build(int mapw, int maph, const int *layers, const char *classes,
+	const char *atlasname, int tilew, int tileh, unsigned int atlascrc, const unsigned char (*tilealpha)[2],
+	long long *size, char *error, int errorsize)
+{
+	if (mapw <= 0 || maph <= 0 || mapw % CHUNK_SIZE || maph % CHUNK_SIZE)
+	{
+		SetError(error, errorsize, "size %ix%i isn't a multiple of %i", mapw, maph, CHUNK_SIZE);
+		return NULL;
+	}
+
+	long long numcells = (long long)mapw * maph;
+	int numtiles = tilew * tileh;
+	for (long long i = 0; i < NUM_LAYERS * numcells; i++)
+	{
+		if (layers[i] < 0 || layers[i] >= numtiles)
+		{
+			SetError(error, errorsize, "tile %i is outside the %i tiles of %s", layers[i], numtiles, atlasname);
+			return NULL;
+		}
+	}
+
+	int chunksx = mapw / CHUNK_SIZE;
+	int chunksy = maph / CHUNK_SIZE;
+	int numchunks = chunksx * chunksy;
+
+	// count the tiles first so the file can be laid out in one go
+	long long numvertices = 0;
+	for (int layer = 0; layer < NUM_LAYERS; layer++)
+		for (long long i = 0; i < numcells; i++)
+			if (TileVisible(layers, mapw, maph, tilealpha, layer, i))
+				numvertices += 4;
+
+	if (numvertices > 0x7fffffff)
+	{
+		SetError(error, errorsize, "too many tiles for one pack");
+		return NULL;
+	}
+
+	packheader_t header;
+	memset(&header, 0, sizeof(header));
+	header.magic = PACK_MAGIC;
+	header.version = PACK_VERSION;
+	header.byteorder = PACK_BYTEORDER;
+	header.headersize = sizeof(packheader_t);
+	header.mapw = mapw;
+	header.maph = maph;
+	header.numlayers = NUM_LAYERS;
+	header.chunksize = CHUNK_SIZE;
+	header.chunksx = chunksx;
+	header.chunksy = chunksy;
+	header.numsections = NUM_SECTIONS;
+
+	long long sizes[NUM_SECTIONS];
+	sizes[SECTION_LAYERS] = NUM_LAYERS * numcells * sizeof(int);
+	sizes[SECTION_COLLISION] = PACK_FLAGS * PlaneWords(mapw, maph) * sizeof(unsigned long long);
+	sizes[SECTION_CHUNKS] = numchunks * sizeof(packchunk_t);
+	sizes[SECTION_VERTICES] = numvertices * sizeof(packvertex_t);
+	sizes[SECTION_ATLAS] = sizeof(packatlas_t);
+
+	long long offset = AlignSize(sizeof(packheader_t));
+	for (int i = 0; i < NUM_SECTIONS; i++)
+	{
+		header.sections[i].offset = offset;
+		header.sections[i].size = sizes[i];
+		offset = AlignSize(offset + sizes[i]);
+	}
+	header.filesize = offset;
+
+	// calloc leaves the padding zeroed so the checksum is repeatable
+	unsigned char *pack = (unsigned char*)calloc(1, header.filesize);
+
+	memcpy(pack + header.sections[SECTION_LAYERS].offset, layers, sizes[SECTION_LAYERS]);
+
+	unsigned long long *collision = (unsigned long long*)(pack + header.sections[SECTION_COLLISION].offset);
+	for (long long i = 0; i < numcells; i++)
+	{
+		int flags = ClassFlags(classes[i]);
+		for (int f = 0; f < PACK_FLAGS; f++)
+			if (flags & (1 << f))
+				collision[f * PlaneWords(mapw, maph) + i / 64] |= 1ull << (i % 64);
+	}
+
+	packchunk_t *chunks = (packchunk_t*)(pack + header.sections[SECTION_CHUNKS].offset);
+	packvertex_t *vertices = (packvertex_t*)(pack + header.sections[SECTION_VERTICES].offset);
+	int vertex = 0;
+	for (int chunk = 0; chunk < numchunks; chunk++)
+	{
+		int x0 = (chunk % chunksx) * CHUNK_SIZE;
+		int y0 = (chunk / chunksx) * CHUNK_SIZE;
+
+		for (int layer = 0; layer < NUM_LAYERS; layer++)
+		{
+			chunks[chunk].firstvertex[layer] = vertex;
+
+			for (int y = 0; y < CHUNK_SIZE; y++)
+			{
+				for (int x = 0; x < CHUNK_SIZE; x++)
+				{
+					long long cell = (long long)(y0 + y) * mapw + x0 + x;
+					if (!TileVisible(layers, mapw, maph, tilealpha, layer, cell))
+						continue;
+
+					// tile 0 is at the bottom left of the atlas
+					int tile = layers[layer * numcells + cell];
+					int u0 = (tile % tilew) * 65535 / tilew;
+					int v0 = (tile / tilew) * 65535 / tileh;
+					int u1 = (tile % tilew + 1) * 65535 / tilew;
+					int v1 = (tile / tilew + 1) * 65535 / tileh;
+
+					packvertex_t *v = &vertices[vertex];
+					v[0].x = x * TILE_SIZE;
+					v[0].y = y * TILE_SIZE;
+					v[0].u = u0;
+					v[0].v = v0;
+					v[1].x = (x + 1) * TILE_SIZE;
+					v[1].y = y * TILE_SIZE;
+					v[1].u = u1;
+					v[1].v = v0;
+					v[2].x = x * TILE_SIZE;
+					v[2].y = (y + 1) * TILE_SIZE;
+					v[2].u = u0;
+					v[2].v = v1;
+					v[3].x = (x + 1) * TILE_SIZE;
+					v[3].y = (y + 1) * TILE_SIZE;
+					v[3].u = u1;
+					v[3].v = v1;
+					vertex += 4;
+				}
+			}
+
+			chunks[chunk].numvertices[layer] = vertex - chunks[chunk].firstvertex[layer];
+		}
+	}
+
+	packatlas_t *atlas = (packatlas_t*)(pack + header.sections[SECTION_ATLAS].offset);
+	const char *slash = strrchr(atlasname, '/');
+	snprintf(atlas->name, sizeof(atlas->name), "%s", slash ? slash + 1 : atlasname);
+	atlas->tilew = tilew;
+	atlas->tileh = tileh;
+	atlas->tilesize = TILE_SIZE;
+	atlas->crc = atlascrc;
+
+	header.crc = LevelPack_Crc(0, pack + sizeof(packheader_t), header.filesize - sizeof(packheader_t));
+	memcpy(pack, &header, sizeof(header));
+
+	*size = header.filesize;
+	return pack;
+}
+
+// maps the pack and checks it can be used as it is. the checksum means
+// reading the whole file, it can be left out when the pack has already been
+// checked since it was written
+levelpack_t *LevelPack_Open(const char *filename, bool checkcrc, char *error, int errorsize)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		SetError(error, errorsize, "couldn't open %s", filename);
+		return NULL;
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+	if (st.st_size < (long long)sizeof(packheader_t))
+	{
+		close(fd);
+		SetError(error, errorsize, "too small for a pack");
+		return NULL;
+	}
+
+	void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		SetError(error, errorsize, "couldn't map %s", filename);
+		return NULL;
+	}
+
+	levelpack_t *pack = (levelpack_t*)calloc(1, sizeof(levelpack_t));
+	pack->base = base;
+	pack->size = st.st_size;
+
+	const packheader_t *h = (const packheader_t*)base;
+	pack->header = h;
+
+	// everything the accessors rely on is checked before they can be used
+	const char *problem = NULL;
+	long long numcells = (long long)h->mapw * h->maph;
+	if (h->magic != PACK_MAGIC)
+		problem = "not a level pack";
+	else if (h->byteorder != PACK_BYTEORDER)
+		problem = "written with the other byte order";
+	else if (h->version != PACK_VERSION)
+		problem = "a different version";
+	else if (h->headersize != sizeof(packheader_t) || h->numsections != NUM_SECTIONS)
+		problem = "a different header layout";
+	else if (h->filesize != st.st_size)
+		problem = "truncated or padded";
+	else if (h->numlayers != NUM_LAYERS || h->chunksize != CHUNK_SIZE)
+		problem = "a different number of layers or chunk size";
+	else if (h->mapw <= 0 || h->maph <= 0 || h->mapw % CHUNK_SIZE || h->maph % CHUNK_SIZE ||
+		h->chunksx != h->mapw / CHUNK_SIZE || h->chunksy != h->maph / CHUNK_SIZE)
+		problem = "a bad map size";
+
+	long long expected[NUM_SECTIONS];
+	expected[SECTION_LAYERS] = NUM_LAYERS * numcells * sizeof(int);
+	expected[SECTION_COLLISION] = PACK_FLAGS * PlaneWords(h->mapw, h->maph) * sizeof(unsigned long long);
+	expected[SECTION_CHUNKS] = (long long)h->chunksx * h->chunksy * sizeof(packchunk_t);
+	expected[SECTION_VERTICES] = -1;
+	expected[SECTION_ATLAS] = sizeof(packatlas_t);
+
+	for (int i = 0; i < NUM_SECTIONS && !problem; i++)
+	{
+		const packsection_t *s = &h->sections[i];
+		// compared so a corrupt offset or size can't overflow
+		if (s->offset < (long long)sizeof(packheader_t) || s->offset > h->filesize || s->size < 0 ||
+			s->size > h->filesize - s->offset)
+			problem = "a section outside the file";
+		else if (s->offset % PACK_ALIGN)
+			problem = "a misaligned section";
+		else if (expected[i] >= 0 && s->size != expected[i])
+			problem = "a section of the wrong size";
+		else if (i == SECTION_VERTICES && s->size % (4 * sizeof(packvertex_t)))
+			problem = "a partial tile in the vertices";
+	}
+
+	if (!problem && checkcrc && LevelPack_Crc(0, (const unsigned char*)base + sizeof(packheader_t), h->filesize - sizeof(packheader_t)) != h->crc)
+		problem = "a bad checksum";
+
+	if (!problem)
+	{
+		const unsigned char *p = (const unsigned char*)base;
+		pack->layers = (const int*)(p + h->sections[SECTION_LAYERS].offset);
+		pack->collision = (const unsigned long long*)(p + h->sections[SECTION_COLLISION].offset);
+		pack->chunks = (const packchunk_t*)(p + h->sections[SECTION_CHUNKS].offset);
+		pack->vertices = (const packvertex_t*)(p + h->sections[SECTION_VERTICES].offset);
+		pack->atlas = (const packatlas_t*)(p + h->sections[SECTION_ATLAS].offset);
+
+		// the vertex ranges are used to index the vertices directly
+		long long numvertices = h->sections[SECTION_VERTICES].size / sizeof(packvertex_t);
+		for (int i = 0; i < h->chunksx * h->chunksy && !problem; i++)
+		{
+			for (int layer = 0; layer < NUM_LAYERS; layer++)
+			{
+				const packchunk_t *c = &pack->chunks[i];
+				if (c->firstvertex[layer] < 0 || c->numvertices[layer] < 0 || c->numvertices[layer] % 4 ||
+					(long long)c->firstvertex[layer] + c->numvertices[layer] > numvertices)
+				{
+					problem = "a chunk's vertices outside the vertex section";
+					break;
+				}
+			}
+		}
+
+		if (!memchr(pack->atlas->name, 0, sizeof(pack->atlas->name)))
+			problem = "an unterminated atlas name";
+	}
+
+	if (problem)
+	{
+		SetError(error, errorsize, "%s is %s", filename, problem);
+		LevelPack_Close(pack);
+		return NULL;
+	}
+
+	return pack;
+}
+
+void LevelPack_Close(levelpack_t *pack)
+{
+	if (!pack)
+		return;
+
+	munmap(pack->base, pack->size);
+	free(pack);
+}
+
+int LevelPack_Tile(const levelpack_t *pack, int layer, int x, int y)
+{
+	long long numcells = (long long)pack->header->mapw * pack->header->maph;
+	return pack->layers[layer * numcells + (long long)y * pack->header->mapw + x];
+}
+
+// the PACK_ flags of the cell
+int LevelPack_CellFlags(const levelpack_t *pack, int x, int y)
+{
+	long long cell = (long long)y * pack->header->mapw + x;
+	long long planewords = PlaneWords(pack->header->mapw, pack->header->maph);
+
+	int flags = 0;
+	for (int f = 0; f < PACK_FLAGS; f++)
+		if ((pack->collision[f * planewords + cell / 64] >> (cell % 64)) & 1)
+			flags |= 1 << f;
+
+	return flags;
+}
+
+// vertices are relative to the chunk's bottom left corner,
+// cx * CHUNK_SIZE * TILE_SIZE, cy * CHUNK_SIZE * TILE_SIZE
+const packvertex_t *LevelPack_ChunkVertices(const levelpack_t *pack, int cx, int cy, int layer, int *numvertices)
+{
+	const packchunk_t *c = &pack->chunks[cy * pack->header->chunksx + cx];
+	*numvertices = c->numvertices[layer];
+	return pack->vertices + c->firstvertex[layer];
+}
@@ -0,0 +1,381 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+// procedural map generator
+// writes maps in the formats ed.cpp reads, generated a band of chunks at a
+// time on every core. the noise is integer only so the same seed gives the
+// same map on any machine, whatever the thread count
+//
+// mapgen [-legacy] [-threads n] <width> <height> <seed> <output>
+
+#define CHUNK_SIZE	16
+#define NUM_LAYERS	4
+#define LEGACY_MAP_SIZE	16
+
+// ==============================================
+// errors and warnings
+
+static void Error(const char *error, ...)
+{
+	va_list valist;
+	char buffer[2048];
+
+	va_start(valist, error);
+	vsprintf(buffer, error, valist);
+	va_end(valist);
+
+	fprintf(stderr, "\x1b[31m");
+	fprintf(stderr, "Error: %s", buffer);
+	fprintf(stderr, "\x1b[0m");
+	exit(1);
+}
+
+static unsigned int Sys_Milliseconds()
+{
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+
+	return tp.tv_sec * 1000 + tp.tv_usec / 1000;
+}
+
+// ________________________________________________________________________________
+// Noise
+// value noise on an integer lattice, four cells at a time using the compiler's
+// vector extensions so it maps onto sse or neon. positions are in cells and
+// the lattice spacing is a power of two up to 256 cells. values are 0-65535
+
+typedef int v4i __attribute__((vector_size(16)));
+typedef unsigned int v4u __attribute__((vector_size(16)));
+
+static v4u Hash(v4u x, v4u y, unsigned int seed)
+{
+	v4u h = x * 0x8da6b343u + y * 0xd8163841u + seed * 0xcb1ab31fu;
+	h ^= h >> 13;
+	h *= 0x85ebca6bu;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static v4i ValueNoise(v4i x, int y, int shift, unsigned int seed)
+{
+	int mask = (1 << shift) - 1;
+
+	// lattice cell and 8 bit fraction within it
+	v4i x0 = x >> shift;
+	int y0 = y >> shift;
+	v4i fx = (x & mask) << (8 - shift);
+	int fy = (y & mask) << (8 - shift);
+
+	// smoothstep, 3t^2 - 2t^3 in 8 bit fixed point
+	v4i sx = (fx * fx * (768 - 2 * fx)) >> 16;
+	int sy = (fy * fy * (768 - 2 * fy)) >> 16;
+
+	v4u ux0 = (v4u)x0;
+	v4u uy0 = (v4u)(x0 * 0 + y0);
+	v4i v00 = (v4i)(Hash(ux0, uy0, seed) >> 16);
+	v4i v10 = (v4i)(Hash(ux0 + 1, uy0, seed) >> 16);
+	v4i v01 = (v4i)(Hash(ux0, uy0 + 1, seed) >> 16);
+	v4i v11 = (v4i)(Hash(ux0 + 1, uy0 + 1, seed) >> 16);
+
+	v4i a = v00 + (((v10 - v00) * sx) >> 8);
+	v4i b = v01 + (((v11 - v01) * sx) >> 8);
+
+	return a + (((b - a) * sy) >> 8);
+}
+
+// four octaves starting at a lattice spacing of 1 << shift
+static v4i FractalNoise(v4i x, int y, int shift, unsigned int seed)
+{
+	v4i sum = x * 0;
+	int weight = 8, total = 0;
+
+	for (int i = 0; i < 4 && shift - i > 0; i++)
+	{
+		sum += ValueNoise(x, y, shift - i, seed + i) * weight;
+		total += weight;
+		weight >>= 1;
+	}
+
+	return sum / total;
+}
+
+// ________________________________________________________________________________
+// Terrain
+// the maps are side on like the built in one. there's a rolling surface with
+// solid ground below it, caves carved out of the ground, water filling the low
+// caves, ladders down some columns of the caves and fields in a few pockets
+
+// tiles from the desert tileset
+#define TILE_SKY	56
+#define TILE_SAND	47
+#define TILE_GROUND	104	// and the next two
+#define TILE_SURFACE	107
+#define TILE_WATER	37
+#define TILE_LADDER	92
+#define TILE_FIELD	55
+#define TILE_DECAL	93
+
+static int mapw;
+static int maph;
+static unsigned int seed;
+
+// the surface height of each column
+static int *surface;
+static int sealevel;
+
+static void GenerateSurface()
+{
+	surface = (int*)malloc(mapw * sizeof(int));
+
+	int base = maph * 5 / 8;
+	int amplitude = maph / 4 < 64 ? maph / 4 : 64;
+
+	for (int x = 0; x < mapw; x += 4)
+	{
+		v4i xs = { x, x + 1, x + 2, x + 3 };
+		v4i n = FractalNoise(xs, 0, 6, seed ^ 0x5f3759df);
+
+		for (int i = 0; i < 4 && x + i < mapw; i++)
+			surface[x + i] = base + ((n[i] - 32768) * amplitude) / 32768;
+	}
+
+	sealevel = base - amplitude / 2;
+}
+
+static unsigned int CellHash(int x, int y, unsigned int salt)
+{
+	v4u xs = { (unsigned int)x, 0, 0, 0 };
+	v4u ys = { (unsigned int)y, 0, 0, 0 };
+
+	return Hash(xs, ys, seed ^ salt)[0];
+}
+
+static bool IsLadderColumn(int x)
+{
+	return CellHash(x, 0, 0x1adde4) % 23 == 0;
+}
+
+// classes use the same characters as the built in map
+static void GenerateRow(int y, char *classes)
+{
+	for (int x = 0; x < mapw; x += 4)
+	{
+		v4i xs = { x, x + 1, x + 2, x + 3 };
+		v4i cave = FractalNoise(xs, y, 5, seed);
+		v4i field = ValueNoise(xs, y, 3, seed ^ 0xf1e1d);
+
+		for (int i = 0; i < 4 && x + i < mapw; i++)
+		{
+			int cx = x + i;
+			char c = '.';
+
+			// the ground is kept thick just below the surface
+			int depth = surface[cx] - y;
+			if (depth > 0)
+				c = cave[i] > 37000 + (depth < 8 ? (8 - depth) * 2000 : 0) ? '.' : '#';
+
+			if (c == '.' && y < sealevel)
+				c = 'w';
+			else if (c == '.' && depth > 0 && IsLadderColumn(cx))
+				c = 'l';
+			else if (c == '.' && depth > 0 && field[i] > 60000)
+				c = 'f';
+
+			// solid border like the built in map
+			if (cx == 0 || cx == mapw - 1 || y == 0 || y == maph - 1)
+				c = '#';
+
+			classes[cx] = c;
+		}
+	}
+}
+
+// layer 0 is the backdrop, 1 the terrain, 2 ladders and fields, 3 decoration
+static void ClassesToTiles(int y, const char *classes, const char *below, int *layers[NUM_LAYERS])
+{
+	for (int x = 0; x < mapw; x++)
+	{
+		char c = classes[x];
+
+		layers[0][x] = y >= surface[x] ? TILE_SKY : TILE_SAND;
+		layers[1][x] = 0;
+		layers[2][x] = 0;
+		layers[3][x] = 0;
+
+		if (c == '#')
+			layers[1][x] = y == surface[x] - 1 ? TILE_SURFACE : TILE_GROUND + CellHash(x, y, 0x9e0) % 3;
+		else if (c == 'w')
+			layers[1][x] = TILE_WATER;
+		else if (c == 'l')
+			layers[2][x] = TILE_LADDER;
+		else if (c == 'f')
+			layers[2][x] = TILE_FIELD;
+
+		// decoration sat on top of the ground
+		if (c == '.' && below && below[x] == '#' && CellHash(x, y, 0xdec) % 7 == 0)
+			layers[3][x] = TILE_DECAL;
+	}
+}
+
+// ________________________________________________________________________________
+// Output
+// the bands are written straight to their place in the file so the threads
+// never wait on each other
+
+static int outfd;
+static bool legacy;
+static long long headersize;
+static int numbands;
+static int nextband;
+
+static void WriteAt(const void *data, long long numbytes, long long offset)
+{
+	const char *p = (const char*)data;
+
+	while (numbytes > 0)
+	{
+		ssize_t written = pwrite(outfd, p, numbytes, offset);
+		if (written <= 0)
+			Error("Failed to write the map\n");
+
+		p += written;
+		numbytes -= written;
+		offset += written;
+	}
+}
+
+static void WriteHeader()
+{
+	if (legacy)
+		return;
+
+	char header[256];
+	int len = snprintf(header, sizeof(header), "mapw %i maph %i layers %i\ndata", mapw, maph, NUM_LAYERS);
+	WriteAt(header, len, 0);
+	headersize = len;
+}
+
+static void WriteBand(int band, int *tiles, const char *classes)
+{
+	long long y0 = (long long)band * CHUNK_SIZE;
+	long long cells = (long long)mapw * maph;
+	long long bandcells = (long long)mapw * CHUNK_SIZE;
+
+	for (int layer = 0; layer < NUM_LAYERS; layer++)
+	{
+		long long offset = headersize + (layer * cells + y0 * mapw) * sizeof(int);
+		WriteAt(tiles + layer * bandcells, bandcells * sizeof(int), offset);
+	}
+
+	// the raw format only has the tiles
+	if (!legacy)
+		WriteAt(classes, bandcells, headersize + NUM_LAYERS * cells * sizeof(int) + y0 * mapw);
+}
+
+// ________________________________________________________________________________
+// Threads
+
+static void *GenerateThread(void *arg)
+{
+	// one extra row of classes so decoration can look at the row below
+	int *tiles = (int*)malloc(NUM_LAYERS * mapw * CHUNK_SIZE * sizeof(int));
+	char *classes = (char*)malloc((CHUNK_SIZE + 1) * mapw);
+
+	while (1)
+	{
+		int band = __atomic_fetch_add(&nextband, 1, __ATOMIC_RELAXED);
+		if (band >= numbands)
+			break;
+
+		int y0 = band * CHUNK_SIZE;
+		if (y0 > 0)
+			GenerateRow(y0 - 1, classes);
+
+		for (int i = 0; i < CHUNK_SIZE; i++)
+		{
+			char *row = classes + (i + 1) * mapw;
+			int *layers[NUM_LAYERS];
+			for (int layer = 0; layer < NUM_LAYERS; layer++)
+				layers[layer] = tiles + layer * mapw * CHUNK_SIZE + i * mapw;
+
+			GenerateRow(y0 + i, row);
+			ClassesToTiles(y0 + i, row, y0 + i > 0 ? row - mapw : NULL, layers);
+		}
+
+		WriteBand(band, tiles, classes + mapw);
+	}
+
+	free(tiles);
+	free(classes);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int numthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int arg = 1;
+
+	for (; arg < argc && argv[arg][0] == '-'; arg++)
+	{
+		if (!strcmp(argv[arg], "-legacy"))
+			legacy = true;
+		else if (!strcmp(argv[arg], "-threads") && arg + 1 < argc)
+			numthreads = atoi(argv[++arg]);
+		else
+			Error("Unknown option %s\n", argv[arg]);
+	}
+
+	if (argc - arg != 4)
+	{
+		printf("usage: mapgen [-legacy] [-threads n] <width> <height> <seed> <output>\n");
+		return 1;
+	}
+
+	mapw = atoi(argv[arg + 0]);
+	maph = atoi(argv[arg + 1]);
+	seed = strtoul(argv[arg + 2], NULL, 0);
+	const char *filename = argv[arg + 3];
+
+	if (mapw <= 0 || maph <= 0 || mapw % CHUNK_SIZE || maph % CHUNK_SIZE)
+		Error("Map size %ix%i is not a multiple of %i\n", mapw, maph, CHUNK_SIZE);
+	// the editor indexes every layer's cells with an int and won't load more
+	if ((long long)NUM_LAYERS * mapw * maph > INT_MAX)
+		Error("Map size %ix%i is too big, %i layers of it must fit in %i cells\n", mapw, maph, NUM_LAYERS, INT_MAX);
+	if (legacy && (mapw != LEGACY_MAP_SIZE || maph != LEGACY_MAP_SIZE))
+		Error("The raw map format is always %ix%i\n", LEGACY_MAP_SIZE, LEGACY_MAP_SIZE);
+	if (numthreads < 1)
+		numthreads = 1;
+
+	outfd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (outfd < 0)
+		Error("Failed to open file \"%s\"\n", filename);
+
+	unsigned int starttime = Sys_Milliseconds();
+
+	WriteHeader();
+	GenerateSurface();
+	numbands = maph / CHUNK_SIZE;
+
+	pthread_t *threads = (pthread_t*)malloc(numthreads * sizeof(pthread_t));
+	for (int i = 0; i < numthreads; i++)
+		pthread_create(&threads[i], NULL, GenerateThread, NULL);
+	for (int i = 0; i < numthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	close(outfd);
+
+	unsigned int msecs = Sys_Milliseconds() - starttime;
+	double cells = (double)mapw * maph;
+	printf("%s: %ix%i, %i threads, %u ms, %.1f Mcells/s\n", filename, mapw, maph, numthreads, msecs,
+		cells / 1000.0 / (msecs ? msecs : 1));
+
+	return 0;
+}
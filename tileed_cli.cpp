@@ -0,0 +1,1503 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+// batch tool for map and tileset collections
+// runs one command over every map and tileset in the directories and files
+// given, on every core. each thread keeps its own queue of work and takes
+// from the others when it runs dry. a file is split into parts that can be
+// taken separately, so one big map doesn't hold up the rest of the batch
+//
+// tileed-cli [-threads n] [-tileset file] [-o dir] [-check] <command> <dirs or files...>
+//
+// upgrade     rewrites raw 16x16 maps with the sized map header and the
+//             built in classes, and tilesets that only give their image
+//             size with the tile counts the editor reads. raw maps are
+//             checked against -tileset, without it only the files named
+//             are taken as raw maps
+// validate    checks the header, size, tile numbers and classes of every
+//             map, the size of every tileset and the checksum of every .rle
+//             file, and prints each file's checksum. maps need -tileset
+// compress    writes <map>.rle, the cells and classes run length encoded
+// decompress  writes the map back out of a .rle file
+// export      writes <file>.tga, a tileset's image or a map at one pixel
+//             per cell coloured like the minimap. maps need -tileset
+// pack        writes <map>.pack, the level pack the game maps straight into
+//             memory, see levelpack.cpp. needs -tileset. with -check each
+//             pack is opened again the way the game does and its tiles are
+//             compared with the map's
+//
+// tga and bmp tilesets are read directly by the editor and are left alone
+
+#define CHUNK_SIZE	16
+#define NUM_LAYERS	4
+#define LEGACY_MAP_SIZE	16
+#define TILE_SIZE	16
+
+// cells handed out at a time
+#define PART_CELLS	(256 * 1024)
+
+#define MAX_THREADS	256
+
+void *LevelPack_Build(int mapw, int maph, const int *layers, const char *classes,
+	const char *atlasname, int tilew, int tileh, unsigned int atlascrc, const unsigned char (*tilealpha)[2],
+	long long *size, char *error, int errorsize);
+unsigned int LevelPack_Crc(unsigned int crc, const unsigned char *data, long long size);
+struct levelpack_t;
+levelpack_t *LevelPack_Open(const char *filename, bool checkcrc, char *error, int errorsize);
+void LevelPack_Close(levelpack_t *pack);
+int LevelPack_Tile(const levelpack_t *pack, int layer, int x, int y);
+
+// ==============================================
+// errors and warnings
+
+static void Error(const char *error, ...)
+{
+	va_list valist;
+	char buffer[2048];
+
+	va_start(valist, error);
+	vsprintf(buffer, error, valist);
+	va_end(valist);
+
+	fprintf(stderr, "\x1b[31m");
+	fprintf(stderr, "Error: %s", buffer);
+	fprintf(stderr, "\x1b[0m");
+	exit(1);
+}
+
+static unsigned int Sys_Milliseconds()
+{
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+
+	return tp.tv_sec * 1000 + tp.tv_usec / 1000;
+}
+
+// ________________________________________________________________________________
+// Files
+
+static unsigned char *ReadWholeFile(const char *filename, long long *size)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	fstat(fd, &st);
+	*size = st.st_size;
+
+	unsigned char *data = (unsigned char*)malloc(*size + 1);
+	if (!data)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	long long got = 0;
+	while (got < *size)
+	{
+		ssize_t n = read(fd, data + got, *size - got);
+		if (n <= 0)
+			break;
+		got += n;
+	}
+
+	close(fd);
+
+	if (got != *size)
+	{
+		free(data);
+		return NULL;
+	}
+
+	// so the header can be searched as a string
+	data[*size] = 0;
+	return data;
+}
+
+// written beside the destination and renamed over it so a file is never left
+// half written, even when it's rewritten in place
+static bool WriteWholeFile(const char *filename, const void **blocks, const long long *sizes, int numblocks)
+{
+	char tempname[1100];
+	snprintf(tempname, sizeof(tempname), "%s.tmp", filename);
+
+	int fd = open(tempname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+
+	for (int i = 0; i < numblocks; i++)
+	{
+		const char *p = (const char*)blocks[i];
+		long long left = sizes[i];
+		while (left > 0)
+		{
+			ssize_t written = write(fd, p, left);
+			if (written <= 0)
+			{
+				close(fd);
+				unlink(tempname);
+				return false;
+			}
+
+			p += written;
+			left -= written;
+		}
+	}
+
+	fdatasync(fd);
+	close(fd);
+
+	return rename(tempname, filename) == 0;
+}
+
+// ________________________________________________________________________________
+// Formats
+// maps are either the original raw 16x16 cell array or have a text header
+// mapw 256 maph 256 layers 4
+// data<cells><classes>
+// tilesets have a text header with the tile counts, older ones only have the
+// image size, followed by the pixels top row first
+// tilew 8 tileh 16
+// data<pixels>
+// compressed maps have the checksum of the cells and classes in the header
+// rlemap mapw 256 maph 256 layers 4 crc 12345678
+// data<cell runs><class runs>
+// a cell run is an int count and the int tile, a class run a byte count and
+// the class
+
+enum filekind_t
+{
+	KIND_UNKNOWN,
+	KIND_RAW_MAP,
+	KIND_MAP,
+	KIND_RLE_MAP,
+	KIND_TILESET
+};
+
+static const char *kindnames[] = { "unknown", "raw map", "map", "compressed map", "tileset" };
+
+#define RAW_MAP_BYTES	(NUM_LAYERS * LEGACY_MAP_SIZE * LEGACY_MAP_SIZE * (int)sizeof(int))
+
+// collision classes a map can hold
+static const char validclasses[] = "#wlf.1";
+
+// the classes the editor gives the original map
+static const char legacyclasses[] =
+"################" \
+"#wwwwwwwwwwwwww#" \
+"#wwwwwwwwwwwwww#" \
+"###########..###" \
+"#.............f#" \
+"#.1....11#####f#" \
+"#....111######f#" \
+"#.....11######f#" \
+"#.....111#####f#" \
+"#......l......f#" \
+"#......l......f#" \
+"#......l......f#" \
+"#######l##....f#" \
+"#......l......f#" \
+"#......l......f#" \
+"################";
+
+// finds the key in the header and reads the number after it
+static bool HeaderInt(const char *header, const char *key, int *value)
+{
+	const char *k = strstr(header, key);
+	if (!k)
+		return false;
+
+	k += strlen(key);
+	k += strspn(k, "\x20\x09\x0a\x0b\x0c\x0d");
+	*value = atoi(k);
+	return true;
+}
+
+// ________________________________________________________________________________
+// Jobs
+// a job is one file. it's read and checked as a whole, then its parts run
+// wherever there's a free thread and whichever finishes last writes the
+// result
+
+struct job_t;
+
+struct command_t
+{
+	const char *name;
+	int (*begin)(job_t *job);		// returns the number of parts
+	void (*part)(job_t *job, int part);
+	void (*finish)(job_t *job);
+};
+
+struct job_t
+{
+	char path[1024];
+	bool named;		// given on the command line, not found in a directory
+	unsigned char *data;
+	long long size;
+	int kind;
+
+	// from the header
+	int mapw;
+	int maph;
+	int tilew;
+	int tileh;
+	bool hastilecounts;
+	unsigned char *payload;		// past the header
+	long long payloadsize;
+
+	int numparts;
+	int partsleft;
+	unsigned int starttime;
+
+	// results, the counts are added to from every part
+	unsigned int crc;
+	int badtiles;
+	int badclasses;
+	char error[256];
+	const char *skipped;
+
+	// what each part made
+	unsigned char **partdata;
+	long long *partsize;
+	unsigned char *image;
+};
+
+static const command_t *command;
+static const char *outdir;
+static bool checkpacks;
+
+// the tileset from -tileset, for exporting and packing maps
+static const char *tilesetname;
+static int tilesetw;
+static int tileseth;
+static unsigned int tilesetcrc;
+static int numtiles;
+static unsigned char (*tilecolors)[4];
+static unsigned char (*tilealpha)[2];	// lowest and highest
+
+// totals over the batch
+static int numok;
+static int numfailed;
+static int numskipped;
+static int numignored;
+static long long totalbytes;
+
+static void JobFailed(job_t *job, const char *error, ...)
+{
+	// the first failure is the one reported
+	if (job->error[0])
+		return;
+
+	va_list valist;
+	va_start(valist, error);
+	vsnprintf(job->error, sizeof(job->error), error, valist);
+	va_end(valist);
+}
+
+// cells may not be aligned in the file
+static int Cell(const job_t *job, long long i)
+{
+	int tile;
+	memcpy(&tile, job->payload + i * sizeof(int), sizeof(int));
+	return tile;
+}
+
+static long long NumCells(const job_t *job)
+{
+	return (long long)NUM_LAYERS * job->mapw * job->maph;
+}
+
+// one class per cell of the map
+static long long NumClasses(const job_t *job)
+{
+	return (long long)job->mapw * job->maph;
+}
+
+static const char *Classes(const job_t *job)
+{
+	return (const char*)job->payload + NumCells(job) * sizeof(int);
+}
+
+static int CellParts(const job_t *job)
+{
+	return (int)((NumCells(job) + PART_CELLS - 1) / PART_CELLS);
+}
+
+// where the result for the job goes. the suffix replaces the one given
+// with strip, or is added
+static void OutputPath(const job_t *job, const char *strip, const char *suffix, char *path, int size)
+{
+	const char *slash = strrchr(job->path, '/');
+	const char *base = slash ? slash + 1 : job->path;
+
+	char name[1024];
+	snprintf(name, sizeof(name), "%s", base);
+	int len = strlen(name);
+	if (strip && len > (int)strlen(strip) && !strcmp(name + len - strlen(strip), strip))
+		name[len - strlen(strip)] = 0;
+
+	if (outdir)
+		snprintf(path, size, "%s/%s%s", outdir, name, suffix);
+	else if (slash)
+		snprintf(path, size, "%.*s/%s%s", (int)(slash - job->path), job->path, name, suffix);
+	else
+		snprintf(path, size, "%s%s", name, suffix);
+}
+
+// the file is long enough to hold the magic and starts with it
+static bool StartsWith(const job_t *job, const char *magic)
+{
+	long long len = strlen(magic);
+	return job->size >= len && !memcmp(job->data, magic, len);
+}
+
+// works out what the file is and checks its header against its size
+static void ParseFile(job_t *job)
+{
+	unsigned char *data = job->data;
+
+	if (StartsWith(job, "rlemap") || StartsWith(job, "mapw") || StartsWith(job, "tilew") || StartsWith(job, "imagew"))
+	{
+		unsigned char *p = (unsigned char*)memmem(data, job->size, "data", 4);
+		if (!p)
+		{
+			JobFailed(job, "no data block");
+			return;
+		}
+
+		// the header is only searched up to the data block
+		char header[256];
+		int headersize = p - data < (int)sizeof(header) - 1 ? p - data : (int)sizeof(header) - 1;
+		memcpy(header, data, headersize);
+		header[headersize] = 0;
+
+		job->payload = p + 4;
+		job->payloadsize = job->size - (job->payload - data);
+
+		if (StartsWith(job, "tilew") || StartsWith(job, "imagew"))
+		{
+			job->kind = KIND_TILESET;
+			job->hastilecounts = HeaderInt(header, "tilew", &job->tilew) && HeaderInt(header, "tileh", &job->tileh);
+			if (!job->hastilecounts)
+			{
+				int imagew = 0, imageh = 0;
+				if (!HeaderInt(header, "imagew", &imagew) || !HeaderInt(header, "imageh", &imageh))
+				{
+					JobFailed(job, "no tile counts or image size");
+					return;
+				}
+				if (imagew % TILE_SIZE || imageh % TILE_SIZE)
+				{
+					JobFailed(job, "image size %ix%i isn't a multiple of %i", imagew, imageh, TILE_SIZE);
+					return;
+				}
+
+				job->tilew = imagew / TILE_SIZE;
+				job->tileh = imageh / TILE_SIZE;
+			}
+
+			if (job->tilew <= 0 || job->tileh <= 0)
+				JobFailed(job, "bad tile counts %ix%i", job->tilew, job->tileh);
+			else if (job->payloadsize != (long long)job->tilew * job->tileh * TILE_SIZE * TILE_SIZE * 4)
+				JobFailed(job, "%lli bytes of pixels for %ix%i tiles", job->payloadsize, job->tilew, job->tileh);
+			return;
+		}
+
+		job->kind = StartsWith(job, "rlemap") ? KIND_RLE_MAP : KIND_MAP;
+
+		int layers = 0;
+		if (!HeaderInt(header, "mapw", &job->mapw) || !HeaderInt(header, "maph", &job->maph) ||
+			!HeaderInt(header, "layers", &layers))
+		{
+			JobFailed(job, "header is missing the size");
+			return;
+		}
+		if (job->mapw <= 0 || job->maph <= 0 || job->mapw % CHUNK_SIZE || job->maph % CHUNK_SIZE)
+		{
+			JobFailed(job, "size %ix%i isn't a multiple of %i", job->mapw, job->maph, CHUNK_SIZE);
+			return;
+		}
+		if (layers != NUM_LAYERS)
+		{
+			JobFailed(job, "%i layers instead of %i", layers, NUM_LAYERS);
+			return;
+		}
+
+		if (job->kind == KIND_RLE_MAP)
+		{
+			int crc = 0;
+			if (!HeaderInt(header, "crc", &crc))
+				JobFailed(job, "no checksum");
+			job->crc = crc;
+			return;
+		}
+
+		long long expected = NumCells(job) * sizeof(int) + NumClasses(job);
+		if (job->payloadsize < expected)
+			JobFailed(job, "truncated, %lli bytes of %lli", job->payloadsize, expected);
+		else if (job->payloadsize > expected)
+			JobFailed(job, "%lli bytes past the end of the map", job->payloadsize - expected);
+		return;
+	}
+
+	// the original map is just the cells, the editor reads any file that
+	// big without a header this way
+	if (job->size == RAW_MAP_BYTES)
+	{
+		job->kind = KIND_RAW_MAP;
+		job->mapw = LEGACY_MAP_SIZE;
+		job->maph = LEGACY_MAP_SIZE;
+		job->payload = data;
+		job->payloadsize = job->size;
+	}
+}
+
+static void ReportJob(job_t *job)
+{
+	unsigned int msecs = Sys_Milliseconds() - job->starttime;
+	double mbps = (double)job->size / 1024.0 / 1024.0 / (msecs ? msecs : 1) * 1000.0;
+
+	// one printf per line so lines from different threads don't mix
+	if (job->error[0])
+	{
+		__atomic_add_fetch(&numfailed, 1, __ATOMIC_RELAXED);
+		printf("%s: FAILED, %s\n", job->path, job->error);
+	}
+	else if (job->skipped)
+	{
+		__atomic_add_fetch(&numskipped, 1, __ATOMIC_RELAXED);
+		printf("%s: skipped, %s\n", job->path, job->skipped);
+	}
+	else
+	{
+		__atomic_add_fetch(&numok, 1, __ATOMIC_RELAXED);
+		printf("%s: %s %s, crc %08x, %lli kb, %u ms, %.1f mb/s\n", job->path, command->name,
+			kindnames[job->kind], job->crc, job->size / 1024, msecs, mbps);
+	}
+
+	__atomic_add_fetch(&totalbytes, job->size, __ATOMIC_RELAXED);
+}
+
+static void FreeJob(job_t *job)
+{
+	if (job->partdata)
+		for (int i = 0; i < job->numparts; i++)
+			free(job->partdata[i]);
+
+	free(job->partdata);
+	free(job->partsize);
+	free(job->image);
+	free(job->data);
+	free(job);
+}
+
+// ________________________________________________________________________________
+// Work stealing
+// each thread has a deque of tasks. it takes its own newest task first, so a
+// file's parts run while its data is still in the cache, and takes the oldest
+// task of another thread when its own run out. a task is a whole file until
+// it has been read, and then a part of it. a thread that finds nothing to
+// take sleeps until a task is pushed or the last one finishes
+
+struct task_t
+{
+	job_t *job;
+	int part;	// -1 for the whole file
+};
+
+struct worker_t
+{
+	pthread_mutex_t lock;
+	task_t *tasks;
+	int head;	// oldest, where tasks are stolen from
+	int tail;	// one past the newest
+	int maxtasks;
+	int steals;
+	pthread_t thread;
+};
+
+static worker_t workers[MAX_THREADS];
+static int numworkers;
+
+// queued and running tasks, a thread only stops once this reaches 0
+static int pendingtasks;
+
+// counts pushes so a thread can tell if one came while it was looking
+static pthread_mutex_t idlelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idlecond = PTHREAD_COND_INITIALIZER;
+static unsigned int numpushes;
+
+static __thread int currentworker;
+
+static void PushTask(int worker, job_t *job, int part)
+{
+	worker_t *w = &workers[worker];
+	__atomic_add_fetch(&pendingtasks, 1, __ATOMIC_ACQ_REL);
+
+	pthread_mutex_lock(&w->lock);
+	if (w->tail == w->maxtasks)
+	{
+		if (w->head)
+		{
+			memmove(w->tasks, w->tasks + w->head, (w->tail - w->head) * sizeof(task_t));
+			w->tail -= w->head;
+			w->head = 0;
+		}
+		else
+		{
+			w->maxtasks = w->maxtasks ? w->maxtasks * 2 : 256;
+			w->tasks = (task_t*)realloc(w->tasks, w->maxtasks * sizeof(task_t));
+		}
+	}
+
+	w->tasks[w->tail].job = job;
+	w->tasks[w->tail].part = part;
+	w->tail++;
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_mutex_lock(&idlelock);
+	__atomic_add_fetch(&numpushes, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&idlecond);
+	pthread_mutex_unlock(&idlelock);
+}
+
+static bool PopTask(int worker, task_t *task)
+{
+	worker_t *w = &workers[worker];
+	bool found = false;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->tail > w->head)
+	{
+		*task = w->tasks[--w->tail];
+		found = true;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return found;
+}
+
+static bool StealTask(int victim, task_t *task)
+{
+	worker_t *w = &workers[victim];
+	bool found = false;
+
+	// checked without the lock first so idle threads don't queue on it
+	if (__atomic_load_n(&w->tail, __ATOMIC_RELAXED) == __atomic_load_n(&w->head, __ATOMIC_RELAXED))
+		return false;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->tail > w->head)
+	{
+		*task = w->tasks[w->head++];
+		found = true;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return found;
+}
+
+static void PartDone(job_t *job)
+{
+	if (__atomic_sub_fetch(&job->partsleft, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (!job->error[0] && command->finish)
+		command->finish(job);
+
+	ReportJob(job);
+	FreeJob(job);
+}
+
+static void RunFile(job_t *job)
+{
+	job->starttime = Sys_Milliseconds();
+
+	job->data = ReadWholeFile(job->path, &job->size);
+	if (!job->data)
+	{
+		JobFailed(job, "couldn't read the file");
+		ReportJob(job);
+		FreeJob(job);
+		return;
+	}
+
+	ParseFile(job);
+
+	// anything that isn't a map or tileset is left out of the report
+	if (job->kind == KIND_UNKNOWN && !job->error[0])
+	{
+		__atomic_add_fetch(&numignored, 1, __ATOMIC_RELAXED);
+		FreeJob(job);
+		return;
+	}
+
+	if (!job->error[0])
+		job->numparts = command->begin(job);
+
+	if (job->error[0] || job->skipped || !job->numparts)
+	{
+		ReportJob(job);
+		FreeJob(job);
+		return;
+	}
+
+	job->partdata = (unsigned char**)calloc(job->numparts, sizeof(unsigned char*));
+	job->partsize = (long long*)calloc(job->numparts, sizeof(long long));
+	job->partsleft = job->numparts;
+
+	// the other parts are left for whoever gets to them first
+	for (int i = job->numparts - 1; i > 0; i--)
+		PushTask(currentworker, job, i);
+
+	command->part(job, 0);
+	PartDone(job);
+}
+
+static void RunTask(task_t *task)
+{
+	if (task->part < 0)
+		RunFile(task->job);
+	else
+	{
+		command->part(task->job, task->part);
+		PartDone(task->job);
+	}
+}
+
+static void *WorkerThread(void *arg)
+{
+	currentworker = (int)(size_t)arg;
+
+	while (1)
+	{
+		unsigned int pushes = __atomic_load_n(&numpushes, __ATOMIC_ACQUIRE);
+
+		task_t task;
+		bool found = PopTask(currentworker, &task);
+
+		for (int i = 1; i < numworkers && !found; i++)
+		{
+			int victim = (currentworker + i) % numworkers;
+			found = StealTask(victim, &task);
+			if (found)
+				workers[currentworker].steals++;
+		}
+
+		if (found)
+		{
+			RunTask(&task);
+
+			// wakes the others to stop
+			if (!__atomic_sub_fetch(&pendingtasks, 1, __ATOMIC_ACQ_REL))
+			{
+				pthread_mutex_lock(&idlelock);
+				pthread_cond_broadcast(&idlecond);
+				pthread_mutex_unlock(&idlelock);
+			}
+			continue;
+		}
+
+		// tasks are only added by running tasks, so with none left
+		// nothing more can turn up
+		pthread_mutex_lock(&idlelock);
+		while (numpushes == pushes && __atomic_load_n(&pendingtasks, __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&idlecond, &idlelock);
+		bool done = !__atomic_load_n(&pendingtasks, __ATOMIC_ACQUIRE);
+		pthread_mutex_unlock(&idlelock);
+
+		if (done)
+			break;
+	}
+
+	return NULL;
+}
+
+// ________________________________________________________________________________
+// Upgrade
+
+// any file of the right size looks like a raw map, so it's only rewritten if
+// its cells are tiles. without a tileset to check them against that isn't
+// enough, and only files named on the command line are taken as raw maps
+static int UpgradeBegin(job_t *job)
+{
+	if (job->kind == KIND_RAW_MAP)
+	{
+		for (long long i = 0; i < NumCells(job); i++)
+		{
+			int tile = Cell(job, i);
+			if (tile < 0 || (numtiles && tile >= numtiles))
+			{
+				job->skipped = "not a raw map, it has cells that aren't tiles";
+				return 0;
+			}
+		}
+
+		if (!numtiles && !job->named)
+		{
+			job->skipped = "might not be a raw map, name it or give -tileset to check its tiles";
+			return 0;
+		}
+
+		return 1;
+	}
+
+	if (job->kind == KIND_TILESET && !job->hastilecounts)
+		return 1;
+
+	job->skipped = "already current";
+	return 0;
+}
+
+static void UpgradePart(job_t *job, int part)
+{
+	char header[256];
+	char outpath[1100];
+	OutputPath(job, NULL, "", outpath, sizeof(outpath));
+
+	const void *blocks[3];
+	long long sizes[3];
+	int numblocks = 0;
+
+	if (job->kind == KIND_RAW_MAP)
+	{
+		sizes[0] = snprintf(header, sizeof(header), "mapw %i maph %i layers %i\ndata", job->mapw, job->maph, NUM_LAYERS);
+		blocks[0] = header;
+		blocks[1] = job->payload;
+		sizes[1] = job->payloadsize;
+		blocks[2] = legacyclasses;
+		sizes[2] = LEGACY_MAP_SIZE * LEGACY_MAP_SIZE;
+		numblocks = 3;
+	}
+	else
+	{
+		sizes[0] = snprintf(header, sizeof(header), "tilew %i tileh %i\ndata", job->tilew, job->tileh);
+		blocks[0] = header;
+		blocks[1] = job->payload;
+		sizes[1] = job->payloadsize;
+		numblocks = 2;
+	}
+
+	job->crc = LevelPack_Crc(0, job->payload, job->payloadsize);
+	if (!WriteWholeFile(outpath, blocks, sizes, numblocks))
+		JobFailed(job, "couldn't write \"%s\"", outpath);
+}
+
+// ________________________________________________________________________________
+// Validate
+
+// the tiles of a map can only be checked against a tileset, without one it
+// isn't reported as valid
+static int ValidateBegin(job_t *job)
+{
+	if (job->kind != KIND_TILESET && !numtiles)
+	{
+		JobFailed(job, "checking the tile numbers needs -tileset");
+		return 0;
+	}
+
+	if (job->kind == KIND_RAW_MAP || job->kind == KIND_MAP)
+		return CellParts(job);
+
+	return 1;
+}
+
+static bool DecodeRle(job_t *job, unsigned char *out);
+
+static void ValidatePart(job_t *job, int part)
+{
+	if (job->kind == KIND_TILESET)
+	{
+		job->crc = LevelPack_Crc(0, job->payload, job->payloadsize);
+		return;
+	}
+
+	if (job->kind == KIND_RLE_MAP)
+	{
+		long long size = NumCells(job) * sizeof(int) + NumClasses(job);
+		unsigned char *out = (unsigned char*)malloc(size);
+		if (!out)
+		{
+			JobFailed(job, "out of memory");
+			return;
+		}
+
+		if (DecodeRle(job, out))
+		{
+			unsigned int crc = LevelPack_Crc(0, out, size);
+			if (crc != job->crc)
+				JobFailed(job, "checksum %08x doesn't match %08x", crc, job->crc);
+
+			int bad = 0;
+			for (long long i = 0; i < NumCells(job); i++)
+			{
+				int tile;
+				memcpy(&tile, out + i * sizeof(int), sizeof(int));
+				if (tile < 0 || tile >= numtiles)
+					bad++;
+			}
+			job->badtiles = bad;
+		}
+		free(out);
+		return;
+	}
+
+	// the first part also does the checksum and the classes while the
+	// others check the cells
+	if (!part)
+	{
+		job->crc = LevelPack_Crc(0, job->payload, job->payloadsize);
+
+		if (job->kind == KIND_MAP)
+		{
+			const char *classes = Classes(job);
+			int bad = 0;
+			for (long long i = 0; i < NumClasses(job); i++)
+				if (!classes[i] || !strchr(validclasses, classes[i]))
+					bad++;
+			__atomic_add_fetch(&job->badclasses, bad, __ATOMIC_RELAXED);
+		}
+	}
+
+	long long first = (long long)part * PART_CELLS;
+	long long last = first + PART_CELLS < NumCells(job) ? first + PART_CELLS : NumCells(job);
+	int bad = 0;
+	for (long long i = first; i < last; i++)
+	{
+		int tile = Cell(job, i);
+		if (tile < 0 || tile >= numtiles)
+			bad++;
+	}
+	__atomic_add_fetch(&job->badtiles, bad, __ATOMIC_RELAXED);
+}
+
+static void ValidateFinish(job_t *job)
+{
+	if (job->badtiles)
+		JobFailed(job, "%i cells have tiles outside the tileset", job->badtiles);
+	else if (job->badclasses)
+		JobFailed(job, "%i cells have unknown classes", job->badclasses);
+}
+
+// ________________________________________________________________________________
+// Compress
+// each part encodes its own cells, a run can't cross from one part into the
+// next. the classes are encoded by the first part
+
+struct cellrun_t
+{
+	int count;
+	int tile;
+};
+
+static int CompressBegin(job_t *job)
+{
+	if (job->kind == KIND_MAP)
+		return CellParts(job);
+
+	if (job->kind == KIND_RAW_MAP)
+		job->skipped = "raw maps have no classes, upgrade it first";
+	else
+		job->skipped = "not a map";
+	return 0;
+}
+
+static void CompressPart(job_t *job, int part)
+{
+	long long first = (long long)part * PART_CELLS;
+	long long last = first + PART_CELLS < NumCells(job) ? first + PART_CELLS : NumCells(job);
+
+	cellrun_t *runs = (cellrun_t*)malloc((last - first) * sizeof(cellrun_t));
+	if (!runs)
+	{
+		JobFailed(job, "out of memory");
+		return;
+	}
+
+	int numruns = 0;
+	for (long long i = first; i < last; i++)
+	{
+		int tile = Cell(job, i);
+		if (numruns && runs[numruns - 1].tile == tile)
+			runs[numruns - 1].count++;
+		else
+		{
+			runs[numruns].count = 1;
+			runs[numruns].tile = tile;
+			numruns++;
+		}
+	}
+
+	job->partdata[part] = (unsigned char*)runs;
+	job->partsize[part] = numruns * sizeof(cellrun_t);
+
+	if (part)
+		return;
+
+	job->crc = LevelPack_Crc(0, job->payload, job->payloadsize);
+}
+
+static void CompressFinish(job_t *job)
+{
+	// class runs are a byte count and the class
+	const char *classes = Classes(job);
+	long long numcells = NumClasses(job);
+	unsigned char *classruns = (unsigned char*)malloc(numcells * 2);
+	if (!classruns)
+	{
+		JobFailed(job, "out of memory");
+		return;
+	}
+
+	long long size = 0;
+	for (long long i = 0; i < numcells; i++)
+	{
+		if (size && classruns[size - 1] == (unsigned char)classes[i] && classruns[size - 2] < 255)
+			classruns[size - 2]++;
+		else
+		{
+			classruns[size++] = 1;
+			classruns[size++] = classes[i];
+		}
+	}
+
+	char header[256];
+	int headersize = snprintf(header, sizeof(header), "rlemap mapw %i maph %i layers %i crc %i\ndata",
+		job->mapw, job->maph, NUM_LAYERS, (int)job->crc);
+
+	int numblocks = job->numparts + 2;
+	const void **blocks = (const void**)malloc(numblocks * sizeof(void*));
+	long long *sizes = (long long*)malloc(numblocks * sizeof(long long));
+	blocks[0] = header;
+	sizes[0] = headersize;
+	for (int i = 0; i < job->numparts; i++)
+	{
+		blocks[i + 1] = job->partdata[i];
+		sizes[i + 1] = job->partsize[i];
+	}
+	blocks[numblocks - 1] = classruns;
+	sizes[numblocks - 1] = size;
+
+	char outpath[1100];
+	OutputPath(job, NULL, ".rle", outpath, sizeof(outpath));
+	if (!WriteWholeFile(outpath, blocks, sizes, numblocks))
+		JobFailed(job, "couldn't write \"%s\"", outpath);
+
+	free(blocks);
+	free(sizes);
+	free(classruns);
+}
+
+// ________________________________________________________________________________
+// Decompress
+
+// writes the cells and then the classes to out, returns false if the runs
+// don't add up to the map
+static bool DecodeRle(job_t *job, unsigned char *out)
+{
+	const unsigned char *p = job->payload;
+	const unsigned char *end = job->payload + job->payloadsize;
+
+	long long numcells = NumCells(job);
+	for (long long i = 0; i < numcells;)
+	{
+		cellrun_t run;
+		if (end - p < (long long)sizeof(run))
+		{
+			JobFailed(job, "cell runs end early");
+			return false;
+		}
+
+		memcpy(&run, p, sizeof(run));
+		p += sizeof(run);
+		if (run.count <= 0 || run.count > numcells - i)
+		{
+			JobFailed(job, "bad cell run");
+			return false;
+		}
+
+		for (int j = 0; j < run.count; j++, i++)
+			memcpy(out + i * sizeof(int), &run.tile, sizeof(int));
+	}
+
+	char *classes = (char*)out + numcells * sizeof(int);
+	long long numclasses = NumClasses(job);
+	for (long long i = 0; i < numclasses;)
+	{
+		if (end - p < 2 || !p[0] || p[0] > numclasses - i)
+		{
+			JobFailed(job, "bad class run");
+			return false;
+		}
+
+		memset(classes + i, p[1], p[0]);
+		i += p[0];
+		p += 2;
+	}
+
+	if (p != end)
+	{
+		JobFailed(job, "%i bytes past the runs", (int)(end - p));
+		return false;
+	}
+
+	return true;
+}
+
+static int DecompressBegin(job_t *job)
+{
+	if (job->kind == KIND_RLE_MAP)
+		return 1;
+
+	job->skipped = "not compressed";
+	return 0;
+}
+
+static void DecompressPart(job_t *job, int part)
+{
+	long long size = NumCells(job) * sizeof(int) + NumClasses(job);
+	unsigned char *out = (unsigned char*)malloc(size);
+	job->partdata[0] = out;
+	if (!out)
+	{
+		JobFailed(job, "out of memory");
+		return;
+	}
+
+	if (!DecodeRle(job, out))
+		return;
+
+	unsigned int crc = LevelPack_Crc(0, out, size);
+	if (crc != job->crc)
+	{
+		JobFailed(job, "checksum %08x doesn't match %08x", crc, job->crc);
+		return;
+	}
+
+	char header[256];
+	const void *blocks[2] = { header, out };
+	long long sizes[2];
+	sizes[0] = snprintf(header, sizeof(header), "mapw %i maph %i layers %i\ndata", job->mapw, job->maph, NUM_LAYERS);
+	sizes[1] = size;
+
+	char outpath[1100];
+	OutputPath(job, ".rle", "", outpath, sizeof(outpath));
+	if (!WriteWholeFile(outpath, blocks, sizes, 2))
+		JobFailed(job, "couldn't write \"%s\"", outpath);
+}
+
+// ________________________________________________________________________________
+// Export
+// 32 bit tga. maps have row 0 at the bottom like tga does, tilesets are
+// stored top row first
+
+static void TgaHeader(unsigned char *header, int w, int h, bool topfirst)
+{
+	memset(header, 0, 18);
+	header[2] = 2;		// uncompressed true colour
+	header[12] = w & 0xff;
+	header[13] = w >> 8;
+	header[14] = h & 0xff;
+	header[15] = h >> 8;
+	header[16] = 32;
+	header[17] = 8 | (topfirst ? 0x20 : 0);
+}
+
+// average colour of each tile, weighted by alpha like the editor does, and
+// the range of its alpha
+static void LoadTileColors(const char *filename)
+{
+	job_t job;
+	memset(&job, 0, sizeof(job));
+	snprintf(job.path, sizeof(job.path), "%s", filename);
+
+	job.data = ReadWholeFile(filename, &job.size);
+	if (!job.data)
+		Error("Failed to open file \"%s\"\n", filename);
+
+	ParseFile(&job);
+	if (job.kind != KIND_TILESET || job.error[0])
+		Error("\"%s\" isn't a tileset %s\n", filename, job.error);
+
+	tilesetw = job.tilew;
+	tileseth = job.tileh;
+	tilesetcrc = LevelPack_Crc(0, job.payload, job.payloadsize);
+	numtiles = job.tilew * job.tileh;
+	tilecolors = (unsigned char(*)[4])malloc(numtiles * 4);
+	tilealpha = (unsigned char(*)[2])malloc(numtiles * 2);
+	if (!tilecolors || !tilealpha)
+		Error("Out of memory for the colours of \"%s\"\n", filename);
+
+	int imagew = job.tilew * TILE_SIZE;
+	for (int tile = 0; tile < numtiles; tile++)
+	{
+		// tile 0 is at the bottom left once the editor flips the image
+		int x0 = (tile % job.tilew) * TILE_SIZE;
+		int y0 = (job.tileh - 1 - tile / job.tilew) * TILE_SIZE;
+		int sum[4] = { 0, 0, 0, 0 };
+		int minalpha = 255, maxalpha = 0;
+
+		for (int y = y0; y < y0 + TILE_SIZE; y++)
+		{
+			for (int x = x0; x < x0 + TILE_SIZE; x++)
+			{
+				const unsigned char *p = job.payload + (y * imagew + x) * 4;
+				sum[0] += p[0] * p[3];
+				sum[1] += p[1] * p[3];
+				sum[2] += p[2] * p[3];
+				sum[3] += p[3];
+				if (p[3] < minalpha)
+					minalpha = p[3];
+				if (p[3] > maxalpha)
+					maxalpha = p[3];
+			}
+		}
+
+		for (int i = 0; i < 3; i++)
+			tilecolors[tile][i] = sum[3] ? sum[i] / sum[3] : 0;
+		tilecolors[tile][3] = sum[3] / (TILE_SIZE * TILE_SIZE);
+		tilealpha[tile][0] = minalpha;
+		tilealpha[tile][1] = maxalpha;
+	}
+
+	free(job.data);
+}
+
+static int ExportBegin(job_t *job)
+{
+	// checked before anything is composited, a tga is at most 65535 a side
+	if (job->kind == KIND_TILESET ?
+		job->tilew * TILE_SIZE > 65535 || job->tileh * TILE_SIZE > 65535 :
+		job->mapw > 65535 || job->maph > 65535)
+	{
+		job->skipped = "too big for a tga";
+		return 0;
+	}
+
+	if (job->kind == KIND_TILESET)
+		return 1;
+
+	if (job->kind == KIND_RLE_MAP)
+	{
+		job->skipped = "decompress it first";
+		return 0;
+	}
+
+	if (!tilecolors)
+	{
+		JobFailed(job, "exporting a map needs -tileset");
+		return 0;
+	}
+
+	job->image = (unsigned char*)malloc(NumClasses(job) * 4);
+	if (!job->image)
+	{
+		JobFailed(job, "out of memory");
+		return 0;
+	}
+
+	return (job->maph + CHUNK_SIZE - 1) / CHUNK_SIZE;
+}
+
+// a chunk row of the map, composited over white like the minimap
+static void ExportPart(job_t *job, int part)
+{
+	if (job->kind == KIND_TILESET)
+	{
+		job->crc = LevelPack_Crc(0, job->payload, job->payloadsize);
+		return;
+	}
+
+	long long layercells = NumClasses(job);
+	for (int y = part * CHUNK_SIZE; y < (part + 1) * CHUNK_SIZE && y < job->maph; y++)
+	{
+		for (int x = 0; x < job->mapw; x++)
+		{
+			float c[3] = { 1, 1, 1 };
+			for (int layer = 0; layer < NUM_LAYERS; layer++)
+			{
+				int tile = Cell(job, layer * layercells + (long long)y * job->mapw + x);
+				if (tile <= 0 || tile >= numtiles || !tilecolors[tile][3])
+					continue;
+
+				float a = tilecolors[tile][3] / 255.0f;
+				for (int i = 0; i < 3; i++)
+					c[i] = c[i] * (1 - a) + (tilecolors[tile][i] / 255.0f) * a;
+			}
+
+			// tga is bgra
+			unsigned char *p = job->image + ((long long)y * job->mapw + x) * 4;
+			p[0] = c[2] * 255;
+			p[1] = c[1] * 255;
+			p[2] = c[0] * 255;
+			p[3] = 255;
+		}
+	}
+}
+
+static void ExportFinish(job_t *job)
+{
+	unsigned char header[18];
+	const void *blocks[2] = { header, NULL };
+	long long sizes[2] = { 18, 0 };
+
+	if (job->kind == KIND_TILESET)
+	{
+		int w = job->tilew * TILE_SIZE;
+		int h = job->tileh * TILE_SIZE;
+		TgaHeader(header, w, h, true);
+
+		// rgba to bgra
+		job->image = (unsigned char*)malloc(job->payloadsize);
+		if (!job->image)
+		{
+			JobFailed(job, "out of memory");
+			return;
+		}
+
+		for (long long i = 0; i < job->payloadsize; i += 4)
+		{
+			job->image[i + 0] = job->payload[i + 2];
+			job->image[i + 1] = job->payload[i + 1];
+			job->image[i + 2] = job->payload[i + 0];
+			job->image[i + 3] = job->payload[i + 3];
+		}
+		sizes[1] = job->payloadsize;
+	}
+	else
+	{
+		TgaHeader(header, job->mapw, job->maph, false);
+		job->crc = LevelPack_Crc(0, job->payload, job->payloadsize);
+		sizes[1] = NumClasses(job) * 4;
+	}
+	blocks[1] = job->image;
+
+	char outpath[1100];
+	OutputPath(job, NULL, ".tga", outpath, sizeof(outpath));
+	if (!WriteWholeFile(outpath, blocks, sizes, 2))
+		JobFailed(job, "couldn't write \"%s\"", outpath);
+}
+
+// ________________________________________________________________________________
+// Pack
+// the whole pack is laid out at once so a map is a single part
+
+static int PackBegin(job_t *job)
+{
+	if (job->kind != KIND_MAP && job->kind != KIND_RAW_MAP)
+	{
+		job->skipped = job->kind == KIND_RLE_MAP ? "decompress it first" : "not a map";
+		return 0;
+	}
+
+	if (!tilealpha)
+	{
+		JobFailed(job, "packing a map needs -tileset");
+		return 0;
+	}
+
+	return 1;
+}
+
+// opens the written pack with the checksum checked and compares every tile
+static void CheckPack(job_t *job, const char *path)
+{
+	char error[256];
+	levelpack_t *pack = LevelPack_Open(path, true, error, sizeof(error));
+	if (!pack)
+	{
+		JobFailed(job, "the written pack doesn't open, %s", error);
+		return;
+	}
+
+	long long layercells = NumClasses(job);
+	long long bad = 0;
+	for (int layer = 0; layer < NUM_LAYERS; layer++)
+		for (int y = 0; y < job->maph; y++)
+			for (int x = 0; x < job->mapw; x++)
+				if (LevelPack_Tile(pack, layer, x, y) != Cell(job, layer * layercells + (long long)y * job->mapw + x))
+					bad++;
+	LevelPack_Close(pack);
+
+	if (bad)
+		JobFailed(job, "\"%s\" has %lli cells that don't match the map", path, bad);
+}
+
+static void PackPart(job_t *job, int part)
+{
+	// the cells may not be aligned in the file
+	int *layers = (int*)malloc(NumCells(job) * sizeof(int));
+	if (!layers)
+	{
+		JobFailed(job, "out of memory");
+		return;
+	}
+
+	memcpy(layers, job->payload, NumCells(job) * sizeof(int));
+	const char *classes = job->kind == KIND_RAW_MAP ? legacyclasses : Classes(job);
+
+	char error[256];
+	long long size;
+	void *pack = LevelPack_Build(job->mapw, job->maph, layers, classes, tilesetname, tilesetw, tileseth,
+		tilesetcrc, tilealpha, &size, error, sizeof(error));
+	free(layers);
+	if (!pack)
+	{
+		JobFailed(job, "%s", error);
+		return;
+	}
+
+	job->crc = LevelPack_Crc(0, job->payload, job->payloadsize);
+
+	char outpath[1100];
+	OutputPath(job, NULL, ".pack", outpath, sizeof(outpath));
+	const void *blocks[1] = { pack };
+	if (!WriteWholeFile(outpath, blocks, &size, 1))
+		JobFailed(job, "couldn't write \"%s\"", outpath);
+	else if (checkpacks)
+		CheckPack(job, outpath);
+
+	free(pack);
+}
+
+// ________________________________________________________________________________
+// Main
+
+static const command_t commands[] =
+{
+	{ "upgrade", UpgradeBegin, UpgradePart, NULL },
+	{ "validate", ValidateBegin, ValidatePart, ValidateFinish },
+	{ "compress", CompressBegin, CompressPart, CompressFinish },
+	{ "decompress", DecompressBegin, DecompressPart, NULL },
+	{ "export", ExportBegin, ExportPart, ExportFinish },
+	{ "pack", PackBegin, PackPart, NULL },
+};
+
+static int numjobs;
+
+static bool IsOutput(const char *name)
+{
+	int len = strlen(name);
+	return (len > 4 && (!strcmp(name + len - 4, ".tmp") || !strcmp(name + len - 4, ".tga"))) ||
+		(len > 5 && !strcmp(name + len - 5, ".pack"));
+}
+
+// the files are dealt out to the threads in turn to start with
+static void AddFile(const char *path, bool named)
+{
+	job_t *job = (job_t*)calloc(1, sizeof(job_t));
+	snprintf(job->path, sizeof(job->path), "%s", path);
+	job->named = named;
+
+	PushTask(numjobs % numworkers, job, -1);
+	numjobs++;
+}
+
+// every file in a directory, not the ones below it
+static void AddPath(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st))
+		Error("Can't find \"%s\"\n", path);
+
+	if (!S_ISDIR(st.st_mode))
+	{
+		AddFile(path, true);
+		return;
+	}
+
+	DIR *dir = opendir(path);
+	if (!dir)
+		Error("Can't read directory \"%s\"\n", path);
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)))
+	{
+		if (entry->d_name[0] == '.' || IsOutput(entry->d_name))
+			continue;
+
+		char filename[1024];
+		snprintf(filename, sizeof(filename), "%s/%s", path, entry->d_name);
+		if (!stat(filename, &st) && S_ISREG(st.st_mode))
+			AddFile(filename, false);
+	}
+
+	closedir(dir);
+}
+
+int main(int argc, char *argv[])
+{
+	int numthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int arg = 1;
+
+	for (; arg < argc && argv[arg][0] == '-'; arg++)
+	{
+		if (!strcmp(argv[arg], "-threads") && arg + 1 < argc)
+			numthreads = atoi(argv[++arg]);
+		else if (!strcmp(argv[arg], "-tileset") && arg + 1 < argc)
+			tilesetname = argv[++arg];
+		else if (!strcmp(argv[arg], "-o") && arg + 1 < argc)
+			outdir = argv[++arg];
+		else if (!strcmp(argv[arg], "-check"))
+			checkpacks = true;
+		else
+			Error("Unknown option %s\n", argv[arg]);
+	}
+
+	if (argc - arg < 2)
+	{
+		printf("usage: tileed-cli [-threads n] [-tileset file] [-o dir] [-check] <command> <dirs or files...>\n");
+		printf("commands: upgrade validate compress decompress export pack\n");
+		return 1;
+	}
+
+	for (unsigned int i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+		if (!strcmp(argv[arg], commands[i].name))
+			command = &commands[i];
+	if (!command)
+		Error("Unknown command %s\n", argv[arg]);
+	arg++;
+
+	if (numthreads < 1)
+		numthreads = 1;
+	if (numthreads > MAX_THREADS)
+		numthreads = MAX_THREADS;
+	numworkers = numthreads;
+
+	if (tilesetname)
+		LoadTileColors(tilesetname);
+
+	for (int i = 0; i < numworkers; i++)
+		pthread_mutex_init(&workers[i].lock, NULL);
+	for (; arg < argc; arg++)
+		AddPath(argv[arg]);
+
+	unsigned int starttime = Sys_Milliseconds();
+
+	for (int i = 0; i < numworkers; i++)
+		pthread_create(&workers[i].thread, NULL, WorkerThread, (void*)(size_t)i);
+
+	int steals = 0;
+	for (int i = 0; i < numworkers; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		steals += workers[i].steals;
+	}
+
+	unsigned int msecs = Sys_Milliseconds() - starttime;
+	printf("%s: %i ok, %i failed, %i skipped, %i not maps or tilesets\n", command->name, numok, numfailed, numskipped, numignored);
+	printf("%lli kb in %u ms, %.1f mb/s, %i threads, %i tasks stolen\n", totalbytes / 1024, msecs,
+		(double)totalbytes / 1024.0 / 1024.0 / (msecs ? msecs : 1) * 1000.0, numworkers, steals);
+
+	return numfailed ? 1 : 0;
+}